@@ -0,0 +1,80 @@
+// Archives input files into the decoded/ subdirectory of the input
+// directory in a background thread, so that slow metadata operations on a
+// busy filesystem don't hold up decoding.
+//
+// Both directories are held open, and files are moved with renameat(), so
+// no path names are looked up or built.  A file is only archived once the
+// subrun its data went into has been written out (and, with checkpoints,
+// made durable and checkpointed), so a crash can never lose data from a
+// file that has already been archived.  Until then the file stays in the
+// input directory, where the reader knows to skip it.  After each round of
+// renames both directories are fsynced.
+//
+// Optionally, archived files are compressed, one at a time between rounds
+// of renames, to decoded/'name'.done.ebz (see Compress.h).  Files archived
+// uncompressed, as by an earlier run, and compressions cut short by a crash
+// are picked up when the archiver starts.
+//
+// Optionally, archived files are deleted once they are old enough.
+
+class FileArchiver {
+
+public:
+
+  FileArchiver();
+
+  // Opens 'inputdir' and its decoded/ subdirectory, creating that if need
+  // be, and starts the background thread.  If 'retention' is non-zero,
+  // archived files are deleted 'retention' seconds after they were last
+  // modified.  If 'compress', archived files are compressed.  Exits via
+  // LOG_CRIT on failure.
+  void Start(const std::string & inputdir, const unsigned int retention,
+             const bool compress);
+
+  bool IsOn() const { return started; }
+
+  // Queues file 'name', in the input directory, to become
+  // decoded/'name'.done once subrun 'subrun' is released.  Thread-safe.
+  void Archive(const std::string & name, const unsigned int subrun);
+
+  // Queues file decoded/'name', put there other than by Archive(), to be
+  // compressed, if archived files are.  Thread-safe.
+  void Compress(const std::string & name);
+
+  // Lets files of subruns up to and including 'subrun' be archived.  For
+  // the writer, once the subrun is safely written out.  Thread-safe.
+  void Release(const unsigned int subrun);
+
+  // Archives the files of released subruns still queued, compresses the
+  // files archived since starting, and stops the background thread.  Files
+  // of unreleased subruns stay where they are.
+  void Stop();
+
+private:
+
+  static void * thread_main(void * archiver);
+  void Run();
+  void Sweep();
+  bool PastRetention(const std::string & name, const time_t now);
+  void FindUncompressed();
+  void CompressOne(const std::string & name);
+
+  struct queued_file {
+    unsigned int subrun;
+    std::string name;
+  };
+
+  bool started;
+  int inputfd, donefd;
+  unsigned int retention;
+  bool compress;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  std::deque<queued_file> queue; // in subrun order
+  std::deque<std::string> tocompress; // base names, in decoded/
+  std::deque<std::string> backlog; // the same, found at start
+  unsigned int released; // subruns below this may be archived
+  bool stopping;
+};
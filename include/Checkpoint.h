@@ -0,0 +1,32 @@
+// Crash-recovery checkpoints of the event builder's state.
+//
+// A checkpoint is a native-endian binary file that is only meant to be read
+// back by the same build of the EventBuilder on the same machine, so no
+// attempt is made to make it portable.  It is always replaced atomically:
+// the new contents are written to a temporary file, fsynced, and renamed
+// over the old checkpoint, after which the directory is fsynced too.
+
+// Primitive writers and readers.  All return false on I/O error or, for the
+// readers, on unexpected end of file.
+bool ckpt_write_u32(FILE * f, const uint32_t x);
+bool ckpt_read_u32(FILE * f, uint32_t & x);
+bool ckpt_write_u64(FILE * f, const uint64_t x);
+bool ckpt_read_u64(FILE * f, uint64_t & x);
+bool ckpt_write_string(FILE * f, const std::string & s);
+bool ckpt_read_string(FILE * f, std::string & s);
+bool ckpt_write_packets(FILE * f, const std::vector<decoded_packet> & packets);
+bool ckpt_read_packets(FILE * f, std::vector<decoded_packet> & packets);
+
+// Opens the temporary file that will become checkpoint 'name' once
+// ckpt_commit() is called on it.  Exits via LOG_CRIT on failure.
+FILE * ckpt_begin(const std::string & name);
+
+// Flushes and fsyncs the temporary file, closes it, atomically renames it
+// to 'name' and fsyncs the containing directory.  Returns false on failure,
+// in which case the previous checkpoint, if any, is left in place.
+bool ckpt_commit(FILE * f, const std::string & name);
+
+// Opens checkpoint 'name' for reading and checks its header.  Returns NULL
+// if there is no checkpoint.  Exits via LOG_CRIT if it exists but is not a
+// checkpoint this build can read.
+FILE * ckpt_open(const std::string & name);
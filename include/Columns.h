@@ -0,0 +1,68 @@
+// Columnar copies of the events written to each output file, for analyses
+// that only read a few fields of each event, such as its modules, times and
+// charge sums, and so would rather not parse the whole event stream.
+//
+// Next to output file <output>_NNNNN goes <output>_columns_NNNNN, holding
+// the same events, with the same output module numbers, as arrays of one
+// field each.  Only ADC packets are kept, as only they are encoded.  The
+// file is native-endian and meant to be mapped into memory and read in
+// place: each column starts on a 64-byte boundary, and is found through the
+// index at the end of the file:
+//
+//   header, 64 bytes: magic "EBCL", version, number of events, of packets
+//           and of hits
+//   columns, each padded to 64 bytes:
+//     event_first  uint64 [events+1]  first packet of each event, then the
+//                                     number of packets
+//     event_time   uint32 [events]    Unix time stamp
+//     module       uint16 [packets]
+//     time16ns     uint32 [packets]   clock count
+//     charge_sum   int32  [packets]   sum of the charges of the hits
+//     hit_first    uint64 [packets+1] first hit of each packet, then the
+//                                     number of hits
+//     channel      uint8  [hits]
+//     charge       int16  [hits]
+//   index, 32 bytes per column: name, NUL-padded to 12 bytes, bytes per
+//           element (uint32), offset of the column in the file (uint64),
+//           number of elements (uint64)
+//   trailer, 16 bytes: offset of the index (uint64), number of columns
+//           (uint32), magic "EBCL"
+
+class EventEncoder;
+
+// The columns of a run of events, built up in memory until they are written
+class EventColumns {
+
+public:
+
+  void Clear();
+
+  // Adds the event made of the 'npackets' packets starting at 'packets',
+  // from the USB streams with indices 'usbindex', with the output module
+  // numbers 'encoder' gives them.  Thread-safe for different EventColumns.
+  void AddEvent(const decoded_packet * const packets,
+                const int * const usbindex, const unsigned int npackets,
+                const EventEncoder & encoder);
+
+  // Adds the events of 'o' after these
+  void Append(const EventColumns & o);
+
+  uint64_t Events() const { return event_time.size(); }
+
+  // Writes the columns to file 'name', replacing any that is there.  Logs
+  // and returns false on failure.
+  bool Write(const std::string & name) const;
+
+private:
+
+  // As in the file, but with the leading zero of event_first and hit_first
+  // left out
+  std::vector<uint64_t> event_end;
+  std::vector<uint32_t> event_time;
+  std::vector<uint16_t> module;
+  std::vector<uint32_t> time16ns;
+  std::vector<int32_t> charge_sum;
+  std::vector<uint64_t> hit_end;
+  std::vector<uint8_t> channel;
+  std::vector<int16_t> charge;
+};
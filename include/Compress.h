@@ -0,0 +1,107 @@
+// Compression of input files archived into decoded/.
+//
+// The raw data only carries 6 bits of payload in each byte, so archived
+// input files compress well.  With -z, the archiver compresses each file it
+// archives, in the background, from decoded/<name>.done to
+// decoded/<name>.done.ebz, and the decoder reads such files transparently,
+// so they can be reprocessed with -O like any other.
+//
+// The codec is chosen when building: zstd (make ZSTD=1), LZ4 (make LZ4=1)
+// or zlib (make ZLIB=1), the first of these built in being used to
+// compress.  Files are only readable by builds with their codec.
+//
+// Files are cut into blocks that are compressed separately, so that they
+// can be decompressed by several threads at once.  The file is
+// native-endian:
+//
+//   header, 32 bytes: magic "EBZ1", codec, block size, unused, size of the
+//           raw file (uint64), number of blocks (uint64)
+//   blocks, each: raw length (uint32), stored length (uint32), then the
+//           stored bytes.  A block that doesn't get smaller is stored raw,
+//           with both lengths the same.
+
+class WorkerPool;
+
+extern const char * const compressed_suffix;
+
+// The name of the codec files are compressed with, or NULL if this build
+// has none
+const char * compression_codec();
+
+// Whether file 'name' is named as a compressed file
+bool is_compressed_name(const std::string & name);
+
+// Compresses file 'from' in directory 'dirfd' to 'to' in the same
+// directory, keeping its modification time, then deletes 'from'.  The
+// compressed file is written under a temporary name and made durable before
+// being renamed into place, so 'to' is always whole.  Logs and returns
+// false on failure, leaving 'from' where it is.
+bool compress_file(const int dirfd, const std::string & from,
+                   const std::string & to);
+
+// Decompresses file 'from' to 'to', which is written under a temporary name
+// and fsynced before being renamed into place.  'from' is left alone.  Logs
+// and returns false on failure.
+bool decompress_file(const std::string & from, const std::string & to);
+
+// Reads a compressed file into memory.  Its blocks are decompressed while
+// what has been decompressed so far is used, by the thread reading the file
+// as it waits for them and by background threads, several at a time.  The
+// background threads only work while they can get a slot of the
+// WorkerPool given to SetWorkers() without waiting for one.
+class CompressedFile {
+
+public:
+
+  CompressedFile();
+  ~CompressedFile();
+
+  // Before Open(): the background threads take a slot of 'pool' for client
+  // 'client' for each block, and stop when none is free.  If NULL, they
+  // work without one.  See WorkerPool.h.
+  void SetWorkers(WorkerPool * pool, const unsigned int client);
+
+  // Opens compressed file 'name' and starts decompressing it.  Returns false
+  // if it can't be read or is damaged.
+  bool Open(const std::string & name);
+
+  // The size of the raw file
+  uint64_t Size() const { return rawsize; }
+
+  // Waits until the first 'end' bytes of the raw file are decompressed,
+  // decompressing blocks itself while any are left, and returns the whole
+  // raw file, or NULL if a block of it is damaged.  Only for the thread
+  // that opened the file.
+  const char * Data(const uint64_t end);
+
+  void Close();
+
+private:
+
+  static void * thread_main(void * file);
+  void Work();
+  bool DecompressNext();
+
+  struct block {
+    uint64_t in, out; // offsets in the file and in the raw data
+    uint32_t inlen, outlen;
+  };
+
+  const char * map;
+  size_t maplen;
+  uint32_t codec;
+  uint64_t rawsize;
+  std::vector<block> blocks;
+  std::vector<char> raw;
+
+  WorkerPool * workers;
+  unsigned int workerclient;
+
+  std::vector<pthread_t> threads;
+  pthread_mutex_t lock;
+  pthread_cond_t progress;
+  unsigned int next; // next block for a thread to take
+  std::vector<bool> done; // by block
+  unsigned int ndone; // all blocks before this are decompressed
+  bool damaged, stopping;
+};
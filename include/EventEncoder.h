@@ -0,0 +1,106 @@
+// Encodes built events in the output format described in README.txt.
+//
+// Packets carry the module numbers of the input numbering convention,
+// {USB serial number, board number}, which are mapped to the output
+// numbering convention, pmtboard_u, as they are encoded.  Also keeps track
+// of which modules have missed sync pulses, logging when they do and when
+// they recover.
+//
+// Encode() does all of this for one event at a time and is not thread-safe.
+// To encode batches of events in several threads at once, EncodeShared(),
+// which only reads the encoder, encodes them, and NoteSync() records what
+// each event shows of the sync pulses in a sync_record for the batch.
+// CheckSync() is then called with each batch's record in the order of the
+// batches, which logs exactly what Encode() would have for the same events.
+
+struct build_histograms;
+
+// What a batch of events showed of each module's sync pulses.  Each
+// module's packets, in order, are cut into runs on the same side of the
+// sync pulse period, and only where each run starts, and the clock count
+// checked against, are kept.
+struct sync_record {
+  struct sync_run {
+    uint16_t module; // output module
+    bool over; // past the sync pulse period
+    uint32_t time_sec; // of the event the run starts in
+    long int time16ns; // of the last packet of a run past the period, or
+                       // the first packet of one that isn't
+  };
+
+  void clear()
+  {
+    runs.clear();
+    last.clear();
+  }
+
+  std::vector<sync_run> runs; // in the order they start
+  std::vector<int> last; // by module, index in runs of its latest, or -1
+};
+
+class EventEncoder {
+
+public:
+
+  EventEncoder();
+
+  // The serial number of each USB stream, by the index events give for
+  // each packet
+  void SetStreams(const std::vector<int> & serials);
+
+  // Board 'board' of USB 'serial' is module 'pmtboard_u' in the output
+  void AddModule(const int serial, const int board, const uint16_t pmtboard_u);
+
+  // Count each event and packet encoded in these histograms, or not if
+  // NULL.  See Monitor.h.  Only for Encode().
+  void SetMonitor(build_histograms * h) { monitor = h; }
+
+  // Encodes the event made of the 'npackets' packets starting at 'packets',
+  // which came from the USB streams with indices 'usbindex', and appends it
+  // to 'buf'.
+  void Encode(const decoded_packet * const packets,
+              const int * const usbindex, const unsigned int npackets,
+              std::string & buf);
+
+  // As Encode(), but counting in 'hist' if not NULL, and without looking at
+  // the sync pulses, so that it can be called from several threads at once.
+  void EncodeShared(const decoded_packet * const packets,
+                    const int * const usbindex, const unsigned int npackets,
+                    std::string & buf, build_histograms * hist) const;
+
+  // Adds what the event would show of the sync pulses when encoded to
+  // 'sync'.  Thread-safe, like EncodeShared().
+  void NoteSync(const decoded_packet * const packets,
+                const int * const usbindex, const unsigned int npackets,
+                sync_record & sync) const;
+
+  // The output module of module 'module' of the USB stream with index
+  // 'usbindex', or -1 if it isn't known.  Thread-safe.
+  int OutModule(const int usbindex, const uint16_t module) const;
+
+  // Checks the sync pulses recorded in 'sync', logging modules that missed
+  // one or have recovered.  Records must be given in the order of their
+  // events.
+  void CheckSync(const sync_record & sync);
+
+private:
+
+  void index_modules();
+
+  std::vector<int> usbserials;
+
+  // Maps {USB_serial, board_number} to pmtboard_u
+  std::map<std::pair<int, int>, uint16_t> unique;
+
+  // The same by USB index and board number, -1 for unknown modules
+  std::vector< std::vector<int> > outmodule;
+
+  // By output module: whether it is past a missed sync pulse, and its
+  // largest clock count since
+  std::vector<bool> overflow;
+  std::vector<long int> maxcount_16ns;
+
+  // For Encode()
+  build_histograms * monitor;
+  sync_record scratch;
+};
@@ -0,0 +1,31 @@
+// Spare hit containers, passed from where packets are finished with back to
+// where they are decoded, so that the memory of a packet's hits is reused
+// instead of being freed and allocated again for every packet.  Thread-safe.
+
+class HitPool {
+
+public:
+
+  HitPool();
+  ~HitPool();
+
+  // Appends up to 'n' empty containers to 'out', with whatever capacity
+  // they had.  Returns how many were appended, which is zero if the pool
+  // is empty.
+  unsigned int Take(std::vector< std::vector<decoded_hit> > & out,
+                    const unsigned int n);
+
+  // Takes the hit containers of the packets in 'packets', which are about
+  // to be thrown away, as far as there is room in the pool.
+  void Give(std::vector<decoded_packet> & packets);
+
+  // Keeps no more than 'bytes' of spare containers from now on, if that is
+  // less than the limit already set
+  void Limit(const uint64_t bytes);
+
+private:
+
+  pthread_mutex_t lock;
+  std::vector< std::vector<decoded_hit> > spares;
+  uint64_t bytes, maxbytes; // held in spares, and the most to hold
+};
@@ -0,0 +1,118 @@
+// The event builder as a library: builds events in memory from raw data
+// pushed to it, with no input or output files.  This is for building events
+// inside another program, such as a DAQ process.
+//
+// A MemoryBuilder is set up in code, with the same settings the EventBuilder
+// takes from its config file and options, and then fed each USB stream's raw
+// data, as read from the USB, with Push().  Each call to Build() does what
+// the EventBuilder does for a set of input files: it takes the data decoded
+// on each stream up to its next Unix time stamp, puts it in time order and
+// builds what events it can.  Each event is passed to a callback, or kept
+// for TakeEvents(), encoded in the format of the EventBuilder's output files
+// (see README.txt).  An event that may continue into data not yet pushed
+// is held back until the next Build().  At the end of the data, Finish()
+// builds everything that is left.
+//
+// Pushed data is one continuous stream per USB, as with the EventBuilder's
+// socket input (-u): unlike input files, which are each decoded from a clean
+// start, a word cut off at the end of one Push() is finished by the next.
+//
+// Include <stdint.h>, <map>, <string>, <vector>, "USBstream.h",
+// "USBstreamUtils.h", "Merge.h" and "EventEncoder.h" before this, and link
+// with lib/libEBuilder.a and -pthread.  Not thread-safe.
+
+class MemoryBuilder {
+
+public:
+
+  // Called with each built event, 'len' bytes at 'event', and the 'arg'
+  // given to SetCallback()
+  typedef void (*event_callback)(const char * event, const size_t len,
+                                 void * arg);
+
+  MemoryBuilder();
+
+  // Setup, before any other call: one line of the config file.  Board
+  // 'board' of USB 'serial' is module 'pmtboard_u' in the output, with
+  // timing offset 'offset'.
+  void AddModule(const int serial, const int board, const int pmtboard_u,
+                 const int offset);
+
+  // The software threshold and trigger mode, as given with -t and -T.  By
+  // default, the same as the EventBuilder's.
+  void SetThreshold(const int threshold, const int mode);
+
+  // Sets the baselines of USB 'serial', indexed by module*64 + channel
+  void SetBaselines(const int serial, const std::vector<int> & baselines);
+
+  // Sets the baselines of USB 'serial' from 'len' bytes of its raw baseline
+  // data, as in its baseline file
+  void DecodeBaselines(const int serial, const char * const data,
+                       const size_t len);
+
+  // Passes each event to 'cb' as soon as it is built, instead of keeping it
+  // for TakeEvents().  NULL to go back to keeping them.
+  void SetCallback(event_callback cb, void * arg);
+
+  // Decodes 'len' bytes of raw data from USB 'serial', continuing from the
+  // last data pushed for it.  They need not end on a word or packet.
+  void Push(const int serial, const char * const data, const size_t len);
+
+  // Builds events out of what has been pushed.  Returns how many.
+  unsigned int Build();
+
+  // Builds all that is left of what has been pushed, as at the end of a
+  // run: every stream's decoded data, however far it runs past the others,
+  // and the event held back.  Returns how many events were built.
+  unsigned int Finish();
+
+  // Moves the events built so far that haven't been passed to a callback
+  // onto the end of 'events' and returns how many there were
+  unsigned int TakeEvents(std::string & events);
+
+  // Totals for USB 'serial' over all data pushed so far
+  const corruption_counts & GetCorruptionCounts(const int serial);
+
+private:
+
+  // Makes the streams once the config is complete
+  void Setup();
+  void Configure(USBstream & stream, const int serial);
+  unsigned int StreamIndex(const int serial);
+  void Extract(const bool all);
+  unsigned int BuildOrdered(std::vector< std::vector<decoded_packet> > & data,
+                            const std::vector<int> & index);
+  void CloseEvent();
+
+  bool setup;
+
+  // As given to AddModule(), and the serials in order of first appearance,
+  // which gives the index of each stream
+  struct module_config {
+    int serial, board, pmtboard_u, offset;
+  };
+  std::vector<module_config> modules;
+  std::vector<int> serials;
+  int nummodules; // One more than the highest board number
+
+  int threshold, mode;
+
+  std::vector<USBstream> streams;
+  uint64_t timekeyref; // See make_time_key()
+  EventEncoder encoder;
+
+  // Decoded data not yet built, by stream, and the packets, and the stream
+  // indices they came from, of the event being built, which is held back
+  // at the end of a Build() in case it continues
+  std::vector< std::vector<decoded_packet> > current;
+  std::vector<decoded_packet> openevent;
+  std::vector<int> openindex;
+  std::vector<merged_ref> order;
+  std::vector<int> allstreams; // 0, 1, ... for BuildOrdered()
+
+  event_callback callback;
+  void * callback_arg;
+  std::string built; // events for TakeEvents()
+  unsigned int nbuilt;
+  std::string event; // scratch space for the event being passed on
+};
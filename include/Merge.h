@@ -0,0 +1,47 @@
+// Time-ordered merging of the decoded packets of several USB streams.
+
+// One packet in the merged order: which packet, which USB stream (index
+// into the array of streams) it came from, and whether it is the last
+// packet of that stream.
+struct merged_ref {
+  const decoded_packet * packet;
+  int usb;
+  bool last;
+};
+
+// Puts the packets in 'data', one sorted vector per USB stream, into time
+// order in 'order', stopping after the last packet of whichever stream runs
+// out first.  If any stream is empty, 'order' is left empty.  Ties go to
+// the stream with the lower index.
+//
+// If 'group_size' is at least 2 and less than the number of streams, the
+// streams are merged hierarchically: groups of 'group_size' streams are
+// merged in parallel threads, then groups of those results, and so on.
+// The resulting order is the same either way.
+void merge_streams(const std::vector< std::vector<decoded_packet> > & data,
+                   const unsigned int group_size,
+                   std::vector<merged_ref> & order);
+
+// Fills 'used' with how many packets of each stream merge_streams() would
+// put into its order, without doing the merge.
+void merged_extent(const std::vector< std::vector<decoded_packet> > & data,
+                   std::vector<unsigned int> & used);
+
+// Cuts the first used[k] packets of each stream k into up to 'nranges'
+// ranges of time, placing cuts only where every packet before the cut is
+// more than 'window' clock ticks before every packet after it.  Range r of
+// stream k is [cuts[r][k], cuts[r+1][k]).  Each range can then be merged,
+// and its events built, independently of the others, since no event can
+// span a cut.  There may be fewer ranges than asked for if there are not
+// enough such gaps.
+void partition_streams(const std::vector< std::vector<decoded_packet> > & data,
+                       const std::vector<unsigned int> & used,
+                       const unsigned int nranges, const int window,
+                       std::vector< std::vector<unsigned int> > & cuts);
+
+// Puts packets [begin[k], end[k]) of each stream k into time order in
+// 'order', taking all of them.  Ties go to the stream with the lower index.
+void merge_ranges(const std::vector< std::vector<decoded_packet> > & data,
+                  const std::vector<unsigned int> & begin,
+                  const std::vector<unsigned int> & end,
+                  std::vector<merged_ref> & order);
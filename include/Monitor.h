@@ -0,0 +1,108 @@
+// Online monitoring histograms, filled as data is decoded and built.
+//
+// Each thread fills its own shard without locking and folds it into the
+// run-wide totals held by a Monitor every so often, after which the shard
+// starts over from zero.  The Monitor writes out a snapshot of the totals
+// at a set interval, and those start over too, so each snapshot covers the
+// data folded in since the one before.
+
+// Charge spectra have this many bins of this many ADC counts each, starting
+// at zero.  Negative charges go in the first bin and overflows in the last.
+static const int monitor_charge_bins = 64;
+static const int monitor_charge_bin_width = 64;
+
+// Hits within this many ADC counts of the baseline count towards the
+// pedestal drift, which is their mean baseline-subtracted charge.
+static const int monitor_pedestal_window = 64;
+
+// Filled while decoding one USB stream, indexed by module*64 + channel
+struct decode_histograms {
+  void Init(const int nmodules)
+  {
+    hits.assign(nmodules*64, 0);
+    charge.assign(nmodules*64*monitor_charge_bins, 0);
+    pedestal_n.assign(nmodules*64, 0);
+    pedestal_sum.assign(nmodules*64, 0);
+  }
+
+  void Hit(const int module, const int channel, const int q)
+  {
+    const int i = module*64 + channel;
+    hits[i]++;
+
+    int bin = q/monitor_charge_bin_width;
+    if(bin < 0) bin = 0;
+    if(bin >= monitor_charge_bins) bin = monitor_charge_bins - 1;
+    charge[i*monitor_charge_bins + bin]++;
+
+    if(q > -monitor_pedestal_window && q < monitor_pedestal_window){
+      pedestal_n[i]++;
+      pedestal_sum[i] += q;
+    }
+  }
+
+  std::vector<uint32_t> hits;
+  std::vector<uint32_t> charge; // [(module*64 + channel)*bins + bin]
+  std::vector<uint32_t> pedestal_n;
+  std::vector<int64_t> pedestal_sum;
+};
+
+// Filled while building events, indexed by output module number
+struct build_histograms {
+  void Init(const int noutmodules)
+  {
+    nevents = 0;
+    multiplicity.assign(64, 0);
+    modules.assign(noutmodules, 0);
+  }
+
+  // Called once per event with the number of module packets in it
+  void Event(const unsigned int npackets)
+  {
+    nevents++;
+    multiplicity[std::min<unsigned int>(npackets, multiplicity.size()-1)]++;
+  }
+
+  void Module(const int outmodule) { modules[outmodule]++; }
+
+  uint64_t nevents;
+  std::vector<uint32_t> multiplicity; // events by number of packets
+  std::vector<uint32_t> modules;      // packets in built events
+};
+
+class Monitor {
+
+public:
+
+  Monitor();
+
+  // Snapshots will be appended to 'filename' every 'interval' seconds.
+  // 'usbs' are the USB serial numbers of the streams, in index order.
+  void Init(const std::string & filename, const unsigned int interval,
+            const std::vector<int> & usbs, const int nmodules,
+            const int noutmodules);
+
+  bool IsOn() const { return interval > 0; }
+
+  // Add the shard's counts to the totals and zero the shard.  Thread-safe.
+  void Fold(const unsigned int usbindex, decode_histograms & shard);
+  void Fold(build_histograms & shard);
+
+  // Write out a snapshot if one is due, or regardless if 'force' is set.
+  // Thread-safe.
+  void MaybeDump(const bool force);
+
+private:
+
+  void Dump(FILE * f, const time_t now);
+
+  pthread_mutex_t lock;
+  std::string filename;
+  unsigned int interval;
+  time_t last_dump;
+  std::vector<int> usbs;
+  int nmodules;
+
+  std::vector<decode_histograms> decoded; // per USB stream index
+  build_histograms built;
+};
@@ -0,0 +1,69 @@
+// An output data file with explicit control over how it is laid out on disk
+// and when its contents are made durable.
+
+struct output_policy {
+  output_policy()
+  {
+    prealloc_bytes = 0;
+    sync_bytes = 0;
+    writebehind_bytes = 0;
+  }
+
+  // Reserve disk space this many bytes at a time with fallocate() so the
+  // file is laid out contiguously.  Unused space is released on Close().
+  // Zero to not preallocate.
+  uint64_t prealloc_bytes;
+
+  // fdatasync() after every this many bytes written.  Zero to only sync
+  // when asked to with Sync() or Close().
+  uint64_t sync_bytes;
+
+  // Start writeback of every this many bytes as soon as they are written
+  // with sync_file_range(), and wait for the previous chunk to finish, so
+  // dirty pages are written steadily instead of in bursts.  Zero to leave
+  // writeback to the kernel.
+  uint64_t writebehind_bytes;
+};
+
+class OutputFile {
+
+public:
+
+  OutputFile();
+
+  void SetPolicy(const output_policy & p) { policy = p; }
+
+  // Opens 'name', creating or truncating it.  If 'keep' is non-zero, the
+  // file is instead truncated to 'keep' bytes and appended to, which is how
+  // a file is resumed after a restart.  Exits via LOG_CRIT on failure.
+  void Open(const std::string & name, const uint64_t keep = 0);
+
+  // Returns false on error
+  bool Write(const char * buf, size_t len);
+
+  // Makes everything written so far durable.  Returns false on error.
+  bool Sync();
+
+  // Releases unused preallocated space, syncs if 'sync' is true or any
+  // syncing is called for by the policy, and closes.  Returns false on
+  // error.
+  bool Close(const bool sync);
+
+  bool IsOpen() const { return fd >= 0; }
+  uint64_t GetSize() const { return written; }
+  time_t GetOpenTime() const { return opentime; }
+  const std::string & GetName() const { return myname; }
+
+private:
+
+  bool Preallocate();
+
+  output_policy policy;
+  int fd;
+  std::string myname;
+  time_t opentime;
+  uint64_t written;     // bytes written so far, which is the file's size
+  uint64_t allocated;   // bytes preallocated so far
+  uint64_t synced;      // bytes known to be durable
+  uint64_t writtenback; // bytes whose writeback has been started
+};
@@ -0,0 +1,108 @@
+// A cache of what decoding each input file gives, so that rebuilding the
+// same raw data, say with another threshold, trigger mode, baseline or
+// timing offset, can skip unpacking the bytes and parsing the packets.
+//
+// The cache holds each file's module packets as parsed, in the order they
+// were found, before anything that depends on the configuration is done to
+// them: the charges are raw ADC values and the clock counts have no offsets
+// taken off, packets of every module number are kept, and no threshold has
+// been applied.  Along with them go the counts of corruption found in the
+// bytes, the DAQ's word counts, and the decoder state left at the end of the
+// file.  Replaying a cache file then does the rest of decoding exactly as
+// for the raw file.
+//
+// A cache file is keyed on the input file's name, size and modification
+// time, the decoder state it was started in, and the version of the decoder,
+// so a stale one is never used; it is just decoded and written again.  The
+// format is native-endian, with every field naturally aligned, and is read
+// by mapping the file into memory:
+//
+//   header: magic "EBPC", version, key, byte-level corruption counts, DAQ
+//           word counts, first Unix time stamp found, Unix time at the end,
+//           number of leftover 16-bit words and of packets, and whether the
+//           file ended between the two halves of a Unix time stamp
+//   leftover 16-bit words of a packet not finished at the end of the file,
+//           padded to 4 bytes
+//   each packet: Unix time, clock count, module, number of hits, ADC flag,
+//           parity flag, pad, then 4 bytes per hit: raw charge, channel, pad
+
+// What decoding a file gave besides its packets
+struct packet_cache_summary {
+  packet_cache_summary()
+  {
+    tolutc = 0;
+    unix_time_hi = unix_time_lo = 0;
+    pending_time_hi = false;
+  }
+
+  corruption_counts counts; // only those found before parsing packets
+  daq_word_counts daq;
+  uint32_t tolutc; // the run's first Unix time stamp, if found in this file
+  uint16_t unix_time_hi, unix_time_lo; // at the end of the file
+  bool pending_time_hi; // the file ended after the high half of a stamp
+};
+
+// The key for decoding input file 'name', with stat() results 'st', starting
+// from leftover 16-bit words 'leftover' and Unix time words 'hi' and 'lo',
+// with the high half of a stamp waiting for its low half if 'pending', and
+// with the run's first Unix time stamp already found if 'stamped'.
+uint64_t packet_cache_key(const std::string & name, const struct stat & st,
+                          const std::deque<uint16_t> & leftover,
+                          const uint16_t hi, const uint16_t lo,
+                          const bool pending, const bool stamped);
+
+// Collects the packets of a file as it is decoded and writes them out
+class PacketCacheWriter {
+
+public:
+
+  PacketCacheWriter() { npackets = 0; }
+
+  // Forgets the packets added so far, for when decoding starts over
+  void Clear();
+
+  // Adds a packet as parsed, with raw charges and clock count
+  void Add(const decoded_packet & p, const bool parity_ok);
+
+  // Writes cache file 'name' with key 'key', replacing any that is there.
+  // Logs and returns false on failure, which only costs a decode next time.
+  bool Commit(const std::string & name, const uint64_t key,
+              const packet_cache_summary & summary,
+              const std::deque<uint16_t> & leftover);
+
+private:
+
+  std::string packets;
+  uint32_t npackets;
+};
+
+// Reads a cache file back
+class PacketCacheReader {
+
+public:
+
+  PacketCacheReader();
+  ~PacketCacheReader();
+
+  // Maps cache file 'name' and checks it.  Returns false if it isn't there,
+  // is for another key or is damaged.
+  bool Open(const std::string & name, const uint64_t key);
+
+  const packet_cache_summary & GetSummary() const { return summary; }
+  void GetLeftover(std::deque<uint16_t> & leftover) const;
+
+  // Fills 'p', whose hits must be empty, with the next packet, as it was
+  // given to PacketCacheWriter::Add().  Returns false after the last.
+  bool Next(decoded_packet & p, bool & parity_ok);
+
+private:
+
+  void Close();
+
+  const char * map;
+  size_t maplen;
+  size_t pos; // of the next packet
+  uint32_t nleft; // packets not yet read
+  uint32_t nleftover;
+  packet_cache_summary summary;
+};
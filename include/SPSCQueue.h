@@ -0,0 +1,91 @@
+// Bounded lock-free queue between exactly one producer thread and exactly
+// one consumer thread.  Used to connect the stages of the event building
+// pipeline.  Push() waits while the queue is full and Pop() waits while it
+// is empty, so a slow stage holds back the stages feeding it instead of
+// letting them run arbitrarily far ahead.
+//
+// The queue is a ring of 'capacity' slots.  'head' is only written by the
+// consumer and 'tail' only by the producer; each reads the other's index
+// with acquire semantics and publishes its own with release semantics, so
+// a slot's contents are visible before the index that hands it over.
+
+#include <sched.h>
+#include <time.h>
+
+template<typename T> class SPSCQueue {
+
+public:
+
+  // 'capacity' is rounded up to a power of two
+  explicit SPSCQueue(const unsigned int capacity)
+  {
+    size = 1;
+    while(size < capacity) size <<= 1;
+    slots = new T[size];
+    head = tail = 0;
+  }
+
+  ~SPSCQueue() { delete[] slots; }
+
+  // Returns false, without waiting, if the queue is full
+  bool TryPush(const T & x)
+  {
+    const unsigned long t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    if(t - __atomic_load_n(&head, __ATOMIC_ACQUIRE) == size) return false;
+    slots[t & (size-1)] = x;
+    __atomic_store_n(&tail, t+1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // Returns false, without waiting, if the queue is empty
+  bool TryPop(T & x)
+  {
+    const unsigned long h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    if(__atomic_load_n(&tail, __ATOMIC_ACQUIRE) == h) return false;
+    x = slots[h & (size-1)];
+    __atomic_store_n(&head, h+1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  void Push(const T & x)
+  {
+    for(unsigned int spins = 0; !TryPush(x); spins++) Backoff(spins);
+  }
+
+  T Pop()
+  {
+    T x;
+    for(unsigned int spins = 0; !TryPop(x); spins++) Backoff(spins);
+    return x;
+  }
+
+  // Approximate, since the other thread may be changing it
+  unsigned long Size() const
+  {
+    return __atomic_load_n(&tail, __ATOMIC_ACQUIRE)
+         - __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+  }
+
+private:
+
+  // Spin briefly, since the other side is usually only a moment away, then
+  // yield, then sleep so that a stalled stage does not burn a core.
+  static void Backoff(const unsigned int spins)
+  {
+    if(spins < 64) return;
+    if(spins < 128){ sched_yield(); return; }
+    const struct timespec pause = { 0, 100000 }; // 100us
+    nanosleep(&pause, NULL);
+  }
+
+  // Disallow copying
+  SPSCQueue(const SPSCQueue &);
+  SPSCQueue & operator=(const SPSCQueue &);
+
+  T * slots;
+  unsigned long size;
+
+  // On separate cache lines so the two threads don't contend for them
+  __attribute__((aligned(64))) unsigned long head;
+  __attribute__((aligned(64))) unsigned long tail;
+};
@@ -0,0 +1,54 @@
+// Adapts how the event builder batches and parallelizes its work to how far
+// behind the DAQ it is.
+//
+// When file sets are piling up, subruns are made longer, which spreads the
+// fixed cost of each subrun (closing and syncing the output, checkpointing)
+// over more data, and if building events is what limits throughput, events
+// are built in more threads.  Once caught up, both shrink back step by step
+// so that events are written out soon after their files arrive.
+//
+// The reader asks for a plan at the start of each subrun, and the decoders
+// and merger report how long their work takes.  Thread-safe.
+
+class AdaptiveScheduler {
+
+public:
+
+  AdaptiveScheduler();
+
+  // Turns adaptation on.  Subruns will be from 1 to 'maxfilesets' file sets
+  // long and events will be built in from 'minranges' to 'maxranges' time
+  // ranges (see the -j option).
+  void Init(const unsigned int maxfilesets, const unsigned int minranges,
+            const unsigned int maxranges);
+  bool IsOn() const { return on; }
+
+  // Given the number of complete file sets waiting to be read, decides how
+  // many the next subrun should have, which it returns.  For the reader.
+  unsigned int Plan(const unsigned int backlog);
+
+  // The number of ranges to build events in now.  For the merger.
+  unsigned int GetBuildRanges() const;
+
+  // Reports that a decoder took 'us' microseconds to decode one file
+  void ObserveDecode(const uint64_t us);
+
+  // Reports that the merger took 'us' microseconds to build the events of
+  // a subrun of 'nfilesets' file sets
+  void ObserveBuild(const unsigned int nfilesets, const uint64_t us);
+
+private:
+
+  bool on;
+  unsigned int maxfilesets, minranges, maxranges;
+  unsigned int filesets; // per subrun, as last planned
+  unsigned int ranges;   // read by the merger
+
+  // Work reported since the last plan
+  uint64_t decode_us, decode_files;
+  uint64_t build_us, build_filesets;
+
+  // Microseconds per file set of each stage, as last measured.  Decoding
+  // is per USB stream, as the streams are decoded in parallel.
+  double decode_cost, build_cost;
+};
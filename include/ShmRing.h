@@ -0,0 +1,89 @@
+// A ring buffer of built events in POSIX shared memory, for online
+// consumers on the same machine such as event displays.
+//
+// There is one writer, the event builder, and any number of readers, which
+// never hold the writer back: the writer just overwrites the oldest data,
+// and a reader that falls so far behind that what it wanted to read has
+// been overwritten is told so and skips ahead to the newest data.
+//
+// The ring holds records, each of which is a batch of whole events in the
+// same format as the output files, and which records where the batch lies
+// in the sequence of all events published.  The writer claims space with
+// 'reserve' before writing into it and publishes it with 'head' afterwards,
+// so a reader can tell, after copying a record, whether it was overwritten
+// while it copied.
+
+struct shm_ring_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;   // bytes of records after this header, a power of two
+  uint64_t generation; // bumped each time a writer opens the ring
+  uint64_t reserve;    // bytes ever claimed by the writer
+  uint64_t head;       // bytes ever published by the writer
+  uint64_t nevents;    // events ever published
+};
+
+// Each record starts with this, followed by 'length' bytes of events and
+// padding to a multiple of 8 bytes.
+struct shm_ring_record {
+  uint32_t length;
+  uint32_t nevents;
+  uint64_t first_event; // sequence number of the first event in the record
+};
+
+class ShmRingWriter {
+
+public:
+
+  ShmRingWriter();
+
+  // Creates shared memory object 'name' (e.g. "/ebuilder"), or reuses it,
+  // with room for 'capacity' bytes of records, rounded up to a power of
+  // two.  Exits via LOG_CRIT on failure.
+  void Open(const std::string & name, const uint64_t capacity);
+
+  // Publishes 'nevents' events encoded in 'len' bytes at 'data'.  Never
+  // waits for readers.  Batches too big to fit in the ring are dropped.
+  void Publish(const char * data, const uint32_t len, const uint32_t nevents);
+
+  // Unmaps the ring, but leaves it for readers to drain
+  void Close();
+
+  bool IsOpen() const { return header != NULL; }
+
+private:
+
+  shm_ring_header * header;
+  char * ring;
+  size_t mapsize;
+};
+
+class ShmRingReader {
+
+public:
+
+  enum read_status { kGot, kNothing, kOverrun };
+
+  ShmRingReader();
+
+  // Attaches to the ring 'name', starting at its newest data.  Returns
+  // false on failure.
+  bool Open(const std::string & name);
+
+  // Gets the next record into 'events', and which events they are, if
+  // there is one.  Returns kOverrun, without getting anything, if the
+  // reader fell behind and has skipped to the newest data, or if the
+  // writer restarted.
+  read_status Read(std::string & events, uint64_t & first_event,
+                   uint32_t & nevents);
+
+  void Close();
+
+private:
+
+  const shm_ring_header * header;
+  const char * ring;
+  size_t mapsize;
+  uint64_t generation;
+  uint64_t readpos;
+};
@@ -0,0 +1,36 @@
+// Receives one USB stream's raw data directly from its DAQ process over a
+// Unix domain socket, instead of through files.
+//
+// The builder listens, and the DAQ process connects and writes the same
+// bytes it would have written to its files.  If the DAQ process goes away,
+// another connection is accepted.  Nothing ever waits: each Receive() takes
+// whatever has arrived so far.  bin/ReplayDAQ sends files into a socket, as
+// a stand-in for the DAQ.
+
+class SocketIngest {
+
+public:
+
+  SocketIngest();
+
+  // Listens at 'path', replacing any socket left there by an earlier run.
+  // Exits via LOG_CRIT on failure.
+  void Listen(const std::string & path);
+
+  // Appends everything received since the last call to 'buf', first
+  // accepting a connection if there isn't one.  Returns the number of bytes
+  // appended.
+  uint64_t Receive(std::string & buf);
+
+  void Close();
+
+  const std::string & GetPath() const { return path; }
+
+private:
+
+  bool Accept();
+
+  std::string path;
+  int listenfd;
+  int connfd; // -1 if not connected
+};
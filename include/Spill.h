@@ -0,0 +1,51 @@
+// Temporary storage on disk for decoded packets that don't fit in the
+// memory budget, so that a subrun of any length can be built in bounded
+// memory.
+//
+// Each USB stream has its own SpillFile.  Its packets are in time order, so
+// the file is just the front of the stream: packets are appended while
+// data is taken in, then read back from the start, a bounded amount at a
+// time, while events are built.  Once everything written has been read, the
+// file is emptied for reuse.  Packets are stored compactly, 20 bytes plus 3
+// per hit, in native byte order, since the file never outlives the process.
+// It is unlinked as soon as it is created, so nothing is left behind
+// however the program ends.
+
+// Approximate memory used by 'packets', including their hits
+uint64_t packet_memory(const std::vector<decoded_packet> & packets);
+
+class SpillFile {
+
+public:
+
+  SpillFile();
+  ~SpillFile();
+
+  // Creates the file, as 'name', and unlinks it.  Exits via LOG_CRIT on
+  // failure.
+  void Open(const std::string & name);
+
+  // Appends the packets in 'packets', which are left as they are.  Only
+  // while nothing is being read back.  Exits via LOG_CRIT on failure.
+  void Write(const std::vector<decoded_packet> & packets);
+
+  // Appends packets read back to 'packets' until about 'bytes' of memory,
+  // as counted by packet_memory(), have been added, or there are no more.
+  // Returns the memory added.  Once all have been read, the file is emptied
+  // and can be written again.  Exits via LOG_CRIT on failure.
+  uint64_t Read(std::vector<decoded_packet> & packets, const uint64_t bytes);
+
+  // Packets written and not yet read back
+  uint64_t Count() const { return count; }
+
+  // Bytes of the file, for the log
+  uint64_t FileBytes() const { return filebytes; }
+
+private:
+
+  FILE * f;
+  std::string myname;
+  uint64_t count;
+  uint64_t filebytes;
+  bool reading;
+};
@@ -0,0 +1,62 @@
+// Optional tracing of where time goes in the pipeline, for finding which
+// stage, and which USB stream, holds things up.
+//
+// Each thread records spans of time, each with the name of what it was
+// doing and which subrun, file set and USB stream it was doing it for, in
+// its own buffer without locking.  Buffers keep only the most recent spans.
+// At the end of the run the spans are written out in the Chrome trace event
+// format, which chrome://tracing and https://ui.perfetto.dev can show.
+//
+// Times come from the CPU's time stamp counter, which is cheap to read, and
+// are converted to microseconds when written out.  On machines without one,
+// CLOCK_MONOTONIC is used instead.
+
+// Turns tracing on.  Until then, nothing is recorded.  Not thread-safe.
+void trace_start();
+bool trace_on();
+
+// Names the calling thread in the trace, e.g. "decoder" with index 3
+void trace_thread(const char * name, const int index = -1);
+
+uint64_t trace_clock_fallback();
+
+inline uint64_t trace_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return trace_clock_fallback();
+#endif
+}
+
+// Records that the calling thread did 'name', which must be a string
+// constant, from 'begin', a value of trace_clock(), until now.  Pass -1 for
+// any of 'subrun', 'fileset' and 'usb' that don't apply.
+void trace_span(const char * name, const uint64_t begin, const int subrun,
+                const int fileset, const int usb);
+
+// Writes all the spans recorded to 'filename'.  Call only once the threads
+// recording them are done.  Returns false on error.
+bool trace_write(const std::string & filename);
+
+// Records a span for the lifetime of the object, if tracing is on
+struct trace_scope {
+  trace_scope(const char * name_, const int subrun_ = -1,
+              const int fileset_ = -1, const int usb_ = -1)
+  {
+    name = name_;
+    subrun = subrun_;
+    fileset = fileset_;
+    usb = usb_;
+    begin = trace_on()? trace_clock(): 0;
+  }
+
+  ~trace_scope()
+  {
+    if(begin) trace_span(name, begin, subrun, fileset, usb);
+  }
+
+  const char * name;
+  int subrun, fileset, usb;
+  uint64_t begin;
+};
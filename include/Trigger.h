@@ -0,0 +1,56 @@
+// An event-level software trigger, applied to built events before they are
+// written out.
+//
+// The conditions are read from a file of lines of the form "keyword
+// values...", where # starts a comment:
+//
+//   modules N           Require at least N distinct modules.
+//   window T            All of them within T clock cycles.  Default: 0,
+//                       which means anywhere in the event.
+//   group NAME M1 M2 .. Name a group of modules, numbered as in the output.
+//   require NAME1 ..    Require at least one module of each of these groups
+//                       within the window, too.  If there are several
+//                       require lines, any one of them will do.
+//   prescale P          Write every Pth rejected event to a side output.
+//                       Default: 0, which drops them all.
+
+class EventTrigger {
+
+public:
+
+  EventTrigger();
+
+  // Reads the conditions from 'filename'.  Exits via LOG_CRIT on error.
+  void ReadConfig(const std::string & filename);
+
+  // Tells the trigger that module 'module' of the USB stream with index
+  // 'usbindex' is module 'outmodule' in the output.  Needed for every module
+  // before calling Pass().
+  void AddModule(const int usbindex, const int module, const int outmodule);
+
+  // Whether the event made of the 'npackets' packets starting at 'packets',
+  // in time order and from USB stream indices 'usbindex', passes.
+  bool Pass(const decoded_packet * const packets, const int * const usbindex,
+            const unsigned int npackets) const;
+
+  unsigned int GetPrescale() const { return prescale; }
+
+private:
+
+  typedef std::vector<uint64_t> module_mask; // bit per output module
+
+  void SetBit(module_mask & mask, const int outmodule) const;
+  bool Satisfied(const module_mask & hit) const;
+  int OutModule(const int usbindex, const int module) const;
+
+  unsigned int min_modules;
+  uint64_t window;
+  unsigned int prescale;
+  unsigned int mask_words;
+
+  std::map<std::string, module_mask> groups;
+  std::vector< std::vector<module_mask> > requirements; // OR of ANDs
+
+  // Output module number, indexed by usbindex*128 + module, or -1
+  std::vector<int> outmodules;
+};
@@ -1,3 +1,88 @@
+struct decode_histograms;
+class HitPool;
+class PacketCacheWriter;
+class WorkerPool;
+
+// Counts of input thrown away by a USBstream because it was corrupt
+struct corruption_counts {
+  corruption_counts()
+  {
+    skipped_bytes = skipped_words = bad_headers = 0;
+    parity_errors = bad_modules = 0;
+  }
+
+  void add(const corruption_counts & o)
+  {
+    skipped_bytes += o.skipped_bytes;
+    skipped_words += o.skipped_words;
+    bad_headers   += o.bad_headers;
+    parity_errors += o.parity_errors;
+    bad_modules   += o.bad_modules;
+  }
+
+  bool any() const
+  {
+    return skipped_bytes || skipped_words || bad_headers ||
+           parity_errors || bad_modules;
+  }
+
+  uint64_t skipped_bytes; // raw bytes out of sequence
+  uint64_t skipped_words; // 16-bit words outside of any packet
+  uint64_t bad_headers;   // 0xffff words not followed by a usable length
+  uint64_t parity_errors; // packets kept, but with bad parity
+  uint64_t bad_modules;   // packets with module numbers not in the config
+};
+
+// Counts of data words as reported by the DAQ itself in control words
+// between packets: 0xc5 words give a number of words it skipped, and each
+// run of four 0xc6 words the numbers it received and lost, as 32-bit counts
+// in high and low halves.  Each report counts the words since the one
+// before, so reports are summed.  Words lost here were never sent to us,
+// unlike those counted by corruption_counts.
+struct daq_word_counts {
+  daq_word_counts()
+  {
+    skipped = received = lost = reports = 0;
+  }
+
+  void add(const daq_word_counts & o)
+  {
+    skipped  += o.skipped;
+    received += o.received;
+    lost     += o.lost;
+    reports  += o.reports;
+  }
+
+  uint64_t skipped;
+  uint64_t received;
+  uint64_t lost;
+  uint64_t reports; // of received and lost words
+};
+
+// The software threshold on module packets of ADC hits, as given with -t and
+// -T.  A strip is over threshold if its baseline-subtracted charge is.  With
+// the overlapping pair mode, a packet passes if some strip over threshold
+// overlaps another over threshold; with the per-channel mode, if some strip
+// that was hit overlaps one over threshold.  Other packets always pass.
+class ThresholdCut {
+
+public:
+
+  ThresholdCut();
+
+  // threshtype: 0=NONE, 1=OR, 2=AND
+  void Set(const int thresh, const int threshtype);
+
+  bool IsOn() const { return use; }
+  bool Passes(const decoded_packet & packet) const;
+
+private:
+
+  int16_t thresh;
+  bool use;
+  bool bothlayer;
+};
+
 class USBstream {
 
 public:
@@ -5,8 +90,38 @@ public:
   USBstream();
 
   void SetUSB(int usb) { myusb=usb; }
+
+  // Set the number of module numbers, 0 through n-1, that this stream can
+  // carry.  Must be called before SetOffset() and SetBaseline().
+  void SetNumModules(const int n);
   void SetThresh(int thresh, int threshtype);
 
+  // Fill these histograms with every hit decoded from now on, or none if
+  // NULL.  See Monitor.h.
+  void SetMonitor(decode_histograms * h) { monitor = h; }
+
+  // Take containers for the hits of new packets from this pool instead of
+  // allocating them, or always allocate if NULL.  See HitPool.h.
+  void SetHitPool(HitPool * p) { hitpool = p; }
+
+  // Decompress compressed input files with help from threads taking slots
+  // of 'pool' for client 'client', or from threads of their own if NULL.
+  // See Compress.h.
+  void SetWorkers(WorkerPool * pool, const unsigned int client)
+  {
+    workers = pool;
+    workerclient = client;
+  }
+
+  // Keep what is decoded from each file in directory 'dir', and when the
+  // same file is decoded again, replay it from there instead.  See
+  // PacketCache.h.
+  void SetPacketCache(const std::string & dir) { cachedir = dir; }
+
+  // Key packets' times against this reference, which must be set before
+  // decoding.  See make_time_key().
+  void SetTimeKeyReference(uint64_t * ref) { timekeyref = ref; }
+
   // Set per-module timing offset on this USB stream.  As per Camillo:
   //
   // This is a feature that is included in the firmware of the pmt
@@ -18,7 +133,10 @@ public:
   // front  and the back of the CRT.
   void SetOffset(const int module, const int off);
 
-  void SetBaseline(const int base[64 /* maxModules */][64 /* numChannels */]);
+  // Indexed by module*64 + channel, with one entry for each module set in
+  // SetNumModules().
+  void SetBaseline(const std::vector<int> & base);
+  const std::vector<int> & GetBaseline() const { return baseline; }
 
   int GetUSB() const { return myusb; }
   const char* GetFileName() { return myfilename.c_str(); }
@@ -26,22 +144,48 @@ public:
 
   bool GetDecodedDataUpToNextUnixTimeStamp(std::vector<decoded_packet> & vec);
   void GetBaselineData(std::vector<decoded_packet> *vec);
+  // Open nextfile + "_" + the USB serial number
   int LoadFile(const std::string & nextfile);
-  void decodefile();
+
+  // Open the given file
+  int OpenFile(const std::string & filename);
+
+  // Decode the file opened.  Returns false if it could not all be read, as
+  // for a damaged compressed file, having decoded what could be.
+  bool decodefile();
+
+  // Decode 'len' bytes of raw data received from a live stream, called
+  // 'name' in messages, continuing from where the last call left off.  The
+  // chunk holding the first Unix time stamp is decoded again with the time,
+  // as a file is, so a stream decodes the same as files cut from it.
+  void decodestream(const std::string & name, const char * data,
+                    const unsigned int len);
+
+  // Write or read back everything needed to continue decoding this stream
+  // after a restart: the Unix time stamp state, any partially decoded
+  // packet and the decoded packets not yet handed out.  Return false on
+  // I/O error.
+  bool SaveState(FILE * f);
+  bool RestoreState(FILE * f);
+
+  // Totals over all files decoded so far
+  const corruption_counts & GetCorruptionCounts() const { return totalcounts; }
+
+  // The DAQ's own counts for the file or chunk just decoded, and totals
+  // over all of them
+  const daq_word_counts & GetChunkDAQCounts() const { return chunkdaq; }
+  const daq_word_counts & GetDAQCounts() const { return totaldaq; }
 
 private:
 
-  int16_t mythresh;
+  ThresholdCut cut;
   int myusb;
-  int baseline[64 /* maxModules */][64 /* numChannels */];
-  int offset[64 /* maxModules */];
-  int adj1[64];
-  int adj2[64];
+  int nummodules;
+  std::vector<int> baseline; // [module*64 + channel]
+  std::vector<int> offset; // [module]
   uint32_t mytolutc;
   std::string myfilename;
   std::fstream *myFile;
-  bool BothLayerThresh;
-  bool UseThresh;
 
   std::vector<decoded_packet> sortedpackets;
   std::vector<decoded_packet>::iterator sortedpacketsptr;
@@ -50,13 +194,47 @@ private:
   // These functions are for the decoding
   bool raw24bit_to_raw16bit(uint32_t d);
   void raw16bit_to_packets();
-  bool handle_unix_time_words(const uint32_t wordin);
-  bool ThresholdCut(const bool * const allhits, const bool * const threshits);
+  void add_decoded_packet(decoded_packet & packet, const bool parity_ok);
+  bool replay_cached(const std::string & cachename, const uint64_t key);
+  bool handle_control_words(const uint32_t wordin);
+  bool ShouldLogCorruption();
+  void begin_chunk();
+  void reset_byte_state();
+  bool decode_bytes(const char * data, const unsigned int len);
+  void end_chunk();
+  void NewHits(std::vector<decoded_hit> & hits);
 
   // These variables are for the decoding
   bool got_unix_time_hi;
   uint16_t unix_time_hi;
   uint16_t unix_time_lo;
+  uint32_t rawword; // 24-bit word being built, must be unsigned
+  char expcounter; // expecting this counter next
+  bool resyncing; // skipping corrupt bytes until a counter of 0
+  unsigned int c6words; // 0xc6 words so far of the report being read
+  uint16_t c6payload[4];
+
+  // For the file being decoded, and all files so far
+  corruption_counts filecounts, totalcounts;
+  unsigned int corruption_messages; // logged for the file being decoded
+
+  // From the DAQ's control words, for the file being decoded, and all files
+  daq_word_counts chunkdaq, totaldaq;
+
+  decode_histograms * monitor;
+
+  HitPool * hitpool;
+  std::vector< std::vector<decoded_hit> > sparehits; // taken from 'hitpool'
+
+  WorkerPool * workers;
+  unsigned int workerclient;
+
+  uint64_t * timekeyref;
+
+  // With SetPacketCache(), where packets are collected as they are parsed
+  // while a file is decoded
+  std::string cachedir;
+  PacketCacheWriter * cachewriter;
 };
 
 struct OVHitData {
@@ -73,6 +251,15 @@ struct OVHitData {
     return true;
   }
 
+  // Same as writeout(), but appends to 'buf' instead of writing to a file
+  void encode(std::string & buf) const
+  {
+    const uint16_t ncharge = htons(charge);
+    buf += 'H';
+    buf += (char)channel;
+    buf.append((const char *)&ncharge, sizeof ncharge);
+  }
+
   uint8_t channel;
   int16_t charge;
 };
@@ -92,6 +279,17 @@ struct OVEventHeader {
     return true;
   }
 
+  // Same as writeout(), but appends to 'buf' instead of writing to a file
+  void encode(std::string & buf) const
+  {
+    const uint16_t magic = htons(0x4556); // "EV"
+    const uint16_t nnov = htons(n_ov_data_packets);
+    const uint32_t ntime_sec = htonl(time_sec);
+    buf.append((const char *)&magic, sizeof magic);
+    buf.append((const char *)&nnov, sizeof nnov);
+    buf.append((const char *)&ntime_sec, sizeof ntime_sec);
+  }
+
   uint16_t n_ov_data_packets;
   uint32_t time_sec;
 };
@@ -113,6 +311,17 @@ struct OVDataPacketHeader {
     return true;
   }
 
+  // Same as writeout(), but appends to 'buf' instead of writing to a file
+  void encode(std::string & buf) const
+  {
+    const uint16_t nmodule = htons(module);
+    const uint32_t ntime16ns = htonl(time16ns);
+    buf += (char)0x4D; // "M"
+    buf += (char)nHits;
+    buf.append((const char *)&nmodule, sizeof nmodule);
+    buf.append((const char *)&ntime16ns, sizeof ntime16ns);
+  }
+
   uint8_t nHits;
   uint16_t module;
   uint32_t time16ns; // 32 bit counter, but should usually be < 2^29-1
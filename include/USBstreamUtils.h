@@ -1,3 +1,8 @@
+// The trigger system emits a sync pulse, which resets the modules' 62.5 MHz
+// clock counters, every 2^SYNC_PULSE_CLK_COUNT_PERIOD_LOG2 clock cycles.
+static const int SYNC_PULSE_CLK_COUNT_PERIOD_LOG2=29;
+static const uint64_t CLK_COUNT_PER_SECOND = 62500000;
+
 // A hit after decoding.  Happens to be the same as a OVHitData, but
 // semantically this is the in-memory format.
 struct decoded_hit {
@@ -13,12 +18,26 @@ struct decoded_packet {
     module = 0;
     timeunix = 0;
     time16ns = 0;
+    timekey = 0;
+  }
+
+  // Exchanges contents with 'o' without copying any hits, which is how
+  // packets are moved from one stage of the event builder to the next.
+  void swap(decoded_packet & o)
+  {
+    std::swap(isadc, o.isadc);
+    std::swap(module, o.module);
+    std::swap(timeunix, o.timeunix);
+    std::swap(time16ns, o.time16ns);
+    std::swap(timekey, o.timekey);
+    hits.swap(o.hits);
   }
 
   bool isadc; // ADC hits (true) or something else (false)
   uint16_t module;
   uint32_t timeunix;
   uint32_t time16ns;
+  uint64_t timekey; // from make_time_key(), for putting packets in order
   std::vector<decoded_hit> hits;
 };
 
@@ -28,7 +47,48 @@ struct decoded_packet {
 // indicate system-wide problems.)
 void log_msg(const int priority, const char * const format, ...);
 
+// Prefix every message logged from now on by the calling thread with
+// "[tag] ", or nothing if 'tag' is NULL or empty.  'tag' must stay valid
+// while it is in use.  For telling apart the builders sharing a process.
+void set_log_tag(const char * const tag);
+
 void start_log();
 
-bool LessThan(const decoded_packet & lhs,
-              const decoded_packet & rhs, const int ClockSlew);
+// Returns the time of a packet as a count of clock cycles on a single time
+// line shared by all USB streams, so that packets can be put in time order by
+// comparing these keys alone.  The clock counter is reset by each sync pulse;
+// which sync period the packet is in is found from how long ago, going by
+// its Unix time stamp, the counter was reset.  A module that missed sync
+// pulses just has a larger count since its last reset, so that is handled
+// too.  'reference' is the clock count at a sync pulse that keys are worked
+// out from, shared by all the streams of a run.  If it is zero, the first
+// packet keyed with a Unix time stamp sets it, and so the phase of the sync
+// periods for all the others.  Packets with no time stamp yet (timeunix 0)
+// are keyed by their clock count alone, which puts them before all the
+// others.  Thread-safe, as long as 'reference' is only otherwise accessed
+// atomically or while no packets are being keyed.
+uint64_t make_time_key(uint64_t & reference, const uint32_t timeunix,
+                       const uint32_t time16ns);
+
+/* Returns true if the packet 'lhs' is earlier in time than 'rhs' by more
+ * than 'ClockSlew' clock cycles */
+inline bool LessThan(const decoded_packet & lhs,
+                     const decoded_packet & rhs, const int ClockSlew)
+{
+  return lhs.timekey + ClockSlew < rhs.timekey;
+}
+
+// Moves all of the packets in 'src' onto the end of 'dst', leaving 'src'
+// empty.  The hits are not copied.
+void append_packets(std::vector<decoded_packet> & dst,
+                    std::vector<decoded_packet> & src);
+
+// Removes the first 'n' packets of 'v' without copying the hits of the rest
+void erase_front_packets(std::vector<decoded_packet> & v, const unsigned int n);
+
+// Fills 'baseptr', indexed by module*64 + channel, with the mean charge of
+// each channel of modules 0 through numModules-1 in 'BaselineData', the
+// packets decoded from baseline files.
+void calculate_pedestals(std::vector<int> & baseptr,
+                         const std::vector<decoded_packet> & BaselineData,
+                         const int numModules);
@@ -0,0 +1,59 @@
+// CPU time shared fairly between the builders running in one process.
+//
+// The pool has a fixed number of worker slots, normally one per CPU.  A
+// thread takes a slot for each piece of CPU-bound work it does (decoding a
+// file, building a range of events, encoding a batch) and gives it back
+// before it next waits on a queue, so a thread never holds a slot while
+// blocked on another stage.  When threads of several builders are waiting
+// for a slot, the next free one goes to the builder holding the fewest, so
+// a builder with a large backlog, like a reprocessing job, can't starve a
+// live run of CPU.  Thread-safe.
+
+class WorkerPool {
+
+public:
+
+  WorkerPool();
+  ~WorkerPool();
+
+  // Sets the number of slots.  Until this is called, there is no limit and
+  // Acquire() never waits.
+  void Init(const unsigned int nslots);
+  bool IsOn() const { return slots > 0; }
+
+  // Registers a builder, returning the number it takes slots under
+  unsigned int AddClient();
+
+  // Waits for a slot for client 'client', and takes it
+  void Acquire(const unsigned int client);
+
+  // Takes a slot for client 'client' if one is free and it is the client's
+  // turn, without waiting.  Returns whether it took one.
+  bool TryAcquire(const unsigned int client);
+
+  // Gives back a slot taken by Acquire()
+  void Release(const unsigned int client);
+
+private:
+
+  // Whether it is the turn of 'client' for the next free slot
+  bool MyTurn(const unsigned int client) const;
+
+  pthread_mutex_t lock;
+  pthread_cond_t freed;
+  unsigned int slots, inuse;
+  std::vector<unsigned int> held, waiting; // per client
+};
+
+// Holds a slot of a WorkerPool for as long as it exists
+struct worker_slot {
+  worker_slot(WorkerPool & pool_, const unsigned int client_):
+    pool(pool_), client(client_)
+  {
+    pool.Acquire(client);
+  }
+  ~worker_slot() { pool.Release(client); }
+
+  WorkerPool & pool;
+  const unsigned int client;
+};
@@ -0,0 +1,288 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "Archiver.h"
+#include "Compress.h"
+#include "Trace.h"
+
+// Seconds between looks for archived files old enough to delete
+static const int sweep_interval = 60;
+
+FileArchiver::FileArchiver()
+{
+  started = false;
+  inputfd = donefd = -1;
+  retention = 0;
+  compress = false;
+  released = 0;
+  stopping = false;
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&wake, NULL);
+}
+
+void FileArchiver::Start(const std::string & inputdir,
+                         const unsigned int retention_, const bool compress_)
+{
+  retention = retention_;
+  compress = compress_;
+
+  errno = 0;
+  inputfd = open(inputdir.c_str(), O_RDONLY | O_DIRECTORY);
+  if(inputfd < 0)
+    log_msg(LOG_CRIT, "Could not open directory %s: %s.\n", inputdir.c_str(),
+            strerror(errno));
+
+  errno = 0;
+  if(mkdirat(inputfd, "decoded", 0755) == -1 && errno != EEXIST)
+    log_msg(LOG_CRIT, "Could not create directory %s/decoded: %s.\n",
+            inputdir.c_str(), strerror(errno));
+
+  errno = 0;
+  donefd = openat(inputfd, "decoded", O_RDONLY | O_DIRECTORY);
+  if(donefd < 0)
+    log_msg(LOG_CRIT, "Could not open directory %s/decoded: %s.\n",
+            inputdir.c_str(), strerror(errno));
+
+  if(pthread_create(&thread, NULL, thread_main, this))
+    log_msg(LOG_CRIT, "Fatal Error: could not start archiver thread\n");
+  started = true;
+}
+
+void FileArchiver::Archive(const std::string & name, const unsigned int subrun)
+{
+  queued_file f;
+  f.subrun = subrun;
+  f.name = name.substr(name.rfind('/') + 1);
+
+  pthread_mutex_lock(&lock);
+  queue.push_back(f);
+  pthread_mutex_unlock(&lock);
+}
+
+void FileArchiver::Compress(const std::string & name)
+{
+  if(!compress) return;
+
+  pthread_mutex_lock(&lock);
+  tocompress.push_back(name.substr(name.rfind('/') + 1));
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+}
+
+void FileArchiver::Release(const unsigned int subrun)
+{
+  pthread_mutex_lock(&lock);
+  if(subrun + 1 > released) released = subrun + 1;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+}
+
+void FileArchiver::Stop()
+{
+  if(!started) return;
+
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+
+  pthread_join(thread, NULL);
+  close(donefd);
+  close(inputfd);
+  started = false;
+
+  if(!queue.empty())
+    log_msg(LOG_NOTICE, "Leaving %u input files of unfinished subruns "
+            "unarchived\n", (unsigned int)queue.size());
+  if(!backlog.empty())
+    log_msg(LOG_NOTICE, "Leaving %u archived files uncompressed until the "
+            "next start\n", (unsigned int)backlog.size());
+}
+
+void * FileArchiver::thread_main(void * archiver)
+{
+  ((FileArchiver *)archiver)->Run();
+  return NULL;
+}
+
+void FileArchiver::Run()
+{
+  time_t last_sweep = 0;
+  std::vector<std::string> ready;
+
+  trace_thread("archiver");
+
+  if(compress) FindUncompressed();
+
+  pthread_mutex_lock(&lock);
+  while(true){
+    ready.clear();
+    while(!queue.empty() && queue.front().subrun < released){
+      ready.push_back(queue.front().name);
+      queue.pop_front();
+    }
+
+    if(ready.empty()){
+      // Renames come first, so compress one file at a time between them
+      if(!tocompress.empty() || (!stopping && !backlog.empty())){
+        std::deque<std::string> & from =
+          tocompress.empty()? backlog: tocompress;
+        const std::string name = from.front();
+        from.pop_front();
+        pthread_mutex_unlock(&lock);
+        CompressOne(name);
+        pthread_mutex_lock(&lock);
+        continue;
+      }
+
+      if(stopping) break;
+
+      if(retention && time(0) - last_sweep >= sweep_interval){
+        pthread_mutex_unlock(&lock);
+        Sweep();
+        last_sweep = time(0);
+        pthread_mutex_lock(&lock);
+        continue;
+      }
+
+      timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_sec += sweep_interval;
+      pthread_cond_timedwait(&wake, &lock, &until);
+      continue;
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    const uint64_t begin = trace_clock();
+    for(unsigned int i = 0; i < ready.size(); i++){
+      const std::string done = ready[i] + ".done";
+      errno = 0;
+      if(renameat(inputfd, ready[i].c_str(), donefd, done.c_str()))
+        log_msg(LOG_CRIT, "Could not rename input file %s to decoded/%s: "
+                "%s.\n", ready[i].c_str(), done.c_str(), strerror(errno));
+    }
+
+    // Make the renames durable
+    if(fsync(donefd) != 0 || fsync(inputfd) != 0)
+      log_msg(LOG_ERR, "Could not fsync input directories: %s\n",
+              strerror(errno));
+    trace_span("archive", begin, -1, -1, -1);
+
+    pthread_mutex_lock(&lock);
+    if(compress)
+      for(unsigned int i = 0; i < ready.size(); i++)
+        tocompress.push_back(ready[i] + ".done");
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// Lists the files in directory 'dirfd'.  Returns false on failure.
+static bool list_dir(const int dirfd, std::vector<std::string> & names)
+{
+  names.clear();
+  const int fd = dup(dirfd);
+  DIR * dp = fd < 0? NULL: fdopendir(fd);
+  if(dp == NULL){
+    if(fd >= 0) close(fd);
+    log_msg(LOG_ERR, "Could not read the decoded/ directory: %s\n",
+            strerror(errno));
+    return false;
+  }
+  rewinddir(dp); // dup'd descriptors share their position
+
+  struct dirent * dirp;
+  while((dirp = readdir(dp)) != NULL) names.push_back(dirp->d_name);
+  closedir(dp);
+  return true;
+}
+
+static bool ends_with(const std::string & name, const std::string & suffix)
+{
+  return name.size() > suffix.size() &&
+         name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Whether archived file decoded/'name' is old enough to delete
+bool FileArchiver::PastRetention(const std::string & name, const time_t now)
+{
+  struct stat st;
+  return retention && fstatat(donefd, name.c_str(), &st, 0) == 0 &&
+         now - st.st_mtime >= (time_t)retention;
+}
+
+// Deletes archived files older than the retention time
+void FileArchiver::Sweep()
+{
+  std::vector<std::string> names;
+  if(!list_dir(donefd, names)) return;
+
+  const std::string compressed = std::string(".done") + compressed_suffix;
+  const time_t now = time(0);
+  unsigned int deleted = 0;
+  for(unsigned int i = 0; i < names.size(); i++){
+    const std::string & name = names[i];
+    if(!ends_with(name, ".done") && !ends_with(name, compressed)) continue;
+    if(!PastRetention(name, now)) continue;
+
+    if(unlinkat(donefd, name.c_str(), 0) == 0) deleted++;
+    else log_msg(LOG_ERR, "Could not delete decoded/%s: %s\n", name.c_str(),
+                 strerror(errno));
+  }
+
+  if(deleted)
+    log_msg(LOG_INFO, "Deleted %u archived input files past retention\n",
+            deleted);
+}
+
+// Queues the archived files not yet compressed, and finishes compressions
+// cut short: partly written files are deleted, as are files whose
+// compressed copy was already made durable
+void FileArchiver::FindUncompressed()
+{
+  std::vector<std::string> names;
+  if(!list_dir(donefd, names)) return;
+  std::sort(names.begin(), names.end());
+
+  const std::string compressed = std::string(".done") + compressed_suffix;
+  const time_t now = time(0);
+  for(unsigned int i = 0; i < names.size(); i++){
+    const std::string & name = names[i];
+    if(ends_with(name, compressed + ".tmp") ||
+       (ends_with(name, ".done") &&
+        std::binary_search(names.begin(), names.end(),
+                           name + compressed_suffix))){
+      if(unlinkat(donefd, name.c_str(), 0) != 0)
+        log_msg(LOG_ERR, "Could not delete decoded/%s: %s\n", name.c_str(),
+                strerror(errno));
+    }
+    else if(ends_with(name, ".done") && !PastRetention(name, now))
+      backlog.push_back(name);
+  }
+
+  if(!backlog.empty())
+    log_msg(LOG_INFO, "Compressing %u archived input files from before\n",
+            (unsigned int)backlog.size());
+}
+
+void FileArchiver::CompressOne(const std::string & name)
+{
+  const uint64_t begin = trace_clock();
+  compress_file(donefd, name, name + compressed_suffix);
+  trace_span("compress", begin, -1, -1, -1);
+}
@@ -0,0 +1,179 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+
+#include <string>
+#include <vector>
+
+#include "USBstream.h"
+#include "USBstreamUtils.h"
+#include "Checkpoint.h"
+
+static const uint32_t ckpt_magic = 0x4542434B; // "EBCK"
+
+// Bump this whenever the layout of what is written changes.
+static const uint32_t ckpt_version = 5;
+
+bool ckpt_write_u32(FILE * f, const uint32_t x)
+{
+  return 1 == fwrite(&x, sizeof x, 1, f);
+}
+
+bool ckpt_read_u32(FILE * f, uint32_t & x)
+{
+  return 1 == fread(&x, sizeof x, 1, f);
+}
+
+bool ckpt_write_u64(FILE * f, const uint64_t x)
+{
+  return 1 == fwrite(&x, sizeof x, 1, f);
+}
+
+bool ckpt_read_u64(FILE * f, uint64_t & x)
+{
+  return 1 == fread(&x, sizeof x, 1, f);
+}
+
+bool ckpt_write_string(FILE * f, const std::string & s)
+{
+  if(!ckpt_write_u32(f, s.size())) return false;
+  return s.empty() || 1 == fwrite(s.data(), s.size(), 1, f);
+}
+
+bool ckpt_read_string(FILE * f, std::string & s)
+{
+  uint32_t len;
+  if(!ckpt_read_u32(f, len)) return false;
+  s.resize(len);
+  return len == 0 || 1 == fread(&s[0], len, 1, f);
+}
+
+bool ckpt_write_packets(FILE * f, const std::vector<decoded_packet> & packets)
+{
+  if(!ckpt_write_u32(f, packets.size())) return false;
+
+  for(unsigned int i = 0; i < packets.size(); i++){
+    const decoded_packet & p = packets[i];
+    if(!ckpt_write_u32(f, p.isadc) ||
+       !ckpt_write_u32(f, p.module) ||
+       !ckpt_write_u32(f, p.timeunix) ||
+       !ckpt_write_u32(f, p.time16ns) ||
+       !ckpt_write_u64(f, p.timekey) ||
+       !ckpt_write_u32(f, p.hits.size()))
+      return false;
+
+    for(unsigned int h = 0; h < p.hits.size(); h++)
+      if(!ckpt_write_u32(f, p.hits[h].channel) ||
+         !ckpt_write_u32(f, (uint16_t)p.hits[h].charge))
+        return false;
+  }
+  return true;
+}
+
+bool ckpt_read_packets(FILE * f, std::vector<decoded_packet> & packets)
+{
+  uint32_t npackets;
+  if(!ckpt_read_u32(f, npackets)) return false;
+
+  packets.clear();
+  packets.resize(npackets);
+  for(unsigned int i = 0; i < npackets; i++){
+    decoded_packet & p = packets[i];
+    uint32_t isadc, module, nhits;
+    if(!ckpt_read_u32(f, isadc) ||
+       !ckpt_read_u32(f, module) ||
+       !ckpt_read_u32(f, p.timeunix) ||
+       !ckpt_read_u32(f, p.time16ns) ||
+       !ckpt_read_u64(f, p.timekey) ||
+       !ckpt_read_u32(f, nhits))
+      return false;
+    p.isadc = isadc;
+    p.module = module;
+
+    p.hits.resize(nhits);
+    for(unsigned int h = 0; h < nhits; h++){
+      uint32_t channel, charge;
+      if(!ckpt_read_u32(f, channel) || !ckpt_read_u32(f, charge))
+        return false;
+      p.hits[h].channel = channel;
+      p.hits[h].charge = (int16_t)(uint16_t)charge;
+    }
+  }
+  return true;
+}
+
+FILE * ckpt_begin(const std::string & name)
+{
+  const std::string tmpname = name + ".tmp";
+
+  errno = 0;
+  FILE * f = fopen(tmpname.c_str(), "wb");
+  if(f == NULL)
+    log_msg(LOG_CRIT, "Fatal Error: could not open checkpoint file %s: %s\n",
+            tmpname.c_str(), strerror(errno));
+
+  if(!ckpt_write_u32(f, ckpt_magic) || !ckpt_write_u32(f, ckpt_version))
+    log_msg(LOG_CRIT, "Fatal Error: could not write checkpoint file %s\n",
+            tmpname.c_str());
+
+  return f;
+}
+
+bool ckpt_commit(FILE * f, const std::string & name)
+{
+  const std::string tmpname = name + ".tmp";
+
+  errno = 0;
+  if(fflush(f) != 0 || fsync(fileno(f)) != 0){
+    log_msg(LOG_ERR, "Could not flush checkpoint %s: %s\n",
+            tmpname.c_str(), strerror(errno));
+    fclose(f);
+    return false;
+  }
+
+  if(fclose(f) != 0){
+    log_msg(LOG_ERR, "Could not close checkpoint %s\n", tmpname.c_str());
+    return false;
+  }
+
+  errno = 0;
+  if(rename(tmpname.c_str(), name.c_str()) != 0){
+    log_msg(LOG_ERR, "Could not rename checkpoint %s to %s: %s\n",
+            tmpname.c_str(), name.c_str(), strerror(errno));
+    return false;
+  }
+
+  // Make the rename itself durable.  dirname() may modify its argument.
+  std::string namecopy = name;
+  const int dirfd = open(dirname(&namecopy[0]), O_RDONLY | O_DIRECTORY);
+  if(dirfd < 0 || fsync(dirfd) != 0){
+    log_msg(LOG_ERR, "Could not fsync directory of checkpoint %s\n",
+            name.c_str());
+    if(dirfd >= 0) close(dirfd);
+    return false;
+  }
+  close(dirfd);
+
+  return true;
+}
+
+FILE * ckpt_open(const std::string & name)
+{
+  FILE * f = fopen(name.c_str(), "rb");
+  if(f == NULL) return NULL;
+
+  uint32_t magic = 0, version = 0;
+  if(!ckpt_read_u32(f, magic) || magic != ckpt_magic)
+    log_msg(LOG_CRIT, "Fatal Error: %s is not a checkpoint file\n",
+            name.c_str());
+  if(!ckpt_read_u32(f, version) || version != ckpt_version)
+    log_msg(LOG_CRIT, "Fatal Error: checkpoint %s has version %u, but I can "
+            "only read version %u\n", name.c_str(), version, ckpt_version);
+
+  return f;
+}
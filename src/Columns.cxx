@@ -0,0 +1,191 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "EventEncoder.h"
+#include "Columns.h"
+
+static const uint32_t columns_magic = 0x4C434245; // "EBCL"
+
+// Bump this whenever the layout of column files changes
+static const uint32_t columns_version = 1;
+
+static const size_t header_bytes = 64;
+static const size_t column_align = 64;
+
+void EventColumns::Clear()
+{
+  event_end.clear();
+  event_time.clear();
+  module.clear();
+  time16ns.clear();
+  charge_sum.clear();
+  hit_end.clear();
+  channel.clear();
+  charge.clear();
+}
+
+void EventColumns::AddEvent(const decoded_packet * const packets,
+                            const int * const usbindex,
+                            const unsigned int npackets,
+                            const EventEncoder & encoder)
+{
+  if(npackets == 0) return;
+
+  for(unsigned int i = 0; i < npackets; i++){
+    const decoded_packet & p = packets[i];
+    if(!p.isadc) continue;
+
+    // Unknown modules are encoded as module 0
+    module.push_back(std::max(0, encoder.OutModule(usbindex[i], p.module)));
+    time16ns.push_back(p.time16ns);
+
+    int32_t sum = 0;
+    for(unsigned int h = 0; h < p.hits.size(); h++){
+      channel.push_back(p.hits[h].channel);
+      charge.push_back(p.hits[h].charge);
+      sum += p.hits[h].charge;
+    }
+    charge_sum.push_back(sum);
+    hit_end.push_back(channel.size());
+  }
+
+  event_time.push_back(packets[0].timeunix);
+  event_end.push_back(module.size());
+}
+
+template<class T>
+static void append_vector(std::vector<T> & to, const std::vector<T> & from)
+{
+  to.insert(to.end(), from.begin(), from.end());
+}
+
+void EventColumns::Append(const EventColumns & o)
+{
+  const uint64_t npackets = module.size(), nhits = channel.size();
+  for(unsigned int i = 0; i < o.event_end.size(); i++)
+    event_end.push_back(o.event_end[i] + npackets);
+  for(unsigned int i = 0; i < o.hit_end.size(); i++)
+    hit_end.push_back(o.hit_end[i] + nhits);
+
+  append_vector(event_time, o.event_time);
+  append_vector(module, o.module);
+  append_vector(time16ns, o.time16ns);
+  append_vector(charge_sum, o.charge_sum);
+  append_vector(channel, o.channel);
+  append_vector(charge, o.charge);
+}
+
+template<class T>
+static const void * data_of(const std::vector<T> & v)
+{
+  return v.empty()? NULL: &v[0];
+}
+
+// Writes out the columns one at a time, padding each to column_align bytes,
+// and collects the index
+class column_writer {
+
+public:
+
+  column_writer(FILE * f_)
+  {
+    f = f_;
+    pos = header_bytes;
+    ok = true;
+  }
+
+  // Writes column 'name' of 'count' elements of 'size' bytes from 'data',
+  // after 'first' if not NULL, which counts as one more element
+  void Add(const char * const name, const void * const data,
+           const uint32_t size, const uint64_t count,
+           const void * const first = NULL)
+  {
+    char entry[32] = {0};
+    const uint64_t total = count + (first != NULL);
+    memcpy(entry, name, std::min<size_t>(strlen(name), 11));
+    memcpy(entry + 12, &size,  4);
+    memcpy(entry + 16, &pos,   8);
+    memcpy(entry + 24, &total, 8);
+    index.append(entry, sizeof entry);
+
+    if(first != NULL) ok = ok && 1 == fwrite(first, size, 1, f);
+    if(count) ok = ok && 1 == fwrite(data, size*count, 1, f);
+    pos += size*total;
+    pad();
+  }
+
+  // Writes the index and trailer.  Returns whether everything was written.
+  bool Finish()
+  {
+    const uint64_t indexpos = pos;
+    const uint32_t ncolumns = index.size()/32;
+    ok = ok && 1 == fwrite(index.data(), index.size(), 1, f) &&
+         1 == fwrite(&indexpos, 8, 1, f) && 1 == fwrite(&ncolumns, 4, 1, f) &&
+         1 == fwrite(&columns_magic, 4, 1, f);
+    return ok;
+  }
+
+private:
+
+  void pad()
+  {
+    static const char zeros[column_align] = {0};
+    const size_t n = (column_align - pos % column_align) % column_align;
+    if(n) ok = ok && 1 == fwrite(zeros, n, 1, f);
+    pos += n;
+  }
+
+  FILE * f;
+  uint64_t pos;
+  std::string index;
+  bool ok;
+};
+
+bool EventColumns::Write(const std::string & name) const
+{
+  const std::string tmpname = name + ".tmp";
+  errno = 0;
+  FILE * f = fopen(tmpname.c_str(), "wb");
+  if(f == NULL){
+    log_msg(LOG_ERR, "Could not write columns %s: %s\n",
+            tmpname.c_str(), strerror(errno));
+    return false;
+  }
+
+  char header[header_bytes] = {0};
+  const uint64_t counts[] = { Events(), module.size(), channel.size() };
+  memcpy(header,     &columns_magic,   4);
+  memcpy(header + 4, &columns_version, 4);
+  memcpy(header + 8, counts, sizeof counts);
+
+  const uint64_t zero = 0;
+  column_writer w(f);
+  bool ok = 1 == fwrite(header, header_bytes, 1, f);
+  w.Add("event_first", data_of(event_end), 8, event_end.size(), &zero);
+  w.Add("event_time", data_of(event_time), 4, event_time.size());
+  w.Add("module", data_of(module), 2, module.size());
+  w.Add("time16ns", data_of(time16ns), 4, time16ns.size());
+  w.Add("charge_sum", data_of(charge_sum), 4, charge_sum.size());
+  w.Add("hit_first", data_of(hit_end), 8, hit_end.size(), &zero);
+  w.Add("channel", data_of(channel), 1, channel.size());
+  w.Add("charge", data_of(charge), 2, charge.size());
+  ok = w.Finish() && ok;
+
+  if(fclose(f) != 0 || !ok || rename(tmpname.c_str(), name.c_str()) != 0){
+    log_msg(LOG_ERR, "Could not write columns %s: %s\n",
+            name.c_str(), strerror(errno));
+    unlink(tmpname.c_str());
+    return false;
+  }
+  return true;
+}
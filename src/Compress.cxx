@@ -0,0 +1,465 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef EB_ZSTD
+#include <zstd.h>
+#endif
+#ifdef EB_LZ4
+#include <lz4.h>
+#endif
+#ifdef EB_ZLIB
+#include <zlib.h>
+#endif
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "WorkerPool.h"
+#include "Compress.h"
+
+const char * const compressed_suffix = ".ebz";
+
+static const uint32_t compressed_magic = 0x315A4245; // "EBZ1"
+
+static const size_t header_bytes = 32;
+static const size_t block_header_bytes = 8;
+
+// Big enough to compress well, small enough that an input file of a few
+// megabytes gives each decompressing thread something to do
+static const uint32_t block_bytes = 1 << 20;
+
+// Background threads decompressing each file being read, besides the
+// reader.  Every USB stream's decoder reads its own files, so there are
+// already several files at once.
+static const unsigned int decompress_threads = 4;
+
+enum codec_id { kZlib = 1, kLZ4 = 2, kZstd = 3 };
+
+static const char * codec_name(const uint32_t codec)
+{
+  switch(codec){
+    case kZlib: return "zlib";
+    case kLZ4:  return "LZ4";
+    case kZstd: return "zstd";
+    default:    return NULL;
+  }
+}
+
+// The codec new files are compressed with, or 0 if none is built in
+static uint32_t write_codec()
+{
+#if defined(EB_ZSTD)
+  return kZstd;
+#elif defined(EB_LZ4)
+  return kLZ4;
+#elif defined(EB_ZLIB)
+  return kZlib;
+#else
+  return 0;
+#endif
+}
+
+static bool codec_built_in(const uint32_t codec)
+{
+  switch(codec){
+#ifdef EB_ZSTD
+    case kZstd: return true;
+#endif
+#ifdef EB_LZ4
+    case kLZ4:  return true;
+#endif
+#ifdef EB_ZLIB
+    case kZlib: return true;
+#endif
+    default:    return false;
+  }
+}
+
+const char * compression_codec()
+{
+  return codec_name(write_codec());
+}
+
+bool is_compressed_name(const std::string & name)
+{
+  const size_t n = strlen(compressed_suffix);
+  return name.size() > n &&
+         name.compare(name.size() - n, n, compressed_suffix) == 0;
+}
+
+// Compresses the 'len' bytes at 'in' into 'out' with 'codec'.  Returns the
+// compressed length, or 0 if it didn't fit in 'cap' bytes.
+static size_t compress_block(const uint32_t codec, const char * in,
+                             const size_t len, char * out, const size_t cap)
+{
+  switch(codec){
+#ifdef EB_ZSTD
+    case kZstd: {
+      const size_t n = ZSTD_compress(out, cap, in, len, 1);
+      return ZSTD_isError(n)? 0: n;
+    }
+#endif
+#ifdef EB_LZ4
+    case kLZ4:
+      return std::max(0, LZ4_compress_default(in, out, len, cap));
+#endif
+#ifdef EB_ZLIB
+    case kZlib: {
+      uLongf n = cap;
+      return compress2((Bytef *)out, &n, (const Bytef *)in, len,
+                       Z_BEST_SPEED) == Z_OK? n: 0;
+    }
+#endif
+    default:
+      (void)in; (void)len; (void)out; (void)cap;
+      return 0;
+  }
+}
+
+// Decompresses the 'len' bytes at 'in' into the 'outlen' bytes at 'out'
+// with 'codec'.  Returns whether exactly that many came out.
+static bool decompress_block(const uint32_t codec, const char * in,
+                             const size_t len, char * out,
+                             const size_t outlen)
+{
+  if(len == outlen){ // stored raw
+    memcpy(out, in, len);
+    return true;
+  }
+
+  switch(codec){
+#ifdef EB_ZSTD
+    case kZstd:
+      return ZSTD_decompress(out, outlen, in, len) == outlen;
+#endif
+#ifdef EB_LZ4
+    case kLZ4:
+      return LZ4_decompress_safe(in, out, len, outlen) == (int)outlen;
+#endif
+#ifdef EB_ZLIB
+    case kZlib: {
+      uLongf n = outlen;
+      return uncompress((Bytef *)out, &n, (const Bytef *)in, len) == Z_OK &&
+             n == outlen;
+    }
+#endif
+    default:
+      return false;
+  }
+}
+
+// Maps all of file 'fd' read-only, setting 'len'.  Returns NULL on failure,
+// or for an empty file.
+static const char * map_file(const int fd, size_t & len)
+{
+  struct stat st;
+  if(fstat(fd, &st) < 0 || st.st_size == 0) return NULL;
+
+  len = st.st_size;
+  void * m = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(m == MAP_FAILED) return NULL;
+  madvise(m, len, MADV_SEQUENTIAL);
+  return (const char *)m;
+}
+
+bool compress_file(const int dirfd, const std::string & from,
+                   const std::string & to)
+{
+  const uint32_t codec = write_codec();
+  const std::string tmpname = to + ".tmp";
+
+  errno = 0;
+  const int infd = openat(dirfd, from.c_str(), O_RDONLY);
+  struct stat st;
+  if(infd < 0 || fstat(infd, &st) < 0){
+    log_msg(LOG_ERR, "Could not read decoded/%s to compress it: %s\n",
+            from.c_str(), strerror(errno));
+    if(infd >= 0) close(infd);
+    return false;
+  }
+
+  size_t inlen = 0;
+  const char * in = map_file(infd, inlen);
+  close(infd);
+  if(in == NULL && st.st_size != 0){
+    log_msg(LOG_ERR, "Could not map decoded/%s to compress it: %s\n",
+            from.c_str(), strerror(errno));
+    return false;
+  }
+
+  errno = 0;
+  const int outfd = openat(dirfd, tmpname.c_str(),
+                           O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  FILE * f = outfd < 0? NULL: fdopen(outfd, "wb");
+  if(f == NULL){
+    log_msg(LOG_ERR, "Could not write decoded/%s: %s\n", tmpname.c_str(),
+            strerror(errno));
+    if(outfd >= 0) close(outfd);
+    if(in != NULL) munmap((void *)in, inlen);
+    return false;
+  }
+
+  char header[header_bytes] = {0};
+  const uint64_t sizes[] = {
+    inlen, (inlen + block_bytes - 1)/block_bytes
+  };
+  memcpy(header,      &compressed_magic, 4);
+  memcpy(header +  4, &codec,            4);
+  memcpy(header +  8, &block_bytes,      4);
+  memcpy(header + 16, sizes, sizeof sizes);
+  bool ok = 1 == fwrite(header, header_bytes, 1, f);
+
+  std::vector<char> out(block_bytes);
+  for(size_t pos = 0; ok && pos < inlen; pos += block_bytes){
+    const uint32_t rawlen = std::min<size_t>(block_bytes, inlen - pos);
+    uint32_t len = compress_block(codec, in + pos, rawlen, &out[0],
+                                  rawlen - 1);
+    const char * stored = &out[0];
+    if(len == 0){
+      len = rawlen;
+      stored = in + pos;
+    }
+
+    ok = 1 == fwrite(&rawlen, 4, 1, f) && 1 == fwrite(&len, 4, 1, f) &&
+         1 == fwrite(stored, len, 1, f);
+  }
+  if(in != NULL) munmap((void *)in, inlen);
+
+  // Keep the modification time, which the retention time is counted from
+  const struct timespec times[2] = { st.st_atim, st.st_mtim };
+  ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0 &&
+       futimens(fileno(f), times) == 0;
+  if(fclose(f) != 0 || !ok ||
+     renameat(dirfd, tmpname.c_str(), dirfd, to.c_str()) != 0 ||
+     fsync(dirfd) != 0){
+    log_msg(LOG_ERR, "Could not write decoded/%s: %s\n", to.c_str(),
+            strerror(errno));
+    unlinkat(dirfd, tmpname.c_str(), 0);
+    return false;
+  }
+
+  // Only now that the compressed file is durable
+  if(unlinkat(dirfd, from.c_str(), 0) != 0)
+    log_msg(LOG_ERR, "Could not delete decoded/%s: %s\n", from.c_str(),
+            strerror(errno));
+  return true;
+}
+
+bool decompress_file(const std::string & from, const std::string & to)
+{
+  CompressedFile in;
+  if(!in.Open(from)){
+    log_msg(LOG_ERR, "Could not read compressed file %s\n", from.c_str());
+    return false;
+  }
+  const char * data = in.Data(in.Size());
+
+  const std::string tmpname = to + ".tmp";
+  errno = 0;
+  FILE * f = fopen(tmpname.c_str(), "wb");
+  if(f == NULL){
+    log_msg(LOG_ERR, "Could not write %s: %s\n", tmpname.c_str(),
+            strerror(errno));
+    return false;
+  }
+
+  const bool ok = data != NULL &&
+    (in.Size() == 0 || 1 == fwrite(data, in.Size(), 1, f)) &&
+    fflush(f) == 0 && fsync(fileno(f)) == 0;
+  if(fclose(f) != 0 || !ok || rename(tmpname.c_str(), to.c_str()) != 0){
+    log_msg(LOG_ERR, "Could not decompress %s to %s: %s\n", from.c_str(),
+            to.c_str(), strerror(errno));
+    unlink(tmpname.c_str());
+    return false;
+  }
+  return true;
+}
+
+CompressedFile::CompressedFile()
+{
+  map = NULL;
+  maplen = 0;
+  codec = 0;
+  rawsize = 0;
+  next = ndone = 0;
+  damaged = stopping = false;
+  workers = NULL;
+  workerclient = 0;
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&progress, NULL);
+}
+
+CompressedFile::~CompressedFile()
+{
+  Close();
+  pthread_cond_destroy(&progress);
+  pthread_mutex_destroy(&lock);
+}
+
+void CompressedFile::Close()
+{
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_mutex_unlock(&lock);
+  for(unsigned int i = 0; i < threads.size(); i++)
+    pthread_join(threads[i], NULL);
+  threads.clear();
+
+  if(map != NULL) munmap((void *)map, maplen);
+  map = NULL;
+  maplen = 0;
+  codec = 0;
+  rawsize = 0;
+  blocks.clear();
+  std::vector<char>().swap(raw);
+  done.clear();
+  next = ndone = 0;
+  damaged = stopping = false;
+}
+
+void CompressedFile::SetWorkers(WorkerPool * pool, const unsigned int client)
+{
+  workers = pool;
+  workerclient = client;
+}
+
+bool CompressedFile::Open(const std::string & name)
+{
+  Close();
+
+  const int fd = open(name.c_str(), O_RDONLY);
+  if(fd < 0) return false;
+  map = map_file(fd, maplen);
+  close(fd);
+  if(map == NULL) return false;
+
+  uint32_t magic = 0, blocksize = 0;
+  uint64_t sizes[2] = {0, 0};
+  if(maplen >= header_bytes){
+    memcpy(&magic,     map,      4);
+    memcpy(&codec,     map +  4, 4);
+    memcpy(&blocksize, map +  8, 4);
+    memcpy(sizes,      map + 16, sizeof sizes);
+  }
+  if(magic != compressed_magic){
+    Close();
+    return false;
+  }
+  if(!codec_built_in(codec)){
+    log_msg(LOG_ERR, "%s is compressed with %s, which this build cannot "
+            "read\n", name.c_str(),
+            codec_name(codec) != NULL? codec_name(codec): "an unknown codec");
+    Close();
+    return false;
+  }
+  rawsize = sizes[0];
+
+  // Find all of the blocks, and check that they fit, before any is used
+  size_t pos = header_bytes;
+  uint64_t out = 0;
+  for(uint64_t i = 0; i < sizes[1] && pos + block_header_bytes <= maplen;
+      i++){
+    block b;
+    memcpy(&b.outlen, map + pos,     4);
+    memcpy(&b.inlen,  map + pos + 4, 4);
+    b.in = pos + block_header_bytes;
+    b.out = out;
+    if(b.outlen == 0 || b.outlen > blocksize || b.inlen > b.outlen) break;
+
+    pos = b.in + b.inlen;
+    out += b.outlen;
+    blocks.push_back(b);
+  }
+  if(blocks.size() != sizes[1] || pos != maplen || out != rawsize){
+    log_msg(LOG_WARNING, "Compressed file %s is damaged\n", name.c_str());
+    Close();
+    return false;
+  }
+
+  raw.resize(rawsize);
+  done.resize(blocks.size(), false);
+
+  const unsigned int nthreads =
+    std::min<size_t>(decompress_threads, blocks.size());
+  for(unsigned int i = 0; i < nthreads; i++){
+    pthread_t t;
+    if(pthread_create(&t, NULL, thread_main, this))
+      log_msg(LOG_CRIT, "Fatal Error: could not start decompression "
+              "thread\n");
+    threads.push_back(t);
+  }
+  return true;
+}
+
+void * CompressedFile::thread_main(void * file)
+{
+  ((CompressedFile *)file)->Work();
+  return NULL;
+}
+
+// Decompresses the next block no thread has taken yet.  Returns false if
+// there was none to take.
+bool CompressedFile::DecompressNext()
+{
+  pthread_mutex_lock(&lock);
+  if(stopping || damaged || next == blocks.size()){
+    pthread_mutex_unlock(&lock);
+    return false;
+  }
+  const unsigned int i = next++;
+  pthread_mutex_unlock(&lock);
+
+  const block & b = blocks[i];
+  const bool ok = decompress_block(codec, map + b.in, b.inlen,
+                                   &raw[b.out], b.outlen);
+
+  pthread_mutex_lock(&lock);
+  if(!ok) damaged = true;
+  done[i] = true;
+  while(ndone < blocks.size() && done[ndone]) ndone++;
+  pthread_cond_broadcast(&progress);
+  pthread_mutex_unlock(&lock);
+  return true;
+}
+
+// A background thread.  It never waits for a slot, since the reader may be
+// holding one while it waits for the blocks, or to join this thread.
+void CompressedFile::Work()
+{
+  while(workers == NULL || workers->TryAcquire(workerclient)){
+    const bool more = DecompressNext();
+    if(workers != NULL) workers->Release(workerclient);
+    if(!more) break;
+  }
+}
+
+// The reader takes blocks itself rather than only wait for them, so that
+// the file is read even if no background thread gets a slot
+const char * CompressedFile::Data(const uint64_t end)
+{
+  pthread_mutex_lock(&lock);
+  while(!damaged && ndone < blocks.size() &&
+        blocks[ndone].out < end){
+    if(next < blocks.size()){
+      pthread_mutex_unlock(&lock);
+      DecompressNext();
+      pthread_mutex_lock(&lock);
+    }
+    else
+      pthread_cond_wait(&progress, &lock);
+  }
+  const bool ok = !damaged;
+  pthread_mutex_unlock(&lock);
+
+  if(!ok) return NULL;
+  return raw.empty()? "": &raw[0];
+}
@@ -4,7 +4,6 @@
 #include <pthread.h>
 #include <errno.h>
 #include <syslog.h>
-#include <libgen.h>
 #include <dirent.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
@@ -19,11 +18,29 @@
 
 #include <algorithm>
 #include <map>
+#include <set>
 #include <deque>
 #include <vector>
 
 #include "USBstream.h"
 #include "USBstreamUtils.h"
+#include "Checkpoint.h"
+#include "Merge.h"
+#include "SPSCQueue.h"
+#include "OutputFile.h"
+#include "Trigger.h"
+#include "ShmRing.h"
+#include "Monitor.h"
+#include "HitPool.h"
+#include "Trace.h"
+#include "Scheduler.h"
+#include "Archiver.h"
+#include "SocketIngest.h"
+#include "WorkerPool.h"
+#include "EventEncoder.h"
+#include "Spill.h"
+#include "Columns.h"
+#include "Compress.h"
 
 using std::vector;
 using std::string;
@@ -58,17 +75,10 @@ struct usb_sbop{
 // this effect once per minute.
 const int max_filesets_subrun = 12;
 
-static const int maxUSB=10; // Maximum number of USB streams
 static const int latency=5; // Seconds before DAQ switches files.
                             // FixME: 5 anticipated for far detector
 
-static const int numChannels=64; // Number of channels in M64
-static const int maxModules=64; // Maximum number of modules PER USB
-                                // (okay if less than total number of modules)
-
-// Map from USB serial numbers to their location in array of OVUSBStreams
-// (sigh).  Filled in setup_from_config().
-static map<int, int> usbserial_to_usbindex;
+static const int maxModuleNumber=127; // Module numbers are 7 bits in the data
 
 // Will stop if we haven't seen a new input file in ENDTIME seconds when
 // we know the run is over or MAXTIME seconds regardless. For Double
@@ -76,51 +86,488 @@ static map<int, int> usbserial_to_usbindex;
 static const int MAXTIME=5;
 static const int ENDTIME=1;
 
-static const int SYNC_PULSE_CLK_COUNT_PERIOD_LOG2=29; // trigger system emits
-                                                      // sync pulse at 62.5MHz
+// Milliseconds of data taken from the sockets at a time.  Each such chunk
+// counts as a file set.
+static const unsigned int ingest_chunk_ms = 1000;
+
+/*
+  The building runs as a pipeline of threads, each stage connected to the
+  next by bounded queues:
+
+    reader --> decoder (one per USB stream) --> merger --> serializer --> writer
+                                                           (one or more)
+
+  The reader finds sets of input files and hands each USB stream's file to
+  that stream's decoder.  Each decoder decodes, archives the file, and passes
+  the decoded data up to the next Unix time stamp to the merger.  The merger
+  builds events once per subrun and passes them, in batches, to the
+  serializers, which encode them in the output format for the writer.
+  Each message goes through every stage in order, so the end of a subrun is
+  marked by a message that follows its data down the pipeline.  With several
+  serializers, the merger deals messages out to them in turn and the writer
+  takes them back in the same turn, so they are written in order.
+*/
+enum pipeline_msg_type { kFileSet, kEndSubrun, kEndRun };
+
+// From the reader to a decoder
+struct decode_msg {
+  pipeline_msg_type type;
+  unsigned int subrun;
+  unsigned int fileset; // for kFileSet, counting from zero for the run
+  string file; // Input file name
+};
+
+// From a decoder to the merger
+struct slice_msg {
+  pipeline_msg_type type;
+  unsigned int subrun;
+  vector<decoded_packet> packets; // for kFileSet
+  uint32_t tolutc; // for kFileSet, Unix time stamp decoded up to
+  daq_word_counts daq; // for kFileSet, as reported by the DAQ in the slice
+  string state; // for kEndSubrun with -k, the decoder's checkpoint state
+};
 
-// Mutated as program runs
-static int OV_EB_State = 0;
-static int initial_delay = 0;
+// From the merger to the serializer to the writer.  kFileSet here means
+// a batch of events.
+struct build_batch {
+  pipeline_msg_type type;
+  unsigned int subrun;
+
+  // Built events, filled by the merger and emptied by the serializer.  Event
+  // i consists of packets [event_end[i-1], event_end[i]).
+  vector<decoded_packet> packets;
+  vector<int> usbindex;
+  vector<unsigned int> event_end;
+
+  string bytes; // Encoded events, filled by the serializer
+  unsigned int nencoded; // how many events are in 'bytes'
+  string sidebytes; // Encoded prescaled events failing the trigger, by the
+                    // writer, which alone knows which to keep
+  vector<unsigned int> rejected; // events failing the trigger, with prescale
+  sync_record sync; // of all the events, for the writer to check in order
+  EventColumns columns; // of the events in 'bytes', with -F
+
+  // For kEndSubrun
+  unsigned int nevents;
+  uint32_t tolutc;
+  string checkpoint; // With -k, what to write out once the subrun is safe
+
+  // Empties the batch for reuse, keeping the memory it has allocated
+  void Reset(const pipeline_msg_type type_, const unsigned int subrun_)
+  {
+    type = type_;
+    subrun = subrun_;
+    packets.clear();
+    usbindex.clear();
+    event_end.clear();
+    bytes.clear();
+    sidebytes.clear();
+    rejected.clear();
+    sync.clear();
+    columns.Clear();
+    checkpoint.clear();
+    nencoded = nevents = 0;
+    tolutc = 0;
+  }
+};
 
-// Set in parse_options()
-static int Threshold = 73; //default 1.5 PE threshold
-static string OutBase; // output file
-static TriggerMode EBTrigMode = kDoubleLayer; // double-layer threshold
-static string InputDir; // input data directory
+// Number of events passed from the merger to the serializer at a time
+static const unsigned int EventsPerBatch = 1024;
+
+// Where events go as they are built: the batch being filled, whose last
+// event is still open until a packet arrives too late to belong to it, and
+// where to put full batches: straight to the serializer if 'full' is NULL,
+// or onto 'full', for a range being built in another thread.
+struct event_sink {
+  build_batch * b;
+  vector<build_batch *> * full;
+  unsigned int nevents; // events completed
+};
 
-// Set in setup_from_config() and used throughout
-static unsigned int numUSB = 0;
+class RunBuilder;
+
+// The events of one time range of the data, built by build_range().
+struct range_job {
+  RunBuilder * builder;
+  vector< vector<decoded_packet> > * data;
+  vector<unsigned int> begin, end; // range of packets of each stream
+  unsigned int subrun;
+
+  // Only the first range starts with the event carried over from last
+  // time, and only the last range's last event may be incomplete.
+  bool first, last;
+
+  // Output: full batches of complete events, and for the last range, its
+  // last event.
+  vector<build_batch *> batches;
+  vector<decoded_packet> open;
+  vector<int> openindex;
+  unsigned int nevents;
+};
 
-// Maps {USB_serial, board_number}, the input numbering convention, to
-// pmtboard_u, the output numbering convention
-static map<std::pair<int, int>, uint16_t> PMTUniqueMap;
+// The stages of the pipeline that run in their own threads
+enum pipeline_stage { kDecoder, kMerger, kSerializer, kWriter };
+
+// Everything needed to build one run from one input directory with one
+// configuration.  Several can run in the same process, each with its own
+// pipeline, sharing the CPUs through Workers.
+class RunBuilder {
+
+public:
+
+  RunBuilder();
+
+  // Sets up from the command line, or a line of the instances file given
+  // with -d if 'instance' is true, exiting on bad options.
+  void parse_options(int argc, char **argv, const bool instance);
+
+  // Sets up from the config and baselines and builds the run, returning
+  // once it is over.  Exits via LOG_CRIT on fatal errors.
+  void Run();
+
+  const string & GetInputDir() const { return InputDir; }
+  const string & GetOutBase() const { return OutBase; }
+
+  // Prefix for the log messages of this builder, if not empty
+  string Name;
+
+private:
+
+  // What each pipeline thread is started with
+  struct stage_start {
+    RunBuilder * builder;
+    pipeline_stage stage;
+    unsigned int index; // USB index of a decoder, or number of a serializer
+  };
+  static void * run_stage(void * arg);
+  static void * build_range_thread(void * job);
+
+  void check_status(const vector<string> & files);
+  bool TryInitRun();
+  bool InitRun();
+  bool FindNextFileSet(vector<string> & names);
+  bool GetBaselines();
+  bool LoadBaselineData();
+  void setup_from_config(const string & configfile);
+  bool write_end_block_and_close(OutputFile & data_file);
+  build_batch * new_batch(const pipeline_msg_type type,
+                          const unsigned int subrun);
+  void close_event(event_sink & sink);
+  void add_packet(event_sink & sink, decoded_packet & packet, const int usb);
+  void flush_events();
+  void build_range(range_job & job);
+  unsigned int SuperBuildEventsInRanges(const unsigned int subrun,
+                                        const unsigned int nranges_wanted);
+  unsigned int SuperBuildEvents(const unsigned int subrun);
+  void spill_current();
+  unsigned int SuperBuildSpilled(const unsigned int subrun);
+  void retire_file_we_have_read(const unsigned int j,
+                                const unsigned int subrun);
+  void reconcile_input_with_checkpoint();
+  string checkpoint_name();
+  string stream_checkpoint_state(const unsigned int j);
+  string checkpoint_state(const unsigned int subrun,
+                          const vector<string> & stream_states);
+  bool write_checkpoint(const unsigned int subrun, const string & state);
+  unsigned int resume_from_checkpoint();
+  void add_offline_files(const string & dir, const string & suffix,
+                         vector< vector< std::pair<unsigned long, string> > > & stamps);
+  void find_offline_files();
+  bool NextOfflineFileSet(vector<string> & names);
+  unsigned int waiting_filesets();
+  bool run_ended() const;
+  bool NextIngestChunk(vector<string> & names);
+  bool HandleFindNextFileSet(vector<string> & names);
+  void send_to_decoders(const pipeline_msg_type type,
+                        const unsigned int subrun,
+                        const unsigned int fileset,
+                        const vector<string> & names);
+  void read_files(const unsigned int first_subrun);
+  void archive_received(const unsigned int j, const unsigned int fileset,
+                        const string & buf, const size_t len);
+  void extract_slice(const unsigned int j, slice_msg * slice);
+  void cut_slice(const unsigned int j, const uint32_t stamp,
+                 slice_msg * slice);
+  void send_to_branches(const unsigned int j, slice_msg * slice);
+  void copy_packet(const unsigned int j, const decoded_packet & p,
+                   slice_msg * copy);
+  void decoder_thread(const unsigned int j);
+  void report_subrun(const unsigned int subrun,
+                     const vector<daq_word_counts> & daq,
+                     const unsigned int nfilesets, const unsigned int nevents,
+                     const uint64_t wall_us, const uint64_t build_us,
+                     const uint32_t tolutc);
+  void merger_thread();
+  void to_serializer(build_batch * b);
+  void serializer_thread(const unsigned int i);
+  void prescale_rejected(build_batch * b, unsigned int & rejected);
+  void open_output();
+  bool close_output();
+  bool rotation_due();
+  void writer_thread();
+  void make_queues();
+  void open_spill_files();
+  void start_stages(vector<stage_start> & stages, vector<pthread_t> & threads,
+                    const bool decoders);
+  void start_sweep();
+  static void * branch_thread(void * builder);
+  void MainBuild();
+
+  // Map from USB serial numbers to their location in array of OVUSBStreams
+  // (sigh).  Filled in setup_from_config().
+  map<int, int> usbserial_to_usbindex;
+
+  // Mutated as program runs
+  int OV_EB_State;
+  int initial_delay;
+  int Ddelay;
+
+  // Set in parse_options()
+  int Threshold; // default 1.5 PE threshold
+  string OutBase; // output file
+  TriggerMode EBTrigMode; // double-layer threshold by default
+  string InputDir; // input data directory
+  string ConfigFile;
+  bool UseCheckpoint; // write checkpoints and resume from them
+  bool Offline; // reprocess a finished run
+  string PacketCacheDir; // see PacketCache.h
+
+  // With -s, the threshold and trigger mode settings to build in one pass.
+  // This builder builds the first, and Branches the rest, all from packets
+  // decoded once, here, without a threshold.  Each setting's cut is then
+  // applied to the decoded packets as SweepCut.
+  vector< std::pair<int, TriggerMode> > Sweep;
+  vector<RunBuilder *> Branches;
+  vector<pthread_t> BranchThreads;
+  ThresholdCut SweepCut;
+
+  // For a branch, what to add to the charges decoded by the builder feeding
+  // it to give its own baseline subtraction, [USB index][module*64 +
+  // channel], or nothing for a stream where the baselines are the same.
+  // Baselines are found from the packets passing the threshold, so they can
+  // differ between settings.
+  vector< vector<int> > BaselineShift;
+
+  // With -s, for each USB index, the packets passing this setting's cut that
+  // are not yet passed on, and the Unix time stamp the stream has been
+  // passed on up to, as a decoder with this setting's threshold would have
+  // them.  See cut_slice().
+  vector< vector<decoded_packet> > SweepCarry;
+  vector<uint32_t> SweepTOLUTC;
+
+  // With -s, for each USB index, spare hit containers taken from HitsPool
+  // for the copies of packets this builder hands to its branches
+  vector< vector< vector<decoded_hit> > > SweepSpareHits;
+
+  // Number of USB streams merged together in each thread when there are many
+  // USB streams.  Groups are then merged together in the same way.  Zero or
+  // one means to always merge all streams in a single thread.
+  unsigned int MergeGroupSize;
+
+  // Number of time ranges each batch of data is cut into to have its events
+  // built in parallel.  One to build everything in a single thread.
+  unsigned int BuildRanges;
+
+  // If non-zero, adapt the number of file sets per subrun, up to this many,
+  // and the number of build ranges, from BuildRanges up to the number of
+  // CPUs, to how far behind we are.  See Scheduler.h.
+  unsigned int AdaptiveFileSets;
+  AdaptiveScheduler Scheduler;
+
+  // Start a new output file when the current one reaches this size or has
+  // been open this long, instead of once per subrun.  Zero for no limit.
+  uint64_t RotateBytes;
+  unsigned int RotateSeconds;
+
+  // Preallocation and syncing of output files
+  output_policy OutputPolicy;
+
+  // Software trigger config file, if any, and the trigger read from it
+  string TriggerConfig;
+  EventTrigger Trigger;
+
+  // Shared memory ring to also publish events to, if any, and its size
+  string ShmName;
+  uint64_t ShmBytes;
+  ShmRingWriter ShmRing;
+
+  // Seconds between snapshots of the monitoring histograms.  Zero for none.
+  unsigned int MonitorInterval;
+  Monitor OnlineMonitor;
+
+  // Archives input files in the background once they are built.  Archived
+  // files are compressed if CompressArchive, and deleted after
+  // RetentionSeconds, if non-zero.
+  FileArchiver Archiver;
+  unsigned int RetentionSeconds;
+  bool CompressArchive;
+
+  // With -u, the directory of the sockets the DAQ sends each USB stream's raw
+  // data to, instead of writing files, and what receives it.  With -a, that
+  // data is also archived to files in decoded/.
+  string SocketDir;
+  vector<SocketIngest> Ingest;
+  bool ArchiveReceived;
+  time_t IngestStart; // names the archive files
+  bool drained; // with -u, all data has been taken in
+
+  // Set once the run is known to be over.  See run_ended().
+  bool run_has_ended;
+
+  // Encodes events in the output format.  The serializers only use it
+  // through its thread-safe methods, and the writer for the rest.
+  EventEncoder Encoder;
+
+  // Filled while encoding, one for each serializer, then one for the writer
+  vector<build_histograms> BuildHistograms;
+
+  // Number of serializer threads, and the one the merger passes its next
+  // message to
+  unsigned int SerializerThreads;
+  unsigned int NextSerializer;
+
+  // Set in setup_from_config() and used throughout
+  unsigned int numUSB;
+  int numModules; // One more than the highest input board number
+
+  // *Size* set in setup_from_config()
+  vector<USBstream> OVUSBStream;
+
+  // The sync phase all of this run's packets are keyed against.  See
+  // make_time_key().
+  uint64_t TimeKeyReference;
+
+  // Decoded data not yet built into events
+  vector< vector<decoded_packet> > CurrentData;
+
+  // With -b, the memory CurrentData may use before it is spilled to disk,
+  // one file per USB stream, and the memory it uses.  See Spill.h.
+  uint64_t SpillBudget;
+  vector<SpillFile> Spills;
+  uint64_t CurrentBytes;
+
+  // Time order of the packets being built, kept to reuse its memory
+  vector<merged_ref> Order;
+
+  // Packets, and the USB indices they came from, of the event that was still
+  // being built when SuperBuildEvents() ran out of data.  They are carried
+  // into the next call.
+  vector<decoded_packet> ExtraData;
+  vector<int> ExtraIndex;
+
+  // The batch of events not yet sent to the serializer.  It never holds an
+  // open event between calls to SuperBuildEvents().
+  build_batch * PendingEvents;
+
+  // Name, without directory, of the last input file consumed for each USB
+  // stream.  Used to line the input directory up with a checkpoint.
+  vector<string> LastConsumed;
+
+  // Names of input files handed to the decoders.  They stay in the input
+  // directory until decoded, and must not be handed out again meanwhile.
+  std::set<string> Dispatched;
+
+  // In offline mode, all input files, [USB index][file set], with their
+  // directories, and the next file set to read
+  vector< vector<string> > OfflineFiles;
+  unsigned int OfflineNext;
+
+  vector< SPSCQueue<decode_msg *> * > ToDecoder; // one per USB stream
+  vector< SPSCQueue<slice_msg *> * > ToMerger; // one per USB stream
+  vector< SPSCQueue<build_batch *> * > ToSerializer; // one per serializer
+  vector< SPSCQueue<build_batch *> * > ToWriter; // one per serializer
+
+  // Messages handed back once used, so that their memory can be reused
+  vector< SPSCQueue<slice_msg *> * > FreeSlices; // merger to decoders
+  SPSCQueue<build_batch *> * FreeBatches; // writer to merger
+
+  // The output file being written and the number in its name.  Only used
+  // by the writer, except when resuming from a checkpoint before it starts.
+  OutputFile Output;
+  unsigned int FileIndex;
+
+  // If resuming into a partly written output file, its length at the time of
+  // the checkpoint.
+  uint64_t ResumeOffset;
+
+  // With a prescaled trigger, the file of events that failed it, which is
+  // opened and closed along with the output file
+  OutputFile SideOutput;
+  uint64_t ResumeSideOffset;
+
+  // With -F, the events written to the output file, in columns, to be
+  // written out next to it once it is closed.  See Columns.h.
+  bool WriteColumns;
+  EventColumns Columns;
+
+  // What this builder takes slots of Workers as
+  unsigned int WorkerClient;
+};
 
-static USBstream OVUSBStream[maxUSB];
+// Set in parse_options() from the command line, for the whole process
 
-// *Size* set in setup_from_config()
-static bool *overflow; // Keeps track of sync overflows for all boards
+// File to write a trace of the pipeline's work to at the end of the run, if
+// any.  See Trace.h.
+static string TraceFile;
 
-// Keeps track of max clock count for sync overflows for all boards
-static long int *maxcount_16ns;
+// With -d, the file listing the builders to run, one per line
+static string InstancesFile;
 
+// Number of slots in Workers.  Zero for no limit, except with -d, where it
+// is the number of CPUs by default.
+static unsigned int WorkerSlots = 0;
 
-// Decodes USB stream with array index *usbindex. For threading.
-static void * decode(void * usbindex)
+// The priority to log an error in a run's own input at, when it ends the
+// run.  A builder on its own exits, as it always has.  With -d, only that
+// builder stops, so that one instance's bad input can't stop the others.
+static int run_error_priority()
 {
-  OVUSBStream[*((int *)usbindex)].decodefile();
-  return NULL;
+  return InstancesFile == ""? LOG_CRIT: LOG_ERR;
 }
 
-// opens output data file
-static int open_file(const char * const name)
+// Shared by all builders
+
+// Spare hit containers, handed back by the serializers for the decoders
+static HitPool HitsPool;
+
+// Slots for CPU-bound work.  See WorkerPool.h.
+static WorkerPool Workers;
+
+// Set by SIGUSR1, which ends the runs of all builders not in offline mode
+static volatile sig_atomic_t EndRunSignalled = 0;
+
+RunBuilder::RunBuilder()
 {
-  errno = 0;
-  const int fd = open(name, O_WRONLY | O_CREAT, 0644);
-  if(fd < 0)
-    log_msg(LOG_CRIT, "Fatal Error: failed to open file %s: %s\n",
-            name, strerror(errno));
-  return fd;
+  OV_EB_State = initial_delay = Ddelay = 0;
+  Threshold = 73;
+  EBTrigMode = kDoubleLayer;
+  UseCheckpoint = Offline = false;
+  MergeGroupSize = 8;
+  BuildRanges = 1;
+  AdaptiveFileSets = 0;
+  RotateBytes = 0;
+  RotateSeconds = 0;
+  ShmBytes = 64 << 20;
+  MonitorInterval = 0;
+  RetentionSeconds = 0;
+  CompressArchive = false;
+  ArchiveReceived = false;
+  IngestStart = 0;
+  drained = false;
+  run_has_ended = false;
+  numUSB = 0;
+  numModules = 0;
+  TimeKeyReference = 0;
+  PendingEvents = NULL;
+  SpillBudget = CurrentBytes = 0;
+  OfflineNext = 0;
+  SerializerThreads = 1;
+  NextSerializer = 0;
+  FreeBatches = NULL;
+  FileIndex = 0;
+  ResumeOffset = ResumeSideOffset = 0;
+  WriteColumns = false;
+  WorkerClient = 0;
 }
 
 static int check_disk_space(const string & dir)
@@ -148,9 +595,15 @@ static int check_disk_space(const string & dir)
   return 0;
 }
 
-static void check_status(const vector<string> & files)
+static uint64_t monotonic_us()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+void RunBuilder::check_status(const vector<string> & files)
 {
-  static int Ddelay = 0;
   // Performance monitor
   const int f_delay = (int)(latency*files.size()/numUSB/20);
   if(f_delay != OV_EB_State) {
@@ -221,7 +674,7 @@ static bool GetDir(const std::string dir, std::vector<std::string> &myfiles,
   return myfiles.size()==0;
 }
 
-static bool TryInitRun()
+bool RunBuilder::TryInitRun()
 {
   vector<string> files;
   if(GetDir(InputDir, files) && errno)
@@ -234,28 +687,45 @@ static bool TryInitRun()
 }
 
 // Checks that we can open the input directory and that there's at least
-// one file in there. Sets up performance statistics.
-static void InitRun()
+// one file in there. Sets up performance statistics.  Returns false if
+// there are none, with -d.
+bool RunBuilder::InitRun()
 {
   const time_t oldtime = time(0);
 
   while(!TryInitRun()) {
-    if((int)difftime(time(0), oldtime) > MAXTIME)
-      log_msg(LOG_CRIT, "No input files found for %d seconds.\n", MAXTIME);
-    else
-      sleep(1);
+    if((int)difftime(time(0), oldtime) > MAXTIME){
+      log_msg(run_error_priority(), "No input files found for %d seconds.\n",
+              MAXTIME);
+      return false;
+    }
+    sleep(1);
   }
+  return true;
 }
 
-// If there is a file ready for each USB stream, open one for each.
-// Returns true if this happens, and false otherwise.
-static bool OpenNextFileSet()
+// If there is a file ready for each USB stream that hasn't already been
+// handed out, fill 'names' with their names in USB stream order.  Returns
+// true if this happens, and false otherwise.
+bool RunBuilder::FindNextFileSet(vector<string> & names)
 {
   if(check_disk_space(InputDir) < 0) // Why are we checking the *input* directory?
     log_msg(LOG_CRIT, "Fatal error in check_disk_space(%s)\n", InputDir.c_str());
 
   vector<string> files;
   if(GetDir(InputDir, files)) return false;
+
+  // Forget about files that have been archived, and skip those that haven't
+  // yet but have been handed out.
+  std::set<string> still_dispatched;
+  for(unsigned int j = 0; j < files.size(); j++){
+    if(!Dispatched.count(files[j])) continue;
+    still_dispatched.insert(files[j]);
+    files.erase(files.begin()+j);
+    j--;
+  }
+  Dispatched.swap(still_dispatched);
+
   if(files.size() < numUSB) return false;
 
   sort(files.begin(), files.end());
@@ -296,117 +766,122 @@ static bool OpenNextFileSet()
     return false;
   }
 
-  vector<string>::iterator filesit = files.begin();
-
-  int status = 0;
-  string base_filename;
+  names.resize(numUSB);
   for(unsigned int k=0; k<numUSB; k++) {
-    const size_t fname_it_delim = filesit->find(fdelim);
-    const string ftime_min = filesit->substr(0, fname_it_delim);
-    const string fusb = filesit->substr(fname_it_delim+1);
-
-    // Build input filename ( _$usb will be added by LoadFile function )
-    base_filename=InputDir;
-    base_filename.append("/");
-    base_filename.append(ftime_min);
-    if( (status = OVUSBStream[k].LoadFile(base_filename)) < 1 ) // Can't load file
-      return status;
-
-    filesit++;
+    names[k] = InputDir + "/" + files[k];
+    Dispatched.insert(files[k]);
   }
 
   return true;
 }
 
-static void BuildEvent(const vector<decoded_packet> & in_packets,
-                       const vector<int> & OutIndex, const int fd)
+// Parses a size in bytes, which may be suffixed with K, M or G
+static uint64_t parse_size(const char * const arg)
 {
-  if(fd <= 0)
-    log_msg(LOG_CRIT, "Fatal Error in BuildEvent(). Invalid file "
-      "handle for previously opened data file!\n");
-
-  if(in_packets.empty()){
-    log_msg(LOG_WARNING, "Got empty data in BuildEvent(). Trying to continue.\n");
-    return;
+  char * end;
+  uint64_t size = strtoull(arg, &end, 10);
+  switch(*end){
+    case 'G': case 'g': size <<= 10; // fall through
+    case 'M': case 'm': size <<= 10; // fall through
+    case 'K': case 'k': size <<= 10; end++; break;
   }
+  if(*end != '\0' || end == arg){
+    printf("Invalid size %s\n", arg);
+    exit(127);
+  }
+  return size;
+}
 
-  OVEventHeader evheader;
-  evheader.time_sec = in_packets[0].timeunix;
-  evheader.n_ov_data_packets = in_packets.size();
-
-  if(!evheader.writeout(fd))
-    log_msg(LOG_CRIT, "Fatal Error: Cannot write event header!\n");
-
-  for(unsigned int packeti = 0; packeti < in_packets.size(); packeti++){
-    const decoded_packet & packet = in_packets[packeti];
-
-    const int usb = OVUSBStream[OutIndex[packeti]].GetUSB();
-    if(!PMTUniqueMap.count(std::pair<int, int>(usb, packet.module)))
-      log_msg(LOG_ERR, "Got unknown module number %d on USB %d\n",
-              packet.module, usb);
-
-    const int16_t module = PMTUniqueMap[std::pair<int, int>(usb, packet.module)];
-
-    if(!packet.isadc){
-      log_msg(LOG_ERR, "Got non-ADC packet. Not supported!\n");
-      continue;
-    }
-
-    // Sync pulse diagnostic info: pulse expected at clock count
-    // 2^(SYNC_PULSE_CLK_COUNT_PERIOD_LOG2).  Look for overflows.
-    if( packet.time16ns > (1 << SYNC_PULSE_CLK_COUNT_PERIOD_LOG2) ) {
-      if(!overflow[module]) {
-        log_msg(LOG_WARNING, "Module %d missed sync pulse near "
-          "Unix time stamp %ld\n", module, evheader.time_sec);
-        overflow[module] = true;
-      }
-      maxcount_16ns[module] = packet.time16ns;
-    }
-    else if(overflow[module]) {
-      log_msg(LOG_WARNING, "Module %d max clock count %ld\t",
-        module, maxcount_16ns[module]);
-      maxcount_16ns[module] = packet.time16ns;
-      overflow[module] = false;
-    }
-
-    OVDataPacketHeader moduleheader;
-    moduleheader.nHits = packet.hits.size();
-    moduleheader.module = module;
-    moduleheader.time16ns = packet.time16ns;
-
-    if(!moduleheader.writeout(fd))
-      log_msg(LOG_CRIT, "Fatal Error: Cannot write data packet header!\n");
-
-    for(int m = 0; m < moduleheader.nHits; m++) {
-      OVHitData hit;
-      hit.channel = packet.hits[m].channel;
-      hit.charge  = packet.hits[m].charge;
+// Parses a list of threshold:mode pairs, as given to -s.  Returns false if
+// it is malformed or gives a setting twice.
+static bool parse_sweep(const char * p,
+                        vector< std::pair<int, TriggerMode> > & sweep)
+{
+  while(*p){
+    char * end;
+    const long t = strtol(p, &end, 10);
+    if(end == p || *end != ':' || t < 0) return false;
+    p = end + 1;
+
+    const long mode = strtol(p, &end, 10);
+    if(end == p || (*end != ',' && *end != '\0') ||
+       mode < kNone || mode > kDoubleLayer)
+      return false;
+    p = *end? end + 1: end;
 
-      if(!hit.writeout(fd))
-        log_msg(LOG_CRIT, "Fatal Error: Cannot write hit!\n");
-    }
+    const std::pair<int, TriggerMode> setting((int)t, (TriggerMode)mode);
+    if(std::find(sweep.begin(), sweep.end(), setting) != sweep.end())
+      return false;
+    sweep.push_back(setting);
   }
+  return !sweep.empty();
 }
 
-static string parse_options(int argc, char **argv)
+void RunBuilder::parse_options(int argc, char **argv, const bool instance)
 {
   bool option_t_used = false;
-  string configfile;
+  const char * sweeplist = NULL;
+  unsigned int noptions = 0, nprocess_options = 0; // the latter -d, -W, -x
   if(argc <= 1) goto fail;
 
   char c;
-  while((c = getopt(argc, argv, "c:t:T:i:o:h")) != -1) {
+  while((c = getopt(argc, argv, "c:t:T:i:o:kOb:C:s:G:j:e:FA:g:m:M:H:x:D:zu:aS:R:P:y:w:d:W:h")) != -1) {
+    noptions++;
+    if(c == 'd' || c == 'W' || c == 'x') nprocess_options++;
     switch (c) {
       case 'i': InputDir = optarg; break;
       case 'o': OutBase  = optarg; break;
       case 't': Threshold = atoi(optarg); option_t_used = true; break;
       case 'T': EBTrigMode = (TriggerMode)atoi(optarg); break;
-      case 'c': configfile = optarg; break;
+      case 'c': ConfigFile = optarg; break;
+      case 'k': UseCheckpoint = true; break;
+      case 'F': WriteColumns = true; break;
+      case 'O': Offline = true; break;
+      case 'b': SpillBudget = parse_size(optarg); break;
+      case 'C': PacketCacheDir = optarg; break;
+      case 's': sweeplist = optarg; break;
+      case 'G': MergeGroupSize = atoi(optarg); break;
+      case 'j': BuildRanges = atoi(optarg); break;
+      case 'e': SerializerThreads = atoi(optarg); break;
+      case 'A': AdaptiveFileSets = atoi(optarg); break;
+      case 'g': TriggerConfig = optarg; break;
+      case 'm': ShmName = optarg; break;
+      case 'M': ShmBytes = parse_size(optarg); break;
+      case 'H': MonitorInterval = atoi(optarg); break;
+      case 'x': TraceFile = optarg; break;
+      case 'D': RetentionSeconds = 3600*atoi(optarg); break;
+      case 'z': CompressArchive = true; break;
+      case 'u': SocketDir = optarg; break;
+      case 'a': ArchiveReceived = true; break;
+      case 'S': RotateBytes = parse_size(optarg); break;
+      case 'R': RotateSeconds = atoi(optarg); break;
+      case 'P': OutputPolicy.prealloc_bytes = parse_size(optarg); break;
+      case 'y': OutputPolicy.sync_bytes = parse_size(optarg); break;
+      case 'w': OutputPolicy.writebehind_bytes = parse_size(optarg); break;
+      case 'd': InstancesFile = optarg; break;
+      case 'W': WorkerSlots = atoi(optarg); break;
       case 'h':
       default:  goto fail;
     }
   }
-  if(configfile == ""){
+  if(instance && nprocess_options){
+    printf("-d, -W and -x are for the command line, not %s\n",
+           InstancesFile.c_str());
+    goto fail;
+  }
+  if(InstancesFile != "" && !instance){
+    for(int index = optind; index < argc; index++){
+      printf("Non-option argument %s\n", argv[index]);
+      goto fail;
+    }
+    if(noptions != nprocess_options){
+      printf("With -d, the options of each builder go in %s\n",
+             InstancesFile.c_str());
+      goto fail;
+    }
+    return;
+  }
+  if(ConfigFile == ""){
     printf("You must use the -c option\n");
     goto fail;
   }
@@ -429,6 +904,51 @@ static string parse_options(int argc, char **argv)
     printf("Invalid trigger mode %d\n", EBTrigMode);
     goto fail;
   }
+  if(SocketDir != "" && (UseCheckpoint || Offline || AdaptiveFileSets ||
+                         PacketCacheDir != "")){
+    printf("-u cannot be used with -k, -O, -A or -C\n");
+    goto fail;
+  }
+  if(sweeplist != NULL){
+    if(!parse_sweep(sweeplist, Sweep)){
+      printf("-s takes a list like 50:2,73:2,100:1\n");
+      goto fail;
+    }
+    if(!Offline || UseCheckpoint || ShmName != "" || option_t_used ||
+       EBTrigMode != kDoubleLayer){
+      printf("-s needs -O, and cannot be used with -k, -m, -t or -T\n");
+      goto fail;
+    }
+
+    // The first setting is this builder's
+    Threshold = Sweep[0].first;
+    EBTrigMode = Sweep[0].second;
+  }
+  if(CompressArchive && compression_codec() == NULL){
+    printf("-z needs a build with a compression codec, as with make ZSTD=1,\n"
+           "LZ4=1 or ZLIB=1\n");
+    goto fail;
+  }
+  if(CompressArchive && Offline){
+    printf("-z cannot be used with -O, which does not archive files\n");
+    goto fail;
+  }
+  if(ArchiveReceived && SocketDir == ""){
+    printf("-a is only for use with -u\n");
+    goto fail;
+  }
+  if(WriteColumns && UseCheckpoint && (RotateBytes || RotateSeconds)){
+    printf("-F cannot be used with -k and -S or -R\n");
+    goto fail;
+  }
+  if(BuildRanges < 1) {
+    printf("Need at least one build range.\n");
+    goto fail;
+  }
+  if(SerializerThreads < 1 || SerializerThreads > 64) {
+    printf("Need from 1 to 64 serializer threads.\n");
+    goto fail;
+  }
   if(Threshold < 0) {
     printf("Negative thresholds not allowed.\n");
     goto fail;
@@ -439,13 +959,24 @@ static string parse_options(int argc, char **argv)
     goto fail;
   }
 
-  return configfile;
+  return;
 
   fail:
   printf(
     "Usage: %s -i <input data directory> -o <EBuilder_output_disk>\n"
     "          -c <config file>\n"
-    "         [-t <offline_threshold>] [-T <offline_trigger_mode>]\n"
+    "         [-t <offline_threshold>] [-T <offline_trigger_mode>] [-k] [-O]\n"
+    "         [-b <memory_budget>] [-C <packet_cache_dir>]\n"
+    "         [-s <threshold:mode,...>]\n"
+    "         [-G <merge_group_size>] [-j <build_ranges>] [-e <serializers>]\n"
+    "         [-A <max_filesets_subrun>] [-g <trigger_config>]\n"
+    "         [-m <shm_name>] [-M <shm_size>] [-H <monitor_seconds>]\n"
+    "         [-x <trace_file>] [-D <retention_hours>] [-z]\n"
+    "         [-u <socket_dir>] [-a]\n"
+    "         [-S <rotate_size>] [-R <rotate_seconds>] [-F]\n"
+    "         [-P <prealloc_size>] [-y <sync_size>] [-w <writebehind_size>]\n"
+    "         [-W <workers>]\n"
+    "   or: %s -d <instances_file> [-W <workers>] [-x <trace_file>]\n"
     "\n"
     "Mandatory arguments:\n"
     "  -i : Input data directory\n"
@@ -458,52 +989,75 @@ static string parse_options(int argc, char **argv)
     "  -T : offline trigger mode\n"
     "       0: No threshold\n"
     "       1: Per-channel threshold\n"
-    "       2: [default] Overlapping pair: both hits over threshold, if any\n",
-    argv[0]);
+    "       2: [default] Overlapping pair: both hits over threshold, if any\n"
+    "  -k : Checkpoint the builder state to <output>.checkpoint after each\n"
+    "       subrun, and resume from that checkpoint if it already exists\n"
+    "  -O : Offline: reprocess the finished run in the input directory,\n"
+    "       including files already archived in decoded/, as fast as\n"
+    "       possible.  Input files are not moved, and the program stops at\n"
+    "       the end of the input\n"
+    "  -b : Spill decoded data waiting to be built to temporary files next\n"
+    "       to the output once it takes this much memory, and build from\n"
+    "       them a part at a time, so that long subruns, as with -O and -A,\n"
+    "       fit in memory.  default: keep it all in memory\n"
+    "  -C : Keep the packets decoded from each input file in this\n"
+    "       directory, before baselines, offsets and thresholds are\n"
+    "       applied, and use them instead of decoding the file again when\n"
+    "       it is rebuilt, as with -O and another -t\n"
+    "  -s : With -O, build the run with each of these thresholds and\n"
+    "       trigger modes, e.g. 50:2,73:2,100:1, decoding it only once.\n"
+    "       Each setting's output is <output>_t<threshold>_T<mode>_NNNNN\n"
+    "       Each setting gets its own copy of the hits passing its cut, so\n"
+    "       memory grows with the number of settings\n"
+    "  -G : Merge USB streams in parallel groups of this many streams\n"
+    "       default: 8. 0: merge all streams in one thread\n"
+    "  -j : Cut the data into this many time ranges and build the events\n"
+    "       of each in its own thread.  default: 1\n"
+    "  -e : Encode batches of events in this many threads at once.  They\n"
+    "       are still written out in order.  default: 1\n"
+    "  -A : Adapt to the backlog of input: grow subruns up to this many\n"
+    "       file sets, and build in up to one range per CPU, while behind,\n"
+    "       and shrink back once caught up.  default: always %d file sets\n"
+    "  -g : Only write out events passing the software trigger described\n"
+    "       in this file.  See include/Trigger.h for the format\n"
+    "  -m : Also publish events to this POSIX shared memory ring, e.g.\n"
+    "       /ebuilder, for online consumers\n"
+    "  -M : Size of the shared memory ring.  default: 64M\n"
+    "  -H : Append monitoring histograms to <output>_monitor every this\n"
+    "       many seconds\n"
+    "  -x : Write a trace of the work done on each file set to this file,\n"
+    "       in Chrome trace format, at the end of the run\n"
+    "  -D : Delete input files archived in decoded/ this many hours after\n"
+    "       they were written.  default: keep them\n"
+    "  -z : Compress input files archived in decoded/, in the background.\n"
+    "       They are still read by -O.  Needs a build with a codec\n"
+    "  -u : Receive each USB stream's raw data from its DAQ process on the\n"
+    "       Unix domain socket <socket_dir>/usb_<serial number> instead of\n"
+    "       from files.  Not with -k, -O, -A or -C\n"
+    "  -a : With -u, also archive the raw data received in decoded/, as\n"
+    "       input files that can be reprocessed with -O\n"
+    "  -S : Start a new output file when the current one reaches this size\n"
+    "  -R : Start a new output file after this many seconds\n"
+    "       default for both: start one for each subrun\n"
+    "  -F : Also write the events of each output file in columns, to\n"
+    "       <output>_columns_NNNNN.  See include/Columns.h\n"
+    "  -P : Preallocate output files this much at a time\n"
+    "  -y : fdatasync output files after this much is written\n"
+    "  -w : Write back output files to disk in chunks of this size\n"
+    "  Sizes may end in K, M or G.\n"
+    "  -d : Run as a daemon building several runs at once, such as separate\n"
+    "       detector partitions, or a live run and a reprocessing job.  Each\n"
+    "       line of this file gives the options of one builder, as above.\n"
+    "       Blank lines and lines starting with # are skipped.  Exits once\n"
+    "       all of the runs are over\n"
+    "  -W : Run CPU-bound work in at most this many threads at once, shared\n"
+    "       fairly between the builders.  default: no limit, or with -d,\n"
+    "       the number of CPUs\n",
+    argv[0], argv[0], max_filesets_subrun);
   exit(127);
 }
 
-static void CalculatePedestal(int baseptr[maxModules][numChannels],
-                              const vector<decoded_packet> & BaselineData)
-{
-  double baseline[maxModules][numChannels] = {};
-  int counter[maxModules][numChannels] = {};
-
-  for(vector<decoded_packet>::const_iterator I = BaselineData.begin();
-      I != BaselineData.end();
-      I++) {
-
-    const int module = I->module;
-    const int type = I->isadc;
-
-    if(type != kOVR_ADC) continue;
-
-    if(module > maxModules)
-      log_msg(LOG_CRIT, "Fatal Error: Module number requested "
-        "(%d) out of range (0-%d) in calculate pedestal\n", module, maxModules);
-
-    for(unsigned int i = 0; i < I->hits.size(); i++) {
-      const int charge = I->hits[i].charge;
-      const int channel = I->hits[i].channel;
-      if(channel >= numChannels)
-        log_msg(LOG_CRIT, "Fatal Error: Channel number requested "
-          "(%d) out of range (0-%d) in calculate pedestal\n",
-          channel, numChannels-1);
-
-      // Should these be modified to better handle large numbers of baseline
-      // triggers?
-      baseline[module][channel] = (baseline[module][channel]*
-        counter[module][channel] + charge)/(counter[module][channel]+1);
-      counter[module][channel]++;
-    }
-  }
-
-  for(int i = 0; i < maxModules; i++)
-    for(int j = 0; j < numChannels; j++)
-      baseptr[i][j] = (int)baseline[i][j];
-}
-
-static bool GetBaselines()
+bool RunBuilder::GetBaselines()
 {
   // Check for a baseline file directory with the right right number of files.
   {
@@ -542,15 +1096,15 @@ static bool GetBaselines()
 
   // Decode all files and load into memory
   for(unsigned int j = 0; j < numUSB; j++){
-    log_msg(LOG_INFO, "Decoding baseline %d\n", j),
-    OVUSBStream[j].decodefile();
+    log_msg(LOG_INFO, "Decoding baseline %d\n", j);
+    if(!OVUSBStream[j].decodefile()) return false;
   }
 
   for(unsigned int i = 0; i < numUSB; i++) {
     vector<decoded_packet> BaselineData;
     OVUSBStream[i].GetBaselineData(&BaselineData);
-    int baselines[maxModules][numChannels] = { { } };
-    CalculatePedestal(baselines, BaselineData);
+    vector<int> baselines;
+    calculate_pedestals(baselines, BaselineData, numModules);
     OVUSBStream[i].SetBaseline(baselines);
   }
 
@@ -558,15 +1112,26 @@ static bool GetBaselines()
 }
 
 // Try to read in the baselines for MAXTIME seconds.  If they don't appear,
-// exit with status 127.
-static void LoadBaselineData()
+// exit, or with -d, return false.
+bool RunBuilder::LoadBaselineData()
 {
+  if(Offline){
+    if(GetBaselines()) return true;
+    log_msg(run_error_priority(), "Baseline data not found in %s\n",
+            InputDir.c_str());
+    return false;
+  }
+
   const time_t oldtime = time(0);
   while(!GetBaselines()){
-    if((int)difftime(time(0), oldtime) > MAXTIME)
-      log_msg(LOG_CRIT, "Baseline data not found for %d seconds.\n", MAXTIME);
+    if((int)difftime(time(0), oldtime) > MAXTIME){
+      log_msg(run_error_priority(), "Baseline data not found for %d "
+              "seconds.\n", MAXTIME);
+      return false;
+    }
     sleep(2);
   }
+  return true;
 }
 
 // Return a vector of {USB serial numbers, board numbers, pmtboard_u, time offsets}
@@ -613,22 +1178,30 @@ static int sbop_max_board(const vector<usb_sbop> & sbops)
   return maxb;
 }
 
-static void setup_from_config(const string & configfile)
+void RunBuilder::setup_from_config(const string & configfile)
 {
   const vector<usb_sbop> sbops = get_sbops(configfile.c_str());
 
   const vector<int> usbserials = get_distinct_usb_serials(sbops);
   numUSB = usbserials.size();
+  OVUSBStream.resize(numUSB);
+  LastConsumed.resize(numUSB);
+
+  for(unsigned int i = 0; i < sbops.size(); i++) {
+    if(sbops[i].board < 0 || sbops[i].board > maxModuleNumber)
+      log_msg(LOG_CRIT, "Error: config references module %d, but max is %d.\n",
+              sbops[i].board, maxModuleNumber);
+    numModules = std::max(numModules, sbops[i].board+1);
+  }
+
+  for(unsigned int i = 0; i < numUSB; i++)
+    OVUSBStream[i].SetNumModules(numModules);
 
   // Helpful for baseline substraction later on
   for(unsigned int i = 0; i < usbserials.size(); i++)
     usbserial_to_usbindex[usbserials[i]] = i;
 
   for(unsigned int i = 0; i < sbops.size(); i++) {
-    if(sbops[i].board >= maxModules)
-      log_msg(LOG_CRIT, "Error: config references module %d, but max is %d.\n",
-              sbops[i].board, maxModules-1);
-
     // Set offsets, clumsily dealing with the indexing of OVUSBStream
     OVUSBStream[
       std::find(usbserials.begin(), usbserials.end(), sbops[i].serial)
@@ -636,144 +1209,617 @@ static void setup_from_config(const string & configfile)
     ].SetOffset(sbops[i].board, sbops[i].offset);
 
     // Maps input numbering convention to output numbering convention.
-    PMTUniqueMap[std::pair<int, int>(sbops[i].serial, sbops[i].board)]
-      = sbops[i].pmtboard_u;
+    Encoder.AddModule(sbops[i].serial, sbops[i].board, sbops[i].pmtboard_u);
+
+    Trigger.AddModule(usbserial_to_usbindex[sbops[i].serial], sbops[i].board,
+                      sbops[i].pmtboard_u);
   }
 
+  if(TriggerConfig != "") Trigger.ReadConfig(TriggerConfig);
+
+  Encoder.SetStreams(usbserials);
+
   // Count the number of boards in this setup
   const int max_board   = sbop_max_board(sbops);
-  overflow = new bool[max_board+1];
-  maxcount_16ns = new long int[max_board+1];
-  memset(overflow, 0, (max_board+1)*sizeof(bool));
-  memset(maxcount_16ns, 0, (max_board+1)*sizeof(long int));
+
+  if(MonitorInterval){
+    OnlineMonitor.Init(OutBase + "_monitor", MonitorInterval, usbserials,
+                       numModules, max_board+1);
+    BuildHistograms.resize(SerializerThreads + 1);
+    for(unsigned int i = 0; i < BuildHistograms.size(); i++)
+      BuildHistograms[i].Init(max_board+1);
+  }
 
   for(unsigned int i = 0; i < numUSB; i++){
     OVUSBStream[i].SetThresh(Threshold, (int)EBTrigMode);
     OVUSBStream[i].SetUSB(usbserials[i]);
+    OVUSBStream[i].SetTimeKeyReference(&TimeKeyReference);
   }
 }
 
-static bool run_has_ended = false;
-
 static void end_run_signal_handler(__attribute__((unused)) int sig)
 {
-  run_has_ended = true;
+  EndRunSignalled = 1;
 }
 
-static bool write_end_block_and_close(const int data_fd)
+bool RunBuilder::write_end_block_and_close(OutputFile & data_file)
 {
   const uint32_t end = 0x53544F50; // "STOP"
   const uint32_t nend = htonl(end);
-  if(sizeof nend != write(data_fd, &nend, sizeof nend)){
+  if(!data_file.Write((const char *)&nend, sizeof nend)){
     log_msg(LOG_ERR, "End of run write error\n");
+    data_file.Close(false);
     return false;
   }
 
-  if(close(data_fd) < 0){
-    log_msg(LOG_ERR, "Could not close output data file\n");
-    return false;
+  // A checkpoint written after this must not get ahead of the data
+  return data_file.Close(UseCheckpoint);
+}
+
+// Returns an empty batch, reusing one the writer is done with if there is
+// one.  Only for the merger thread, as FreeBatches has a single consumer.
+build_batch * RunBuilder::new_batch(const pipeline_msg_type type,
+                                    const unsigned int subrun)
+{
+  build_batch * b;
+  if(!FreeBatches->TryPop(b)) b = new build_batch;
+  b->Reset(type, subrun);
+  return b;
+}
+
+// Index in the sink's batch of the first packet of the open event
+static unsigned int open_event_start(const event_sink & sink)
+{
+  return sink.b->event_end.empty()? 0: sink.b->event_end.back();
+}
+
+// Completes the open event, if there is one, passing the batch on if full
+void RunBuilder::close_event(event_sink & sink)
+{
+  build_batch * b = sink.b;
+  if(b->packets.size() == open_event_start(sink)) return;
+
+  b->event_end.push_back(b->packets.size());
+  sink.nevents++;
+
+  if(b->event_end.size() >= EventsPerBatch){
+    if(sink.full == NULL){
+      to_serializer(b);
+      sink.b = new_batch(kFileSet, b->subrun);
+    }
+    else{
+      sink.full->push_back(b);
+      sink.b = new build_batch;
+      sink.b->Reset(kFileSet, b->subrun);
+    }
   }
+}
 
-  return true;
+// Adds 'packet', from the USB stream with index 'usb', as the next packet in
+// time order, first completing the open event if 'packet' is more than 3
+// clock cycles after its last packet.  The packet's contents are taken by
+// swapping, so the hits are not copied.
+void RunBuilder::add_packet(event_sink & sink, decoded_packet & packet,
+                            const int usb)
+{
+  if(sink.b->packets.size() > open_event_start(sink) &&
+     LessThan(sink.b->packets.back(), packet, 3))
+    close_event(sink);
+
+  build_batch & b = *sink.b;
+  b.packets.push_back(decoded_packet());
+  b.packets.back().swap(packet);
+  b.usbindex.push_back(usb);
+}
+
+// Moves the open event out of the sink into 'packets' and 'usbindex', to be
+// carried over until the next time events are built.
+static void take_open_event(event_sink & sink, vector<decoded_packet> & packets,
+                            vector<int> & usbindex)
+{
+  build_batch & b = *sink.b;
+  const unsigned int first = open_event_start(sink);
+
+  packets.clear();
+  usbindex.clear();
+  for(unsigned int i = first; i < b.packets.size(); i++){
+    packets.push_back(decoded_packet());
+    packets.back().swap(b.packets[i]);
+    usbindex.push_back(b.usbindex[i]);
+  }
+  b.packets.resize(first);
+  b.usbindex.resize(first);
+}
+
+// Makes 'packets', carried over from last time, the sink's open event
+static void put_open_event(event_sink & sink, vector<decoded_packet> & packets,
+                           vector<int> & usbindex)
+{
+  build_batch & b = *sink.b;
+  for(unsigned int i = 0; i < packets.size(); i++){
+    b.packets.push_back(decoded_packet());
+    b.packets.back().swap(packets[i]);
+    b.usbindex.push_back(usbindex[i]);
+  }
+  packets.clear();
+  usbindex.clear();
+}
+
+void RunBuilder::flush_events()
+{
+  if(PendingEvents == NULL || PendingEvents->event_end.empty()) return;
+  to_serializer(PendingEvents);
+  PendingEvents = NULL;
+}
+
+void * RunBuilder::build_range_thread(void * job)
+{
+  range_job & j = *(range_job *)job;
+  set_log_tag(j.builder->Name.c_str());
+  j.builder->build_range(j);
+  return NULL;
+}
+
+void RunBuilder::build_range(range_job & job)
+{
+  worker_slot slot(Workers, WorkerClient);
+  vector<merged_ref> order;
+  vector<unsigned int> pos(job.begin);
+
+  merge_ranges(*job.data, job.begin, job.end, order);
+
+  event_sink sink;
+  sink.b = new build_batch;
+  sink.b->Reset(kFileSet, job.subrun);
+  sink.full = &job.batches;
+  sink.nevents = 0;
+
+  if(job.first) put_open_event(sink, ExtraData, ExtraIndex);
+
+  for(unsigned int i = 0; i < order.size(); i++){
+    const int usb = order[i].usb;
+    add_packet(sink, (*job.data)[usb][pos[usb]++], usb);
+  }
+
+  // The last event of every range but the last ends at the cut
+  if(job.last) take_open_event(sink, job.open, job.openindex);
+  else         close_event(sink);
+
+  if(sink.b->event_end.empty()) delete sink.b;
+  else                          job.batches.push_back(sink.b);
+
+  job.nevents = sink.nevents;
 }
 
-// This is all the code that I found around BuildEvent. It does some things. I
-// have not really figured out what they are yet. Sorry sorry sorrysorrysorry.
-// In some fashion it does the building of the available data and leaves the
-// unbuilt data for the next try.  It returns the number of events built.
-static unsigned int
-  SuperBuildEvents(vector< vector<decoded_packet> > & CurrentData, const int fd)
+// SuperBuildEvents() for more than one build range.  The data that would be
+// built is cut into up to 'nranges_wanted' time ranges at gaps too long to be
+// inside an event, and each range is merged and built in its own thread.
+// The ranges' events are then queued in order, which gives exactly the
+// events of a single-threaded build.
+unsigned int RunBuilder::SuperBuildEventsInRanges(const unsigned int subrun,
+                                             const unsigned int nranges_wanted)
 {
-  // I don't know how many of these need to be static
-  static vector<decoded_packet>::iterator CurrentDataIt[maxUSB];
-  static vector<decoded_packet> MinData; // Current minimum data packets
-  static decoded_packet MinDataPacket; // Minimum and Last Data Packets added
-  static vector<int> MinIndex; // USB indices of Minimum Data Packet
-  static vector<decoded_packet> ExtraData;// carries events from last timestamp
-  static vector<int> ExtraIndex;
+  vector<unsigned int> used;
+  vector< vector<unsigned int> > cuts;
+
+  merged_extent(CurrentData, used);
+  partition_streams(CurrentData, used, nranges_wanted, 3, cuts);
+
+  const unsigned int nranges = cuts.size() - 1;
+  vector<range_job> jobs(nranges);
+  vector<pthread_t> threads(nranges);
+
+  for(unsigned int r = 0; r < nranges; r++){
+    jobs[r].builder = this;
+    jobs[r].data = &CurrentData;
+    jobs[r].begin = cuts[r];
+    jobs[r].end = cuts[r+1];
+    jobs[r].subrun = subrun;
+    jobs[r].first = r == 0;
+    jobs[r].last = r+1 == nranges;
+  }
+
+  // Build the first range here and the rest in their own threads
+  for(unsigned int r = 1; r < nranges; r++)
+    if(pthread_create(&threads[r], NULL, build_range_thread, &jobs[r]))
+      log_msg(LOG_CRIT, "Fatal Error: could not start build thread\n");
+  build_range(jobs[0]);
+  for(unsigned int r = 1; r < nranges; r++)
+    pthread_join(threads[r], NULL);
+
+  flush_events();
 
   unsigned int EventCounter = 0;
-  // index of minimum event added to USB stream
-  int imin = 0;
-  for(unsigned int i = 0; i < numUSB; i++) {
-    // MinIndex is set to the last CurrentData that's empty,
-    // or zero if none are empty.
-    CurrentDataIt[i] = CurrentData[i].begin();
-    if(CurrentData[i].empty()) imin = i;
-  }
-  MinData .assign(ExtraData .begin(), ExtraData .end());
-  MinIndex.assign(ExtraIndex.begin(), ExtraIndex.end());
-
-  // This is an elaborate test for whether all CurrentDatas are
-  // non-empty up to numUSB.
-  while( CurrentDataIt[imin] != CurrentData[imin].end() ) {
-    // Until 1 USB stream finishes timestamp
-
-    imin=0; // Reset minimum to first USB stream
-    MinDataPacket = *(CurrentDataIt[imin]);
-
-    for(unsigned int k = 0; k < numUSB; k++) { // Loop over USB streams, find minimum
-      decoded_packet CurrentDataPacket = *(CurrentDataIt[k]);
-
-      // Find real minimum; no clock slew
-      if( LessThan(CurrentDataPacket, MinDataPacket, 0) ) {
-        // If current packet less than min packet, min = current
-        MinDataPacket = CurrentDataPacket;
-        imin = k;
-      }
-    } // End of for loop: MinDataPacket has been filled appropriately
+  for(unsigned int r = 0; r < nranges; r++){
+    for(unsigned int i = 0; i < jobs[r].batches.size(); i++)
+      to_serializer(jobs[r].batches[i]);
+    EventCounter += jobs[r].nevents;
+  }
+
+  for(unsigned int k = 0; k < numUSB; k++)
+    erase_front_packets(CurrentData[k], used[k]);
+  ExtraData .swap(jobs[nranges-1].open);
+  ExtraIndex.swap(jobs[nranges-1].openindex);
 
-    if(MinData.size() > 0) { // Check for equal events
-      if( LessThan(MinData.back(), MinDataPacket, 3) ) {
-        // Ignore gaps which consist of fewer than 4 clock cycles
-        ++EventCounter;
-        BuildEvent(MinData, MinIndex, fd);
+  return EventCounter;
+}
 
-        MinData.clear();
-        MinIndex.clear();
-      }
-    }
-    MinData.push_back(MinDataPacket); // Add new element
-    MinIndex.push_back(imin);
-    CurrentDataIt[imin]++; // Increment iterator for added packet
+// Builds events out of the available data and leaves the unbuilt data for
+// the next try.  The packets of all USB streams are put into time order
+// until one stream runs out, since later packets from that stream might
+// still belong before packets we already have from the others.  Events are
+// runs of packets in that order separated by gaps of more than 3 clock
+// cycles.  The last event is carried over to the next call, as it may
+// continue into data we don't have yet.  Events are queued for writing to
+// the file for 'subrun'.  Returns the number of events built.
+//
+// Packets are moved, not copied, from 'CurrentData' into the batches of
+// events, so their hits are never copied.
+unsigned int RunBuilder::SuperBuildEvents(const unsigned int subrun)
+{
+  const unsigned int nranges =
+    Scheduler.IsOn()? Scheduler.GetBuildRanges(): BuildRanges;
+  if(nranges > 1)
+    return SuperBuildEventsInRanges(subrun, nranges);
+
+  {
+    worker_slot slot(Workers, WorkerClient);
+    merge_streams(CurrentData, MergeGroupSize, Order);
+  }
+
+  event_sink sink;
+  sink.b = PendingEvents != NULL? PendingEvents: new_batch(kFileSet, subrun);
+  sink.b->subrun = subrun;
+  sink.full = NULL;
+  sink.nevents = 0;
+
+  put_open_event(sink, ExtraData, ExtraIndex);
 
-  } // End of while loop: Events have been built for this time stamp
+  vector<unsigned int> used(numUSB, 0); // packets taken from each stream
+
+  for(unsigned int i = 0; i < Order.size(); i++) {
+    const int usb = Order[i].usb;
+    add_packet(sink, CurrentData[usb][used[usb]++], usb);
+  }
 
   // Clean up operations and store data for later
+  take_open_event(sink, ExtraData, ExtraIndex);
+  PendingEvents = sink.b;
   for(unsigned int k = 0; k < numUSB; k++)
-    CurrentData[k].assign(CurrentDataIt[k], CurrentData[k].end());
-  ExtraData .assign(MinData .begin(), MinData .end());
-  ExtraIndex.assign(MinIndex.begin(), MinIndex.end());
+    erase_front_packets(CurrentData[k], used[k]);
 
-  return EventCounter;
+  return sink.nevents;
+}
+
+// Moves all of CurrentData out to the spill files.  Their hit containers go
+// back to the pool for the decoders.
+void RunBuilder::spill_current()
+{
+  trace_scope span("spill");
+  for(unsigned int j = 0; j < numUSB; j++){
+    Spills[j].Write(CurrentData[j]);
+    HitsPool.Give(CurrentData[j]);
+    CurrentData[j].clear();
+  }
+  CurrentBytes = 0;
 }
 
-// move files into a subdirectory called decoded/ and rename then with ".done"
-static void rename_files_we_have_read()
+// SuperBuildEvents() with -b.  If some of the data has been spilled to
+// disk, the rest is spilled too, and it is all read back and built a share
+// of the memory budget per stream at a time.  Since SuperBuildEvents() only
+// builds as far as the stream that runs out first and carries the open event
+// over, this gives exactly the events of building everything at once.
+unsigned int RunBuilder::SuperBuildSpilled(const unsigned int subrun)
 {
-  for(unsigned int j = 0; j<numUSB; j++) {
-    const string origname = OVUSBStream[j].GetFileName();
-    const string origname2 = OVUSBStream[j].GetFileName(); // basename insanity
-    const string donedir = dirname((char *)origname.c_str()) + string("/decoded/");
-    const string donename = donedir +
-      string(basename((char *)OVUSBStream[j].GetFileName())) + ".done";
+  bool spilled = false;
+  for(unsigned int j = 0; j < numUSB; j++)
+    if(Spills[j].Count()) spilled = true;
 
-    errno = 0;
-    if(mkdir(donedir.c_str(), 0755) == -1 && errno != EEXIST){
-      log_msg(LOG_CRIT, "Could not create directory %s: %s.\n",
-              donedir.c_str(), strerror(errno));
-      exit(1);
+  unsigned int nevents = 0;
+
+  if(spilled){
+    spill_current();
+
+    uint64_t filebytes = 0;
+    for(unsigned int j = 0; j < numUSB; j++)
+      filebytes += Spills[j].FileBytes();
+    log_msg(LOG_INFO, "Building subrun %u from %lu MB spilled to disk\n",
+            subrun, (unsigned long)(filebytes >> 20));
+
+    const uint64_t share = std::max<uint64_t>(SpillBudget/numUSB, 1);
+    while(true){
+      bool ondisk = false;
+      uint64_t before = 0;
+      for(unsigned int j = 0; j < numUSB; j++){
+        const uint64_t have = packet_memory(CurrentData[j]);
+        if(have < share){
+          trace_scope span("unspill", subrun, -1, j);
+          Spills[j].Read(CurrentData[j], share - have);
+        }
+        if(Spills[j].Count()) ondisk = true;
+        before += CurrentData[j].size();
+      }
+      if(!ondisk) break;
+
+      nevents += SuperBuildEvents(subrun);
+
+      uint64_t after = 0;
+      for(unsigned int j = 0; j < numUSB; j++)
+        after += CurrentData[j].size();
+
+      // Some stream has more than its share of data after the end of
+      // another's, which can only be built in the next subrun, so it has to
+      // be held in memory until then.
+      if(after == before){
+        log_msg(LOG_WARNING, "USB streams out of step by more than the "
+                "memory budget.  Reading the rest back into memory.\n");
+        for(unsigned int j = 0; j < numUSB; j++)
+          Spills[j].Read(CurrentData[j], (uint64_t)-1);
+        break;
+      }
     }
+  }
 
-    errno = 0;
-    if(rename(origname2.c_str(), donename.c_str())) {
-      log_msg(LOG_CRIT, "Could not rename input file %s to %s: %s.\n",
-              origname2.c_str(), donename.c_str(), strerror(errno));
-      exit(1);
+  nevents += SuperBuildEvents(subrun);
+
+  CurrentBytes = 0;
+  for(unsigned int j = 0; j < numUSB; j++)
+    CurrentBytes += packet_memory(CurrentData[j]);
+
+  return nevents;
+}
+
+// Notes that USB stream j is done with the file it has just read, which
+// went into 'subrun', and has it archived into decoded/ once that subrun
+// is written out.  Files are left alone in offline mode.
+void RunBuilder::retire_file_we_have_read(const unsigned int j,
+                                          const unsigned int subrun)
+{
+  const string name = OVUSBStream[j].GetFileName();
+  string base = name.substr(name.rfind('/') + 1);
+
+  if(!Offline){
+    Archiver.Archive(name, subrun);
+    LastConsumed[j] = base;
+    return;
+  }
+
+  if(is_compressed_name(base))
+    base.erase(base.size() - strlen(compressed_suffix));
+  if(base.size() > 5 && base.compare(base.size() - 5, 5, ".done") == 0)
+    base.erase(base.size() - 5);
+  LastConsumed[j] = base;
+}
+
+// Splits an input file name of the form ${unix_time_stamp}_${usb_number}
+// into its parts.  Returns false if the name isn't of that form.
+static bool split_input_name(const string & name, unsigned long & stamp,
+                             int & usb)
+{
+  const size_t delim = name.find("_");
+  if(delim == string::npos || delim == 0) return false;
+
+  char * end;
+  stamp = strtoul(name.c_str(), &end, 10);
+  if(end != name.c_str() + delim) return false;
+
+  usb = strtol(name.c_str() + delim + 1, &end, 10);
+  return *end == '\0' && end != name.c_str() + delim + 1;
+}
+
+// After restoring a checkpoint, make the input directory agree with it.
+// Files archived in decoded/ after the checkpoint was written have not made
+// it into any subrun, so are moved back to be read again.  Files that the
+// checkpoint says were consumed, but which are still in the input
+// directory, are archived without being read.  Archived files that have
+// been compressed are decompressed back into the input directory.
+void RunBuilder::reconcile_input_with_checkpoint()
+{
+  const string donedir = InputDir + "/decoded";
+  const string compressed = string(".done") + compressed_suffix;
+
+  vector<string> done_files, done_suffixes;
+  DIR * dp = opendir(donedir.c_str());
+  if(dp != NULL){
+    struct dirent * dirp;
+    while((dirp = readdir(dp)) != NULL){
+      const string name = dirp->d_name;
+      if(name.size() > 5 && name.compare(name.size() - 5, 5, ".done") == 0){
+        done_files.push_back(name.substr(0, name.size() - 5));
+        done_suffixes.push_back(".done");
+      }
+      else if(name.size() > compressed.size() &&
+              name.compare(name.size() - compressed.size(), compressed.size(),
+                           compressed) == 0){
+        done_files.push_back(name.substr(0, name.size() - compressed.size()));
+        done_suffixes.push_back(compressed);
+      }
+    }
+    closedir(dp);
+  }
+
+  vector<string> input_files;
+  GetDir(InputDir, input_files);
+
+  for(unsigned int j = 0; j < numUSB; j++){
+    unsigned long last_stamp = 0;
+    int usb;
+    if(!LastConsumed[j].empty() &&
+       !split_input_name(LastConsumed[j], last_stamp, usb))
+      log_msg(LOG_CRIT, "Fatal Error: bad file name %s in checkpoint\n",
+              LastConsumed[j].c_str());
+
+    for(unsigned int i = 0; i < done_files.size(); i++){
+      unsigned long stamp;
+      if(!split_input_name(done_files[i], stamp, usb)) continue;
+      if(usb != OVUSBStream[j].GetUSB() || stamp <= last_stamp) continue;
+
+      const string from = donedir + "/" + done_files[i] + done_suffixes[i];
+      const string to = InputDir + "/" + done_files[i];
+      if(access(to.c_str(), F_OK) == 0){
+        // Already restored from the other of a file caught being compressed
+        unlink(from.c_str());
+        continue;
+      }
+      log_msg(LOG_NOTICE, "Restoring %s, which was not built before "
+              "the checkpoint\n", to.c_str());
+      if(is_compressed_name(from)){
+        if(!decompress_file(from, to))
+          log_msg(LOG_CRIT, "Could not restore %s\n", to.c_str());
+        unlink(from.c_str());
+      }
+      else if(rename(from.c_str(), to.c_str()))
+        log_msg(LOG_CRIT, "Could not rename %s to %s: %s.\n",
+                from.c_str(), to.c_str(), strerror(errno));
+    }
+
+    for(unsigned int i = 0; i < input_files.size(); i++){
+      unsigned long stamp;
+      if(!split_input_name(input_files[i], stamp, usb)) continue;
+      if(usb != OVUSBStream[j].GetUSB() || stamp > last_stamp) continue;
+
+      const string from = InputDir + "/" + input_files[i];
+      const string to = donedir + "/" + input_files[i] + ".done";
+      log_msg(LOG_NOTICE, "Archiving %s, which was built before the "
+              "checkpoint\n", from.c_str());
+      if(rename(from.c_str(), to.c_str()))
+        log_msg(LOG_CRIT, "Could not rename %s to %s: %s.\n",
+                from.c_str(), to.c_str(), strerror(errno));
     }
   }
 }
 
+string RunBuilder::checkpoint_name()
+{
+  return OutBase + ".checkpoint";
+}
+
+// Returns the checkpoint state of USB stream j.  Called by its decoder.
+string RunBuilder::stream_checkpoint_state(const unsigned int j)
+{
+  char * buf = NULL;
+  size_t size = 0;
+  FILE * f = open_memstream(&buf, &size);
+  if(f == NULL)
+    log_msg(LOG_CRIT, "Fatal Error: could not allocate checkpoint state\n");
+
+  if(!ckpt_write_string(f, LastConsumed[j]) || !OVUSBStream[j].SaveState(f))
+    log_msg(LOG_CRIT, "Fatal Error: could not save state of USB %d\n",
+            OVUSBStream[j].GetUSB());
+  fclose(f);
+
+  const string state(buf, size);
+  free(buf);
+  return state;
+}
+
+// Returns everything needed to carry on after 'subrun' has been written
+// out, given the checkpoint state of each USB stream.  Called by the
+// merger after building 'subrun'.
+string RunBuilder::checkpoint_state(const unsigned int subrun,
+                                    const vector<string> & stream_states)
+{
+  char * buf = NULL;
+  size_t size = 0;
+  FILE * f = open_memstream(&buf, &size);
+  if(f == NULL)
+    log_msg(LOG_CRIT, "Fatal Error: could not allocate checkpoint state\n");
+
+  bool ok = ckpt_write_u32(f, subrun+1) && ckpt_write_u32(f, numUSB) &&
+            ckpt_write_u64(f, __atomic_load_n(&TimeKeyReference,
+                                              __ATOMIC_ACQUIRE));
+
+  for(unsigned int j = 0; ok && j < numUSB; j++)
+    ok = 1 == fwrite(stream_states[j].data(), stream_states[j].size(), 1, f) &&
+         ckpt_write_packets(f, CurrentData[j]);
+
+  ok = ok && ckpt_write_packets(f, ExtraData) &&
+       ckpt_write_u32(f, ExtraIndex.size());
+  for(unsigned int i = 0; ok && i < ExtraIndex.size(); i++)
+    ok = ckpt_write_u32(f, ExtraIndex[i]);
+
+  if(!ok) log_msg(LOG_CRIT, "Fatal Error: could not save builder state\n");
+  fclose(f);
+
+  const string state(buf, size);
+  free(buf);
+  return state;
+}
+
+// Writes out a checkpoint with the given state, followed by the writer's
+// own: which output file is next or open, and how much of it and of the
+// side output is written.
+// Called by the writer once the subrun the state was taken after is safely
+// on disk.  Returns false, leaving the previous checkpoint in place, if it
+// could not be written.
+bool RunBuilder::write_checkpoint(const unsigned int subrun,
+                                  const string & state)
+{
+  const string name = checkpoint_name();
+  FILE * f = ckpt_begin(name);
+
+  if(1 != fwrite(state.data(), state.size(), 1, f) ||
+     !ckpt_write_u32(f, FileIndex) ||
+     !ckpt_write_u64(f, Output.IsOpen()? Output.GetSize(): 0) ||
+     !ckpt_write_u64(f, SideOutput.IsOpen()? SideOutput.GetSize(): 0)){
+    fclose(f);
+    log_msg(LOG_ERR, "Could not write checkpoint %s\n", name.c_str());
+    return false;
+  }
+
+  if(!ckpt_commit(f, name)) return false;
+  log_msg(LOG_INFO, "Checkpointed after subrun %u\n", subrun);
+  return true;
+}
+
+// If there is a checkpoint, restore the state in it and return the number
+// of the next subrun to write.  Otherwise, return zero.
+unsigned int RunBuilder::resume_from_checkpoint()
+{
+  const string name = checkpoint_name();
+  FILE * f = ckpt_open(name);
+  if(f == NULL) return 0;
+
+  uint32_t subrun, nusb;
+  uint64_t keyref = 0;
+  bool ok = ckpt_read_u32(f, subrun) && ckpt_read_u32(f, nusb) &&
+            ckpt_read_u64(f, keyref);
+  if(ok && nusb != numUSB)
+    log_msg(LOG_CRIT, "Fatal Error: checkpoint %s has %u USB streams, but "
+            "the config has %u\n", name.c_str(), nusb, numUSB);
+  TimeKeyReference = keyref;
+
+  for(unsigned int j = 0; ok && j < numUSB; j++)
+    ok = ckpt_read_string(f, LastConsumed[j]) &&
+         OVUSBStream[j].RestoreState(f) &&
+         ckpt_read_packets(f, CurrentData[j]);
+
+  uint32_t nindex = 0;
+  ok = ok && ckpt_read_packets(f, ExtraData) && ckpt_read_u32(f, nindex);
+  ExtraIndex.resize(nindex);
+  for(unsigned int i = 0; ok && i < nindex; i++){
+    uint32_t index;
+    ok = ckpt_read_u32(f, index);
+    ExtraIndex[i] = index;
+  }
+
+  uint32_t fileindex = 0;
+  ok = ok && ckpt_read_u32(f, fileindex) && ckpt_read_u64(f, ResumeOffset) &&
+       ckpt_read_u64(f, ResumeSideOffset);
+  FileIndex = fileindex;
+  fclose(f);
+
+  if(!ok)
+    log_msg(LOG_CRIT, "Fatal Error: checkpoint %s is truncated or corrupt\n",
+            name.c_str());
+
+  // In offline mode, find_offline_files() skips what was already read
+  if(!Offline) reconcile_input_with_checkpoint();
+
+  log_msg(LOG_NOTICE, "Resuming from checkpoint at subrun %u\n", subrun);
+  return subrun;
+}
+
 static void setup_signals()
 {
   // Lots of boilerplate that just says that when we get a
@@ -789,17 +1835,167 @@ static void setup_signals()
   }
 }
 
-// Waits for new files and returns true if it opened some.  If the run
+// For offline mode.  Adds the names of the input files in 'dir' that end
+// with 'suffix' to OfflineFiles, with their Unix time stamps in 'stamps'.
+// Files up to and including the last one consumed, according to a
+// checkpoint, are skipped.
+void RunBuilder::add_offline_files(const string & dir, const string & suffix,
+  vector< vector< std::pair<unsigned long, string> > > & stamps)
+{
+  DIR * dp = opendir(dir.c_str());
+  if(dp == NULL) return;
+
+  struct dirent * dirp;
+  while((dirp = readdir(dp)) != NULL){
+    string name = dirp->d_name;
+    if(name.size() <= suffix.size() ||
+       name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0)
+      continue;
+    name.erase(name.size() - suffix.size());
+
+    unsigned long stamp;
+    int usb;
+    if(name.find('.') != string::npos || !split_input_name(name, stamp, usb))
+      continue;
+
+    for(unsigned int j = 0; j < numUSB; j++){
+      if(usb != OVUSBStream[j].GetUSB()) continue;
+
+      unsigned long last_stamp = 0;
+      int last_usb;
+      if(!LastConsumed[j].empty() &&
+         split_input_name(LastConsumed[j], last_stamp, last_usb) &&
+         stamp <= last_stamp)
+        break;
+
+      stamps[j].push_back(std::pair<unsigned long, string>(
+        stamp, dir + "/" + dirp->d_name));
+    }
+  }
+  closedir(dp);
+}
+
+// For offline mode.  Finds all input files, both those still in the input
+// directory and those already archived to decoded/, and lines them up into
+// file sets: the nth file set is the nth file in time order of each USB.
+void RunBuilder::find_offline_files()
+{
+  vector< vector< std::pair<unsigned long, string> > > stamps(numUSB);
+  add_offline_files(InputDir, "", stamps);
+  add_offline_files(InputDir + "/decoded", ".done", stamps);
+  add_offline_files(InputDir + "/decoded", string(".done") + compressed_suffix,
+                    stamps);
+
+  unsigned int nsets = (unsigned int)-1;
+  OfflineFiles.resize(numUSB);
+  for(unsigned int j = 0; j < numUSB; j++){
+    sort(stamps[j].begin(), stamps[j].end());
+    for(unsigned int i = 0; i < stamps[j].size(); i++){
+      // A file caught being compressed is there both ways.  Sorting puts
+      // the uncompressed one first.
+      if(i && stamps[j][i].first == stamps[j][i-1].first) continue;
+      OfflineFiles[j].push_back(stamps[j][i].second);
+    }
+    nsets = std::min(nsets, (unsigned int)OfflineFiles[j].size());
+  }
+
+  for(unsigned int j = 0; j < numUSB; j++)
+    if(OfflineFiles[j].size() > nsets)
+      log_msg(LOG_WARNING, "Ignoring last %lu input files for USB %d, which "
+              "has more files than some other USB\n",
+              (long int)(OfflineFiles[j].size() - nsets), OVUSBStream[j].GetUSB());
+
+  log_msg(LOG_NOTICE, "Found %u file sets to reprocess\n", nsets);
+}
+
+// For offline mode.  Gives the next set of input files, asking the kernel
+// to start reading them in ahead of the decoders.  Returns false at the end
+// of the input.
+bool RunBuilder::NextOfflineFileSet(vector<string> & names)
+{
+  for(unsigned int j = 0; j < numUSB; j++)
+    if(OfflineNext >= OfflineFiles[j].size()) return false;
+
+  names.resize(numUSB);
+  for(unsigned int j = 0; j < numUSB; j++){
+    names[j] = OfflineFiles[j][OfflineNext];
+
+    const int fd = open(names[j].c_str(), O_RDONLY);
+    if(fd >= 0){
+      posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+      close(fd);
+    }
+  }
+  OfflineNext++;
+  return true;
+}
+
+// Returns about how many complete file sets are waiting to be read
+unsigned int RunBuilder::waiting_filesets()
+{
+  if(Offline){
+    unsigned int nsets = OfflineFiles[0].size();
+    for(unsigned int j = 1; j < numUSB; j++)
+      nsets = std::min<unsigned int>(nsets, OfflineFiles[j].size());
+    return nsets > OfflineNext? nsets - OfflineNext: 0;
+  }
+
+  vector<string> files;
+  GetDir(InputDir, files);
+
+  unsigned int waiting = 0;
+  for(unsigned int j = 0; j < files.size(); j++)
+    if(!Dispatched.count(files[j]) && files[j].find('_') != string::npos)
+      waiting++;
+  return waiting/numUSB;
+}
+
+// Whether the run is over: in offline mode, once all the input has been
+// read, and otherwise, once we get SIGUSR1.
+bool RunBuilder::run_ended() const
+{
+  return run_has_ended || (!Offline && EndRunSignalled);
+}
+
+// For -u.  Waits until it is time for the decoders to take in what has
+// arrived on their sockets, and fills 'names' with empty names, as there
+// are no files.  Returns false once the run has ended and the last of the
+// data has been taken in.
+bool RunBuilder::NextIngestChunk(vector<string> & names)
+{
+  if(drained){
+    log_msg(LOG_INFO, "Finished processing run\n");
+    return false;
+  }
+
+  if(run_ended()) drained = true;
+  else usleep(ingest_chunk_ms*1000);
+
+  names.assign(numUSB, "");
+  return true;
+}
+
+// Waits for new files and returns true if it found some.  If the run
 // ends or no files are forthcoming, return false.
-static bool HandleOpenNextFileSet()
+bool RunBuilder::HandleFindNextFileSet(vector<string> & names)
 {
+  if(SocketDir != "") return NextIngestChunk(names);
+
+  if(Offline){
+    if(NextOfflineFileSet(names)) return true;
+
+    log_msg(LOG_INFO, "Finished processing run\n");
+    run_has_ended = true;
+    return false;
+  }
+
   const time_t oldtime = time(0);
 
-  while(!OpenNextFileSet()){ // Try to find new files for each USB
-    if((difftime(time(0), oldtime) > ENDTIME && run_has_ended)
+  while(!FindNextFileSet(names)){ // Try to find new files for each USB
+    if((difftime(time(0), oldtime) > ENDTIME && run_ended())
      || difftime(time(0), oldtime) > MAXTIME) {
 
-      if(run_has_ended)
+      if(run_ended())
         log_msg(LOG_INFO, "Finished processing run\n");
       else
         log_msg(LOG_ERR, "No new files for %ds, but I didn't hear that "
@@ -813,82 +2009,966 @@ static bool HandleOpenNextFileSet()
   return true;
 }
 
-// Decode the latest set of open input files.  Each is decoded in a
-// separate thread.  The decoded data is kept inside the USBStream
-// objects for later retrieval.
-static void DecodeFileSet()
+void RunBuilder::send_to_decoders(const pipeline_msg_type type,
+                                  const unsigned int subrun,
+                                  const unsigned int fileset,
+                                  const vector<string> & names)
+{
+  for(unsigned int j = 0; j < numUSB; j++){
+    decode_msg * m = new decode_msg;
+    m->type = type;
+    m->subrun = subrun;
+    m->fileset = fileset;
+    if(type == kFileSet) m->file = names[j];
+    ToDecoder[j]->Push(m);
+  }
+}
+
+// The reader stage.  Hands sets of input files to the decoders, up to the
+// maximum number per subrun or until the conditions for stopping the run
+// have been met, then marks the end of the subrun.  A "subrun" is the set
+// of data read in this way.  All data for a subrun is kept in memory
+// together so that it can be sorted by time.
+void RunBuilder::read_files(const unsigned int first_subrun)
 {
-  pthread_t threads[numUSB]; // An array of threads to decode files
+  const vector<string> none;
+  unsigned int fileset = 0;
+
+  trace_thread("reader");
+  set_log_tag(Name.c_str());
+
+  for(unsigned int subrun = first_subrun; !run_ended(); subrun++){
+    const int filesets_this_subrun = Scheduler.IsOn()?
+      Scheduler.Plan(waiting_filesets()): max_filesets_subrun;
 
-  int indices[numUSB]; // arguments for pthread.
-  for(unsigned int j = 0; j < numUSB; j++){ // Load all files in at once
-    indices[j] = j;
-    pthread_create(&threads[j], NULL, decode, &indices[j]);
+    for(int nfilesets = 0; nfilesets < filesets_this_subrun; nfilesets++){
+      vector<string> names;
+      const uint64_t begin = trace_clock();
+      if(!HandleFindNextFileSet(names)) break;
+      trace_span("find", begin, subrun, fileset, -1);
+
+      log_msg(LOG_INFO, "Decoding file set #%d for this run\n", nfilesets);
+      send_to_decoders(kFileSet, subrun, fileset++, names);
+    }
+    send_to_decoders(kEndSubrun, subrun, 0, none);
   }
+  send_to_decoders(kEndRun, 0, 0, none);
+}
 
-  for(unsigned int j = 0; j < numUSB; j++)
-    pthread_join(threads[j], NULL);
+// With -a, writes the first 'len' bytes of raw data received from USB
+// stream j, as file set 'fileset', to a file in decoded/ named as the DAQ
+// would have named it, with the Unix time of the file set, so that the run
+// can be reprocessed with -O.  Every stream gets a file for every file set,
+// empty if nothing whole was received, so that -O lines them up the same
+// way.  Since the data is decoded the same way, file set by file set, with
+// the decoder state carried from one file to the next, that gives the same
+// events.
+void RunBuilder::archive_received(const unsigned int j,
+                                  const unsigned int fileset,
+                                  const string & buf, const size_t len)
+{
+  char name[64];
+  snprintf(name, sizeof name, "/decoded/%lu_%d.done",
+           (unsigned long)(IngestStart + fileset*ingest_chunk_ms/1000),
+           OVUSBStream[j].GetUSB());
+
+  OutputFile f;
+  f.Open(InputDir + name);
+  if(!f.Write(buf.data(), len) || !f.Close(true))
+    log_msg(LOG_ERR, "Could not archive received data to %s\n",
+            f.GetName().c_str());
+  else Archiver.Compress(name);
 }
 
-// Reads in data from files into CurrentData until either the maximum
-// number of files has been read or the conditions for stopping the run
-// have been met. A "subrun" is the set of data read in this way. All
-// data for a subrun is kept in memory together so that it can be sorted
-// by time.
-static void read_in_for_subrun(vector< vector<decoded_packet> > & CurrentData)
+// Puts into 'slice' the data decoded on stream j up to its next Unix time
+// stamp.  With -s, it is all of the data decoded, and each setting makes
+// its own slice of what passes its cut in send_to_branches().
+void RunBuilder::extract_slice(const unsigned int j, slice_msg * slice)
 {
-  for(int nfilesets = 0; nfilesets < max_filesets_subrun; nfilesets++){
-    // Open set of files
-    if(!HandleOpenNextFileSet()) return;
+  USBstream & stream = OVUSBStream[j];
+  if(Sweep.empty()){
+    stream.GetDecodedDataUpToNextUnixTimeStamp(slice->packets);
+    slice->tolutc = stream.GetTOLUTC();
+    return;
+  }
 
-    // Move the data from the files into USBStream objects
-    log_msg(LOG_INFO, "Decoding file set #%d for this run\n", nfilesets);
-    DecodeFileSet();
+  // The first time stamp is taken as it was found, before taking all the
+  // data moves it on
+  slice->tolutc = stream.GetTOLUTC();
+  bool more = true;
+  while(more)
+    more = stream.GetDecodedDataUpToNextUnixTimeStamp(slice->packets);
+}
 
-    rename_files_we_have_read();
+// With -s, makes this setting's slice of stream j from the packets in
+// 'slice', all those newly decoded that pass its cut, in time order, and
+// 'stamp', the stream's first Unix time stamp or 0 if none yet.  It is
+// what a decoder with this setting's threshold would have passed on: the
+// packets are put in time order with those carried over, these first on
+// ties, as USBstream slots them into place, and then passed on up to the
+// next Unix time stamp as by GetDecodedDataUpToNextUnixTimeStamp().  The
+// slice boundaries then don't depend on packets failing the cut.
+void RunBuilder::cut_slice(const unsigned int j, const uint32_t stamp,
+                           slice_msg * slice)
+{
+  vector<decoded_packet> & carry = SweepCarry[j];
+  vector<decoded_packet> & packets = slice->packets;
+  uint32_t & tolutc = SweepTOLUTC[j];
+  if(tolutc == 0) tolutc = stamp;
+
+  vector<decoded_packet> merged(carry.size() + packets.size());
+  unsigned int a = 0, b = 0;
+  for(unsigned int k = 0; k < merged.size(); k++){
+    if(b == packets.size() ||
+       (a < carry.size() && !LessThan(packets[b], carry[a], 0)))
+      merged[k].swap(carry[a++]);
+    else
+      merged[k].swap(packets[b++]);
+  }
 
-    // Move data from USBStream object into CurrentData's.
-    // XXX worried about this.  It reads up to the Unix time stamp, a
-    // synchronization point, except nothing seems to keep these time stamps
-    // synchronized between the several USB streams.
-    for(unsigned int j = 0; j < numUSB; j++)
-      OVUSBStream[j].GetDecodedDataUpToNextUnixTimeStamp(CurrentData[j]);
+  unsigned int n = 0;
+  while(n < merged.size()){
+    const decoded_packet & p = merged[n++];
+    if(!p.hits.empty() && p.timeunix > tolutc){
+      tolutc = p.timeunix;
+      break;
+    }
+  }
+
+  packets.resize(n);
+  for(unsigned int k = 0; k < n; k++) packets[k].swap(merged[k]);
+  carry.resize(merged.size() - n);
+  for(unsigned int k = n; k < merged.size(); k++) carry[k-n].swap(merged[k]);
+  slice->tolutc = tolutc;
+}
+
+// With -s, appends a copy of packet 'p', decoded on stream j, to a branch's
+// slice 'copy'.  Each branch needs its own copy of the hits, as it puts the
+// packets in order, shifts charges and gives the hits back to HitsPool on
+// its own, so the copy is made in a container from the pool if there is one.
+void RunBuilder::copy_packet(const unsigned int j, const decoded_packet & p,
+                             slice_msg * copy)
+{
+  vector< vector<decoded_hit> > & spare = SweepSpareHits[j];
+  if(spare.empty()) HitsPool.Take(spare, 256);
+
+  copy->packets.push_back(decoded_packet());
+  decoded_packet & c = copy->packets.back();
+  c.isadc = p.isadc;
+  c.module = p.module;
+  c.timeunix = p.timeunix;
+  c.time16ns = p.time16ns;
+  c.timekey = p.timekey;
+  if(!spare.empty()){
+    c.hits.swap(spare.back());
+    spare.pop_back();
+  }
+  c.hits.assign(p.hits.begin(), p.hits.end());
+}
+
+// The decoder stage for USB stream j.  Decodes each file it is given,
+// archives it and passes on the data up to the next Unix time stamp.
+// With -s, hands a copy of what decoder 'j' made of a message to each
+// branch, with only the packets that pass the branch's cut, then applies
+// this builder's own cut to 'slice'.  Each setting then cuts its own slice
+// out of the files' data.
+void RunBuilder::send_to_branches(const unsigned int j, slice_msg * slice)
+{
+  vector<decoded_packet> & packets = slice->packets;
+  const bool fileset = slice->type == kFileSet;
+  const uint32_t stamp = slice->tolutc;
+
+  for(unsigned int i = 0; i < Branches.size(); i++){
+    RunBuilder & b = *Branches[i];
+    slice_msg * copy;
+    if(!b.FreeSlices[j]->TryPop(copy)) copy = new slice_msg;
+    copy->type = slice->type;
+    copy->subrun = slice->subrun;
+    copy->tolutc = slice->tolutc;
+    copy->daq = slice->daq;
+    copy->packets.clear();
+    copy->state.clear();
+    const vector<int> & shift = b.BaselineShift[j];
+    for(unsigned int k = 0; k < packets.size(); k++){
+      if(shift.empty()){
+        if(b.SweepCut.Passes(packets[k])) copy_packet(j, packets[k], copy);
+        continue;
+      }
+
+      copy_packet(j, packets[k], copy);
+      decoded_packet & p = copy->packets.back();
+      for(unsigned int h = 0; h < p.hits.size(); h++)
+        p.hits[h].charge += shift[p.module*64 + p.hits[h].channel];
+      if(!b.SweepCut.Passes(p)){
+        // Keep its container for the next copy
+        SweepSpareHits[j].push_back(vector<decoded_hit>());
+        SweepSpareHits[j].back().swap(p.hits);
+        copy->packets.pop_back();
+      }
+    }
+    if(fileset) b.cut_slice(j, stamp, copy);
+    b.ToMerger[j]->Push(copy);
+  }
+
+  unsigned int n = 0;
+  for(unsigned int k = 0; k < packets.size(); k++)
+    if(SweepCut.Passes(packets[k])){
+      if(n != k) packets[n].swap(packets[k]);
+      n++;
+    }
+  packets.resize(n);
+  if(fileset) cut_slice(j, stamp, slice);
+}
+
+void RunBuilder::decoder_thread(const unsigned int j)
+{
+  USBstream & stream = OVUSBStream[j];
+
+  stream.SetHitPool(&HitsPool);
+  stream.SetWorkers(&Workers, WorkerClient);
+  trace_thread("decoder", j);
+  set_log_tag(Name.c_str());
+
+  string received; // raw data from the socket not yet decoded, with -u
+
+  decode_histograms histograms;
+  if(OnlineMonitor.IsOn()){
+    histograms.Init(numModules);
+    stream.SetMonitor(&histograms);
+  }
+
+  while(true){
+    decode_msg * m = ToDecoder[j]->Pop();
+
+    slice_msg * slice;
+    if(!FreeSlices[j]->TryPop(slice)) slice = new slice_msg;
+    slice->type = m->type;
+    slice->subrun = m->subrun;
+    slice->tolutc = 0;
+    slice->daq = daq_word_counts();
+    slice->packets.clear();
+    slice->state.clear();
+
+    if(m->type == kFileSet && SocketDir != ""){
+      const int subrun = m->subrun, fileset = m->fileset;
+      uint64_t begin = trace_clock();
+      Ingest[j].Receive(received);
+      trace_span("receive", begin, subrun, fileset, j);
+
+      // Take only whole 24-bit words, so that each chunk, and so each
+      // archive file, can be decoded on its own
+      size_t whole = received.size();
+      while(whole > 0 && ((received[whole-1] >> 6) & 3) != 3) whole--;
+
+      if(ArchiveReceived) archive_received(j, fileset, received, whole);
+
+      worker_slot slot(Workers, WorkerClient);
+      if(whole > 0){
+        begin = trace_clock();
+        stream.decodestream(Ingest[j].GetPath(), received.data(), whole);
+        received.erase(0, whole);
+        trace_span("decode", begin, subrun, fileset, j);
+        slice->daq = stream.GetChunkDAQCounts();
+
+        if(OnlineMonitor.IsOn()) OnlineMonitor.Fold(j, histograms);
+      }
+
+      // Even with nothing new, as for an empty file
+      begin = trace_clock();
+      extract_slice(j, slice);
+      trace_span("extract", begin, subrun, fileset, j);
+    }
+    else if(m->type == kFileSet){
+      const int subrun = m->subrun, fileset = m->fileset;
+      worker_slot slot(Workers, WorkerClient);
+      uint64_t begin = trace_clock();
+      const bool opened = stream.OpenFile(m->file) == 1;
+      trace_span("open", begin, subrun, fileset, j);
+
+      begin = trace_clock();
+      const uint64_t start_us = monotonic_us();
+      if(opened){
+        if(!stream.decodefile())
+          log_msg(LOG_ERR, "Skipping unreadable file %s\n",
+                  stream.GetFileName());
+        slice->daq = stream.GetChunkDAQCounts();
+      }
+      else
+        log_msg(LOG_ERR, "Skipping unreadable file %s\n", stream.GetFileName());
+      trace_span("decode", begin, subrun, fileset, j);
+      if(Scheduler.IsOn()) Scheduler.ObserveDecode(monotonic_us() - start_us);
+
+      if(OnlineMonitor.IsOn()) OnlineMonitor.Fold(j, histograms);
+
+      retire_file_we_have_read(j, subrun);
+
+      // XXX worried about this.  It reads up to the Unix time stamp, a
+      // synchronization point, except nothing seems to keep these time stamps
+      // synchronized between the several USB streams.
+      begin = trace_clock();
+      extract_slice(j, slice);
+      trace_span("extract", begin, subrun, fileset, j);
+    }
+    else if(m->type == kEndSubrun && UseCheckpoint){
+      slice->state = stream_checkpoint_state(j);
+    }
+    else if(m->type == kEndRun){
+      const corruption_counts & c = stream.GetCorruptionCounts();
+      if(c.any())
+        log_msg(LOG_WARNING, "USB %d corruption this run: skipped %lu bytes "
+          "and %lu words, %lu bad headers, %lu parity errors, %lu bad module "
+          "numbers\n", stream.GetUSB(), (unsigned long)c.skipped_bytes,
+          (unsigned long)c.skipped_words, (unsigned long)c.bad_headers,
+          (unsigned long)c.parity_errors, (unsigned long)c.bad_modules);
+
+      const daq_word_counts & d = stream.GetDAQCounts();
+      if(d.reports || d.skipped)
+        log_msg(d.lost || d.skipped? LOG_WARNING: LOG_INFO, "USB %d DAQ "
+          "counts this run: received %lu words, lost %lu, skipped %lu\n",
+          stream.GetUSB(), (unsigned long)d.received, (unsigned long)d.lost,
+          (unsigned long)d.skipped);
+    }
+
+    if(!Sweep.empty()) send_to_branches(j, slice);
+
+    const pipeline_msg_type type = m->type;
+    delete m;
+    ToMerger[j]->Push(slice);
+
+    if(type == kEndRun) return;
+  }
+}
+
+// Logs the words the DAQ says it received and lost in subrun 'subrun', for
+// each USB stream in 'daq', next to how long the builder took over the
+// subrun, 'wall_us', of which 'build_us' building its events, and, when
+// live, how far behind the data it is.  A fall in the event rate can then be
+// put down either to loss in the front end or to the builder not keeping up.
+void RunBuilder::report_subrun(const unsigned int subrun,
+                               const vector<daq_word_counts> & daq,
+                               const unsigned int nfilesets,
+                               const unsigned int nevents,
+                               const uint64_t wall_us, const uint64_t build_us,
+                               const uint32_t tolutc)
+{
+  daq_word_counts all;
+  for(unsigned int j = 0; j < numUSB; j++){
+    all.add(daq[j]);
+    if(daq[j].lost || daq[j].skipped)
+      log_msg(LOG_WARNING, "USB %d: DAQ lost %lu of %lu data words and "
+        "skipped %lu in subrun %u\n", OVUSBStream[j].GetUSB(),
+        (unsigned long)daq[j].lost,
+        (unsigned long)(daq[j].received + daq[j].lost),
+        (unsigned long)daq[j].skipped, subrun);
+  }
+
+  char daqpart[128] = "no DAQ word counts";
+  if(all.reports)
+    snprintf(daqpart, sizeof daqpart, "DAQ received %lu words, lost %lu "
+      "(%.3f%%)", (unsigned long)all.received, (unsigned long)all.lost,
+      100.0*all.lost/std::max<uint64_t>(all.received + all.lost, 1));
+
+  char lagpart[64] = "";
+  if(!Offline && tolutc)
+    snprintf(lagpart, sizeof lagpart, ", %ld s behind the data",
+             (long)(time(0) - tolutc));
+
+  log_msg(LOG_INFO, "Subrun %u: %s; built %u events from %u file sets in "
+    "%.1f s, %.1f s of it building%s\n", subrun, daqpart, nevents, nfilesets,
+    wall_us*1e-6, build_us*1e-6, lagpart);
+}
+
+// The merger stage.  Collects data from all decoders, and at the end of
+// each subrun, builds events from it.
+void RunBuilder::merger_thread()
+{
+  uint32_t tolutc = 0;
+  vector<string> stream_states(numUSB);
+  unsigned int nfilesets = 0; // in this subrun
+  vector<daq_word_counts> daq(numUSB); // in this subrun
+  uint64_t subrun_start_us = monotonic_us();
+
+  // There may be data from a checkpoint already
+  for(unsigned int j = 0; SpillBudget && j < numUSB; j++)
+    CurrentBytes += packet_memory(CurrentData[j]);
+
+  trace_thread("merger");
+  set_log_tag(Name.c_str());
+
+  while(true){
+    pipeline_msg_type type = kFileSet;
+    unsigned int subrun = 0;
+
+    // The decoders all see the same sequence of messages
+    for(unsigned int j = 0; j < numUSB; j++){
+      slice_msg * slice = ToMerger[j]->Pop();
+      type = slice->type;
+      subrun = slice->subrun;
+
+      if(type == kFileSet){
+        if(SpillBudget) CurrentBytes += packet_memory(slice->packets);
+        append_packets(CurrentData[j], slice->packets);
+        daq[j].add(slice->daq);
+        if(j == 0){
+          tolutc = slice->tolutc;
+          nfilesets++;
+        }
+      }
+      else if(type == kEndSubrun){
+        stream_states[j].swap(slice->state);
+      }
+      if(!FreeSlices[j]->TryPush(slice)) delete slice;
+    }
+
+    if(type == kFileSet){
+      if(SpillBudget && CurrentBytes > SpillBudget) spill_current();
+      continue;
+    }
+
+    build_batch * end = new_batch(type, subrun);
+
+    if(type == kEndSubrun){
+      trace_scope span("merge", subrun);
+      const uint64_t start_us = monotonic_us();
+      end->nevents = SpillBudget? SuperBuildSpilled(subrun):
+                                  SuperBuildEvents(subrun);
+      const uint64_t end_us = monotonic_us();
+      if(Scheduler.IsOn())
+        Scheduler.ObserveBuild(nfilesets, end_us - start_us);
+      report_subrun(subrun, daq, nfilesets, end->nevents,
+                    end_us - subrun_start_us, end_us - start_us, tolutc);
+      daq.assign(numUSB, daq_word_counts());
+      subrun_start_us = end_us;
+      nfilesets = 0;
+      end->tolutc = tolutc;
+      if(UseCheckpoint)
+        end->checkpoint = checkpoint_state(subrun, stream_states);
+      flush_events();
+    }
+
+    to_serializer(end);
+
+    if(type == kEndRun) return;
+  }
+}
+
+// Passes 'b' to the next serializer in turn.  kEndRun goes to all of them,
+// so that they all stop, each with its own copy.  Only for the merger thread.
+void RunBuilder::to_serializer(build_batch * b)
+{
+  const unsigned int n = b->type == kEndRun? SerializerThreads: 1;
+  for(unsigned int i = 0; i < n; i++){
+    ToSerializer[NextSerializer]->Push(i == 0? b: new_batch(kEndRun, b->subrun));
+    NextSerializer = (NextSerializer + 1) % SerializerThreads;
+  }
+}
+
+// Serializer 'i'.  Encodes batches of events in the output format, and
+// notes what they show of the sync pulses, for the writer to check.  Events
+// failing the trigger are left for the writer to prescale, as that depends
+// on how many failed in the batches before.
+void RunBuilder::serializer_thread(const unsigned int i)
+{
+  const bool triggering = TriggerConfig != "";
+  const bool prescaled = Trigger.GetPrescale() != 0;
+  build_histograms * const hist =
+    OnlineMonitor.IsOn()? &BuildHistograms[i]: NULL;
+
+  trace_thread("serializer", i);
+  set_log_tag(Name.c_str());
+
+  while(true){
+    build_batch * b = ToSerializer[i]->Pop();
+
+    if(b->type == kFileSet){
+      worker_slot slot(Workers, WorkerClient);
+      trace_scope span("serialize", b->subrun);
+      b->nencoded = 0;
+      unsigned int first = 0;
+      for(unsigned int e = 0; e < b->event_end.size(); e++){
+        const unsigned int n = b->event_end[e] - first;
+        const decoded_packet * const packets = &b->packets[first];
+        const int * const usbindex = &b->usbindex[first];
+        Encoder.NoteSync(packets, usbindex, n, b->sync);
+        if(!triggering || Trigger.Pass(packets, usbindex, n)){
+          Encoder.EncodeShared(packets, usbindex, n, b->bytes, hist);
+          if(WriteColumns) b->columns.AddEvent(packets, usbindex, n, Encoder);
+          b->nencoded++;
+        }
+        else if(prescaled)
+          b->rejected.push_back(e);
+        first = b->event_end[e];
+      }
+
+      if(hist) OnlineMonitor.Fold(*hist);
+
+      // Done with these, so give the hits back to the decoders now, unless
+      // the writer may need some
+      if(b->rejected.empty()){
+        HitsPool.Give(b->packets);
+        b->packets.clear();
+        b->usbindex.clear();
+      }
+    }
+
+    const pipeline_msg_type type = b->type;
+    ToWriter[i]->Push(b);
+
+    if(type == kEndRun) return;
+  }
+}
+
+// Encodes every prescale'th event failing the trigger of batch 'b' to its
+// side output, counting those failing from 'rejected', which is updated.
+void RunBuilder::prescale_rejected(build_batch * b, unsigned int & rejected)
+{
+  const unsigned int prescale = Trigger.GetPrescale();
+  build_histograms * const hist =
+    OnlineMonitor.IsOn()? &BuildHistograms.back(): NULL;
+
+  for(unsigned int i = 0; i < b->rejected.size(); i++){
+    if(rejected++ % prescale != 0) continue;
+    const unsigned int e = b->rejected[i];
+    const unsigned int first = e == 0? 0: b->event_end[e-1];
+    Encoder.EncodeShared(&b->packets[first], &b->usbindex[first],
+                         b->event_end[e] - first, b->sidebytes, hist);
+  }
+  if(hist) OnlineMonitor.Fold(*hist);
+
+  HitsPool.Give(b->packets);
+  b->packets.clear();
+  b->usbindex.clear();
+}
+
+void RunBuilder::open_output()
+{
+  const unsigned int BUFSIZE = 1024;
+  char outfile[BUFSIZE];
+  snprintf(outfile, BUFSIZE, "%s_%05u", OutBase.c_str(), FileIndex);
+
+  Output.SetPolicy(OutputPolicy);
+  Output.Open(outfile, ResumeOffset);
+  ResumeOffset = 0;
+
+  if(Trigger.GetPrescale()){
+    snprintf(outfile, BUFSIZE, "%s_prescaled_%05u", OutBase.c_str(), FileIndex);
+    SideOutput.SetPolicy(OutputPolicy);
+    SideOutput.Open(outfile, ResumeSideOffset);
+    ResumeSideOffset = 0;
+  }
+}
+
+bool RunBuilder::close_output()
+{
+  if(WriteColumns){
+    char name[1024];
+    snprintf(name, sizeof name, "%s_columns_%05u", OutBase.c_str(), FileIndex);
+    Columns.Write(name);
+    Columns.Clear();
+  }
+
+  FileIndex++;
+  const bool sideok = !SideOutput.IsOpen() ||
+                      write_end_block_and_close(SideOutput);
+  return write_end_block_and_close(Output) && sideok;
+}
+
+// Whether the output file is full or old enough to start another
+bool RunBuilder::rotation_due()
+{
+  return (RotateBytes && Output.GetSize() >= RotateBytes) ||
+         (RotateSeconds && difftime(time(0), Output.GetOpenTime()) >= RotateSeconds);
+}
+
+// The writer stage.  Writes encoded events to the output file, taking
+// batches from the serializers in the turn the merger gave them out, so in
+// order, and checks their sync pulses.  Output files are closed at the end
+// of each subrun, or, if rotating by size or time, when full or old enough.
+void RunBuilder::writer_thread()
+{
+  const bool rotating = RotateBytes || RotateSeconds;
+  unsigned int next = 0; // serializer the next message comes from
+
+  // Counts for this subrun.  The prescale counter starts over each subrun
+  // so that resuming from a checkpoint gives the same output.
+  unsigned int triggered = 0, rejected = 0;
+
+  trace_thread("writer");
+  set_log_tag(Name.c_str());
+
+  while(true){
+    build_batch * b = ToWriter[next]->Pop();
+    next = (next + 1) % SerializerThreads;
+
+    OnlineMonitor.MaybeDump(b->type == kEndRun);
+
+    if(b->type == kEndRun){
+      // The other serializers' copies follow
+      for(unsigned int i = 1; i < SerializerThreads; i++){
+        delete ToWriter[next]->Pop();
+        next = (next + 1) % SerializerThreads;
+      }
+
+      if(Output.IsOpen()) close_output();
+      ShmRing.Close();
+      delete b;
+      return;
+    }
+
+    if(!Output.IsOpen()) open_output();
+
+    if(b->type == kFileSet){
+      trace_scope span("write", b->subrun);
+      Encoder.CheckSync(b->sync);
+      triggered += b->nencoded;
+      if(!b->rejected.empty()) prescale_rejected(b, rejected);
+      if(WriteColumns) Columns.Append(b->columns);
+
+      if(ShmRing.IsOpen())
+        ShmRing.Publish(b->bytes.data(), b->bytes.size(), b->nencoded);
+
+      if(!Output.Write(b->bytes.data(), b->bytes.size()))
+        log_msg(LOG_CRIT, "Fatal Error: Cannot write events to %s: %s\n",
+                Output.GetName().c_str(), strerror(errno));
+      if(SideOutput.IsOpen() &&
+         !SideOutput.Write(b->sidebytes.data(), b->sidebytes.size()))
+        log_msg(LOG_CRIT, "Fatal Error: Cannot write events to %s: %s\n",
+                SideOutput.GetName().c_str(), strerror(errno));
+      if(rotating && rotation_due()) close_output();
+    }
+    else{ // kEndSubrun
+      trace_scope span("close", b->subrun);
+      const bool safe = rotating? !UseCheckpoint || (Output.Sync() &&
+                                  (!SideOutput.IsOpen() || SideOutput.Sync()))
+                                : close_output();
+      // A restart resumes from the last checkpoint written, so the files of
+      // the subrun are only let go once there is one after it
+      const bool saved = safe &&
+        (!UseCheckpoint || write_checkpoint(b->subrun, b->checkpoint));
+      if(saved && Archiver.IsOn()) Archiver.Release(b->subrun);
+
+      log_msg(LOG_INFO, "Number of built events: %d\nProcessed time stamp: %d\n",
+              b->nevents, b->tolutc);
+      if(TriggerConfig != "")
+        log_msg(LOG_INFO, "Number of events passing the trigger: %u\n",
+                triggered);
+      triggered = rejected = 0;
+    }
+
+    if(!FreeBatches->TryPush(b)) delete b;
+  }
+}
+
+void RunBuilder::make_queues()
+{
+  // The reader may get up to a subrun ahead of the merger
+  const unsigned int maxsets =
+    std::max<unsigned int>(max_filesets_subrun, AdaptiveFileSets);
+  for(unsigned int j = 0; j < numUSB; j++){
+    ToDecoder.push_back(new SPSCQueue<decode_msg *>(maxsets+2));
+    ToMerger .push_back(new SPSCQueue<slice_msg *> (maxsets+2));
+    FreeSlices.push_back(new SPSCQueue<slice_msg *>(maxsets+2));
+  }
+  for(unsigned int i = 0; i < SerializerThreads; i++){
+    ToSerializer.push_back(new SPSCQueue<build_batch *>(16));
+    ToWriter    .push_back(new SPSCQueue<build_batch *>(16));
+  }
+  FreeBatches = new SPSCQueue<build_batch *>(32*(SerializerThreads+1));
+}
+
+void RunBuilder::open_spill_files()
+{
+  if(!SpillBudget) return;
+
+  Spills.resize(numUSB);
+  for(unsigned int j = 0; j < numUSB; j++){
+    char name[64];
+    snprintf(name, sizeof name, ".spill_%d", OVUSBStream[j].GetUSB());
+    Spills[j].Open(OutBase + name);
+  }
+}
+
+// Starts the decoders, unless 'decoders' is false, as for a branch fed by
+// another builder's decoders, then the merger, serializers and writer.
+// 'stages' must be kept until the threads, put in 'threads', are joined.
+void RunBuilder::start_stages(vector<stage_start> & stages,
+                              vector<pthread_t> & threads, const bool decoders)
+{
+  const unsigned int ndecoders = decoders? numUSB: 0;
+  stages.resize(ndecoders + SerializerThreads + 2);
+  threads.resize(stages.size());
+
+  for(unsigned int i = 0; i < stages.size(); i++){
+    stages[i].builder = this;
+    stages[i].index = 0;
+    if(i < ndecoders){
+      stages[i].stage = kDecoder;
+      stages[i].index = i;
+    }
+    else if(i == ndecoders)
+      stages[i].stage = kMerger;
+    else if(i + 1 < stages.size()){
+      stages[i].stage = kSerializer;
+      stages[i].index = i - ndecoders - 1;
+    }
+    else
+      stages[i].stage = kWriter;
+    if(pthread_create(&threads[i], NULL, run_stage, &stages[i]))
+      log_msg(LOG_CRIT, "Fatal Error: could not start pipeline threads\n");
+  }
+}
+
+// Runs the pipeline of a branch, less the decoders, until the end of the run
+void * RunBuilder::branch_thread(void * builder)
+{
+  RunBuilder & b = *(RunBuilder *)builder;
+  vector<stage_start> stages;
+  vector<pthread_t> threads;
+  b.start_stages(stages, threads, false);
+  for(unsigned int i = 0; i < threads.size(); i++)
+    pthread_join(threads[i], NULL);
+  return NULL;
+}
+
+// With -s, sets up a branch for each setting after the first, to build the
+// run from this builder's decoded packets, and starts it.  Each setting's
+// output, this builder's included, is named after it.  Called once the
+// baselines are in, since they are found from packets that pass the first
+// setting's threshold, as without -s.
+void RunBuilder::start_sweep()
+{
+  // From now on, each setting's threshold is applied after decoding
+  for(unsigned int j = 0; j < numUSB; j++)
+    OVUSBStream[j].SetThresh(Threshold, kNone);
+
+  const string base = OutBase;
+  SweepSpareHits.resize(numUSB);
+  for(unsigned int i = 0; i < Sweep.size(); i++){
+    RunBuilder * b = i == 0? this: new RunBuilder;
+    b->Threshold = Sweep[i].first;
+    b->EBTrigMode = Sweep[i].second;
+    b->SweepCut.Set(b->Threshold, b->EBTrigMode);
+    b->SweepCarry.resize(numUSB);
+    b->SweepTOLUTC.assign(numUSB, 0);
+
+    char suffix[64];
+    snprintf(suffix, sizeof suffix, "_t%d_T%d", b->Threshold,
+             (int)b->EBTrigMode);
+    b->OutBase = base + suffix;
+    if(i == 0){
+      if(Name == "") Name = OutBase;
+      continue;
+    }
+    b->Name = b->OutBase;
+
+    b->InputDir = InputDir;
+    b->ConfigFile = ConfigFile;
+    b->Offline = Offline;
+    b->SpillBudget = SpillBudget;
+    b->MergeGroupSize = MergeGroupSize;
+    b->BuildRanges = BuildRanges;
+    b->SerializerThreads = SerializerThreads;
+    b->AdaptiveFileSets = AdaptiveFileSets;
+    b->RotateBytes = RotateBytes;
+    b->RotateSeconds = RotateSeconds;
+    b->OutputPolicy = OutputPolicy;
+    b->WriteColumns = WriteColumns;
+    b->TriggerConfig = TriggerConfig;
+    b->WorkerClient = Workers.AddClient();
+
+    b->setup_from_config(ConfigFile);
+    b->LoadBaselineData(); // found already by this builder
+    b->BaselineShift.resize(numUSB);
+    for(unsigned int j = 0; j < numUSB; j++){
+      const vector<int> & mine = OVUSBStream[j].GetBaseline();
+      const vector<int> & theirs = b->OVUSBStream[j].GetBaseline();
+      if(mine == theirs) continue;
+      b->BaselineShift[j].resize(mine.size());
+      for(unsigned int c = 0; c < mine.size(); c++)
+        b->BaselineShift[j][c] = mine[c] - theirs[c];
+    }
+    b->make_queues();
+    b->CurrentData.resize(b->numUSB);
+    b->open_spill_files();
+
+    Branches.push_back(b);
+    BranchThreads.push_back(pthread_t());
+    if(pthread_create(&BranchThreads.back(), NULL, branch_thread, b))
+      log_msg(LOG_CRIT, "Fatal Error: could not start pipeline threads\n");
   }
 }
 
 // Do everything after the setup steps and the baseline determinations.
 // Reads data and writes out subrun files until there's no more to do.
-static void MainBuild()
+void RunBuilder::MainBuild()
 {
-  // for current timestamp to process
-  vector< vector<decoded_packet> > CurrentData(maxUSB);
+  CurrentData.resize(numUSB);
 
-  for(unsigned int subrun = 0; !run_has_ended; subrun++){
-    read_in_for_subrun(CurrentData);
+  // Baselines have been decoded already and aren't cached
+  if(PacketCacheDir != ""){
+    errno = 0;
+    if(mkdir(PacketCacheDir.c_str(), 0755) == -1 && errno != EEXIST)
+      log_msg(LOG_CRIT, "Could not create directory %s: %s\n",
+              PacketCacheDir.c_str(), strerror(errno));
+    for(unsigned int j = 0; j < numUSB; j++)
+      OVUSBStream[j].SetPacketCache(PacketCacheDir);
+  }
+
+  open_spill_files();
+
+  unsigned int first_subrun = 0;
+  if(UseCheckpoint) first_subrun = resume_from_checkpoint();
+
+  if(Offline) find_offline_files();
+
+  if(AdaptiveFileSets){
+    const long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    Scheduler.Init(AdaptiveFileSets, BuildRanges, ncpus > 0? ncpus: 1);
+  }
 
-    const unsigned int BUFSIZE = 1024;
-    char outfile[BUFSIZE];
-    snprintf(outfile, BUFSIZE, "%s_%05u", OutBase.c_str(), subrun);
-    const int fd = open_file(outfile);
+  make_queues();
 
-    const unsigned int EventCounter = SuperBuildEvents(CurrentData, fd);
-    write_end_block_and_close(fd);
+  // Spare hit memory counts against the memory budget too
+  if(SpillBudget) HitsPool.Limit(SpillBudget/8);
 
-    log_msg(LOG_INFO, "Number of built events: %d\nProcessed time stamp: %d\n",
-            EventCounter, OVUSBStream[0].GetTOLUTC());
+  if(ShmName != "") ShmRing.Open(ShmName, ShmBytes);
+  if(!Offline) Archiver.Start(InputDir, RetentionSeconds, CompressArchive);
+
+  if(SocketDir != ""){
+    IngestStart = time(0);
+    Ingest.resize(numUSB);
+    for(unsigned int j = 0; j < numUSB; j++){
+      char name[64];
+      snprintf(name, sizeof name, "/usb_%d", OVUSBStream[j].GetUSB());
+      Ingest[j].Listen(SocketDir + name);
+    }
+  }
+
+  vector<stage_start> stages;
+  vector<pthread_t> threads;
+  start_stages(stages, threads, true);
+
+  read_files(first_subrun);
+
+  for(unsigned int i = 0; i < threads.size(); i++)
+    pthread_join(threads[i], NULL);
+  Archiver.Stop();
+  for(unsigned int j = 0; j < Ingest.size(); j++) Ingest[j].Close();
+}
+
+void * RunBuilder::run_stage(void * arg)
+{
+  const stage_start & start = *(stage_start *)arg;
+  RunBuilder & b = *start.builder;
+
+  switch(start.stage){
+    case kDecoder:    b.decoder_thread(start.index); break;
+    case kMerger:     b.merger_thread(); break;
+    case kSerializer: b.serializer_thread(start.index); break;
+    case kWriter:     b.writer_thread(); break;
+  }
+  return NULL;
+}
+
+void RunBuilder::Run()
+{
+  set_log_tag(Name.c_str());
+  WorkerClient = Workers.AddClient();
+
+  setup_from_config(ConfigFile);
+  if(!LoadBaselineData()) return;
+  TimeKeyReference = 0; // baselines may be from another sync phase
+  if(!Offline && !InitRun()) return;
+  if(!Sweep.empty()) start_sweep();
+
+  MainBuild();
+
+  for(unsigned int i = 0; i < BranchThreads.size(); i++)
+    pthread_join(BranchThreads[i], NULL);
+}
+
+static void * run_builder(void * builder)
+{
+  ((RunBuilder *)builder)->Run();
+  return NULL;
+}
+
+// Sets up a builder for each line of InstancesFile, which holds the same
+// options as the command line would for a single builder.  Blank lines and
+// lines starting with '#' are skipped.
+static void read_instances(const char * const progname,
+                           vector<RunBuilder *> & builders)
+{
+  FILE * f = fopen(InstancesFile.c_str(), "r");
+  if(f == NULL){
+    printf("Could not read %s: %s\n", InstancesFile.c_str(), strerror(errno));
+    exit(127);
+  }
+
+  char * line = NULL;
+  size_t len = 0;
+  while(getline(&line, &len, f) != -1){
+    vector<char *> args(1, (char *)progname);
+    for(char * word = strtok(line, " \t\n"); word != NULL;
+        word = strtok(NULL, " \t\n"))
+      args.push_back(word);
+    if(args.size() == 1 || args[1][0] == '#') continue;
+
+    RunBuilder * b = new RunBuilder;
+    optind = 0; // glibc's getopt only starts over completely from 0
+    b->parse_options(args.size(), &args[0], true);
+    b->Name = b->GetOutBase();
+
+    for(unsigned int i = 0; i < builders.size(); i++)
+      if(builders[i]->GetInputDir() == b->GetInputDir() ||
+         builders[i]->GetOutBase() == b->GetOutBase()){
+        printf("Two builders in %s have the same input directory or "
+               "output\n", InstancesFile.c_str());
+        exit(127);
+      }
+    builders.push_back(b);
+  }
+  fclose(f);
+  if(line) free(line);
+
+  if(builders.empty()){
+    printf("No builders listed in %s\n", InstancesFile.c_str());
+    exit(127);
   }
 }
 
 int main(int argc, char **argv)
 {
-  const string configfile = parse_options(argc, argv);
+  vector<RunBuilder *> builders(1, new RunBuilder);
+  builders[0]->parse_options(argc, argv, false);
+  if(InstancesFile != ""){
+    delete builders[0];
+    builders.clear();
+    read_instances(argv[0], builders);
+
+    if(WorkerSlots == 0){
+      const long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+      WorkerSlots = ncpus > 0? ncpus: 1;
+    }
+  }
+
+  if(TraceFile != "") trace_start();
+  if(WorkerSlots) Workers.Init(WorkerSlots);
   setup_signals(); // so we will know when each run has ended
   start_log(); // establish syslog connection
-  setup_from_config(configfile);
-  LoadBaselineData();
-  InitRun();
 
-  MainBuild();
+  if(InstancesFile == "")
+    builders[0]->Run();
+  else{
+    vector<pthread_t> threads(builders.size());
+    for(unsigned int i = 0; i < builders.size(); i++)
+      if(pthread_create(&threads[i], NULL, run_builder, builders[i]))
+        log_msg(LOG_CRIT, "Fatal Error: could not start builder thread\n");
+    for(unsigned int i = 0; i < builders.size(); i++)
+      pthread_join(threads[i], NULL);
+  }
+
+  if(TraceFile != "") trace_write(TraceFile);
 
   return 0;
 }
@@ -0,0 +1,176 @@
+#include <stdint.h>
+#include <syslog.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "USBstream.h"
+#include "USBstreamUtils.h"
+#include "Monitor.h"
+#include "EventEncoder.h"
+
+EventEncoder::EventEncoder()
+{
+  // Packets from unknown modules are encoded as module 0
+  overflow.resize(1, false);
+  maxcount_16ns.resize(1, 0);
+  monitor = NULL;
+}
+
+void EventEncoder::SetStreams(const std::vector<int> & serials)
+{
+  usbserials = serials;
+  index_modules();
+}
+
+void EventEncoder::AddModule(const int serial, const int board,
+                             const uint16_t pmtboard_u)
+{
+  unique[std::pair<int, int>(serial, board)] = pmtboard_u;
+
+  if(pmtboard_u >= overflow.size()){
+    overflow.resize(pmtboard_u+1, false);
+    maxcount_16ns.resize(pmtboard_u+1, 0);
+  }
+  index_modules();
+}
+
+// Fills outmodule from usbserials and unique, so that looking up a
+// packet's output module doesn't need a search of the map
+void EventEncoder::index_modules()
+{
+  outmodule.assign(usbserials.size(), std::vector<int>());
+  for(std::map<std::pair<int, int>, uint16_t>::const_iterator u =
+        unique.begin(); u != unique.end(); u++)
+    for(unsigned int i = 0; i < usbserials.size(); i++){
+      if(usbserials[i] != u->first.first) continue;
+      std::vector<int> & boards = outmodule[i];
+      if(u->first.second >= (int)boards.size())
+        boards.resize(u->first.second+1, -1);
+      boards[u->first.second] = u->second;
+    }
+}
+
+int EventEncoder::OutModule(const int usbindex, const uint16_t module) const
+{
+  const std::vector<int> & boards = outmodule[usbindex];
+  return module < boards.size()? boards[module]: -1;
+}
+
+void EventEncoder::Encode(const decoded_packet * const packets,
+                          const int * const usbindex,
+                          const unsigned int npackets, std::string & buf)
+{
+  EncodeShared(packets, usbindex, npackets, buf, monitor);
+
+  scratch.clear();
+  NoteSync(packets, usbindex, npackets, scratch);
+  CheckSync(scratch);
+}
+
+void EventEncoder::EncodeShared(const decoded_packet * const packets,
+                                const int * const usbindex,
+                                const unsigned int npackets, std::string & buf,
+                                build_histograms * hist) const
+{
+  if(npackets == 0){
+    log_msg(LOG_WARNING, "Got empty event to encode. Trying to continue.\n");
+    return;
+  }
+
+  OVEventHeader evheader;
+  evheader.time_sec = packets[0].timeunix;
+  evheader.n_ov_data_packets = npackets;
+  evheader.encode(buf);
+
+  if(hist) hist->Event(npackets);
+
+  for(unsigned int packeti = 0; packeti < npackets; packeti++){
+    const decoded_packet & packet = packets[packeti];
+
+    int module = OutModule(usbindex[packeti], packet.module);
+    if(module < 0){
+      log_msg(LOG_ERR, "Got unknown module number %d on USB %d\n",
+              packet.module, usbserials[usbindex[packeti]]);
+      module = 0;
+    }
+    if(hist) hist->Module(module);
+
+    if(!packet.isadc){
+      log_msg(LOG_ERR, "Got non-ADC packet. Not supported!\n");
+      continue;
+    }
+
+    OVDataPacketHeader moduleheader;
+    moduleheader.nHits = packet.hits.size();
+    moduleheader.module = module;
+    moduleheader.time16ns = packet.time16ns;
+    moduleheader.encode(buf);
+
+    for(int m = 0; m < moduleheader.nHits; m++) {
+      OVHitData hit;
+      hit.channel = packet.hits[m].channel;
+      hit.charge  = packet.hits[m].charge;
+      hit.encode(buf);
+    }
+  }
+}
+
+void EventEncoder::NoteSync(const decoded_packet * const packets,
+                            const int * const usbindex,
+                            const unsigned int npackets,
+                            sync_record & sync) const
+{
+  if(sync.last.size() < overflow.size()) sync.last.resize(overflow.size(), -1);
+
+  for(unsigned int packeti = 0; packeti < npackets; packeti++){
+    const decoded_packet & packet = packets[packeti];
+    if(!packet.isadc) continue;
+
+    const int module = std::max(0, OutModule(usbindex[packeti], packet.module));
+
+    // Sync pulse diagnostic info: pulse expected at clock count
+    // 2^(SYNC_PULSE_CLK_COUNT_PERIOD_LOG2).  Look for overflows.
+    const bool over =
+      packet.time16ns > (1 << SYNC_PULSE_CLK_COUNT_PERIOD_LOG2);
+
+    int & last = sync.last[module];
+    if(last >= 0 && sync.runs[last].over == over){
+      if(over) sync.runs[last].time16ns = packet.time16ns;
+      continue;
+    }
+
+    sync_record::sync_run run;
+    run.module = module;
+    run.over = over;
+    run.time_sec = packets[0].timeunix;
+    run.time16ns = packet.time16ns;
+    last = sync.runs.size();
+    sync.runs.push_back(run);
+  }
+}
+
+void EventEncoder::CheckSync(const sync_record & sync)
+{
+  for(unsigned int i = 0; i < sync.runs.size(); i++){
+    const sync_record::sync_run & run = sync.runs[i];
+    const int module = run.module;
+
+    if(run.over){
+      if(!overflow[module]) {
+        log_msg(LOG_WARNING, "Module %d missed sync pulse near "
+          "Unix time stamp %ld\n", module, (long int)run.time_sec);
+        overflow[module] = true;
+      }
+      maxcount_16ns[module] = run.time16ns;
+    }
+    else if(overflow[module]) {
+      log_msg(LOG_WARNING, "Module %d max clock count %ld\t",
+        module, maxcount_16ns[module]);
+      maxcount_16ns[module] = run.time16ns;
+      overflow[module] = false;
+    }
+  }
+}
@@ -0,0 +1,72 @@
+#include <stdint.h>
+#include <pthread.h>
+
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "HitPool.h"
+
+// The most memory kept in spare containers by default, so that a burst of
+// hits doesn't pin its memory for the rest of the run.  A few subruns' worth
+// of packets at normal rates.
+static const uint64_t default_max_bytes = 16 << 20;
+
+// The memory held by a spare container
+static uint64_t spare_bytes(const std::vector<decoded_hit> & hits)
+{
+  return sizeof hits + hits.capacity()*sizeof(decoded_hit);
+}
+
+HitPool::HitPool()
+{
+  bytes = 0;
+  maxbytes = default_max_bytes;
+  pthread_mutex_init(&lock, NULL);
+}
+
+HitPool::~HitPool()
+{
+  pthread_mutex_destroy(&lock);
+}
+
+unsigned int HitPool::Take(std::vector< std::vector<decoded_hit> > & out,
+                           const unsigned int n)
+{
+  pthread_mutex_lock(&lock);
+  const unsigned int take = spares.size() < n? spares.size(): n;
+  const unsigned int old = out.size();
+  out.resize(old + take);
+  for(unsigned int i = 0; i < take; i++){
+    bytes -= spare_bytes(spares.back());
+    out[old + i].swap(spares.back());
+    spares.pop_back();
+  }
+  pthread_mutex_unlock(&lock);
+  return take;
+}
+
+void HitPool::Give(std::vector<decoded_packet> & packets)
+{
+  pthread_mutex_lock(&lock);
+  for(unsigned int i = 0; i < packets.size(); i++){
+    std::vector<decoded_hit> & hits = packets[i].hits;
+    if(hits.capacity() == 0) continue;
+    if(bytes + spare_bytes(hits) > maxbytes) break;
+    hits.clear();
+    bytes += spare_bytes(hits);
+    spares.push_back(std::vector<decoded_hit>());
+    spares.back().swap(hits);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void HitPool::Limit(const uint64_t bytes_)
+{
+  pthread_mutex_lock(&lock);
+  if(bytes_ < maxbytes) maxbytes = bytes_;
+  while(bytes > maxbytes){
+    bytes -= spare_bytes(spares.back());
+    spares.pop_back();
+  }
+  pthread_mutex_unlock(&lock);
+}
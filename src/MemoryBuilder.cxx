@@ -0,0 +1,255 @@
+#include <stdint.h>
+#include <syslog.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "USBstream.h"
+#include "USBstreamUtils.h"
+#include "Merge.h"
+#include "EventEncoder.h"
+#include "MemoryBuilder.h"
+
+// Module numbers are 7 bits in the data
+static const int maxModuleNumber = 127;
+
+MemoryBuilder::MemoryBuilder()
+{
+  setup = false;
+  nummodules = 0;
+  threshold = 73; // the EventBuilder's defaults
+  mode = 2;
+  timekeyref = 0;
+  callback = NULL;
+  callback_arg = NULL;
+  nbuilt = 0;
+}
+
+void MemoryBuilder::AddModule(const int serial, const int board,
+                              const int pmtboard_u, const int offset)
+{
+  if(setup)
+    log_msg(LOG_CRIT, "Fatal Error: modules must be added before data\n");
+  if(board < 0 || board > maxModuleNumber)
+    log_msg(LOG_CRIT, "Error: config references module %d, but max is %d.\n",
+            board, maxModuleNumber);
+
+  module_config m;
+  m.serial = serial;
+  m.board = board;
+  m.pmtboard_u = pmtboard_u;
+  m.offset = offset;
+  modules.push_back(m);
+
+  if(std::find(serials.begin(), serials.end(), serial) == serials.end())
+    serials.push_back(serial);
+  nummodules = std::max(nummodules, board+1);
+}
+
+void MemoryBuilder::SetThreshold(const int threshold_, const int mode_)
+{
+  threshold = threshold_;
+  mode = mode_;
+  for(unsigned int j = 0; j < streams.size(); j++)
+    streams[j].SetThresh(threshold, mode);
+}
+
+// Sets up 'stream' for USB 'serial' as configured
+void MemoryBuilder::Configure(USBstream & stream, const int serial)
+{
+  stream.SetNumModules(nummodules);
+  stream.SetThresh(threshold, mode);
+  stream.SetUSB(serial);
+  for(unsigned int i = 0; i < modules.size(); i++)
+    if(modules[i].serial == serial)
+      stream.SetOffset(modules[i].board, modules[i].offset);
+}
+
+void MemoryBuilder::Setup()
+{
+  if(setup) return;
+  if(serials.empty())
+    log_msg(LOG_CRIT, "Fatal Error: no modules given to build events from\n");
+
+  streams.resize(serials.size());
+  current.resize(serials.size());
+  for(unsigned int j = 0; j < serials.size(); j++){
+    Configure(streams[j], serials[j]);
+    streams[j].SetTimeKeyReference(&timekeyref);
+    allstreams.push_back(j);
+  }
+
+  encoder.SetStreams(serials);
+  for(unsigned int i = 0; i < modules.size(); i++)
+    encoder.AddModule(modules[i].serial, modules[i].board,
+                      modules[i].pmtboard_u);
+
+  setup = true;
+}
+
+unsigned int MemoryBuilder::StreamIndex(const int serial)
+{
+  Setup();
+  const unsigned int j =
+    std::find(serials.begin(), serials.end(), serial) - serials.begin();
+  if(j == serials.size())
+    log_msg(LOG_CRIT, "Fatal Error: USB %d is not in the config\n", serial);
+  return j;
+}
+
+void MemoryBuilder::SetBaselines(const int serial,
+                                 const std::vector<int> & baselines)
+{
+  streams[StreamIndex(serial)].SetBaseline(baselines);
+}
+
+// Decoded with a stream of its own, as baseline data is from another time
+void MemoryBuilder::DecodeBaselines(const int serial, const char * const data,
+                                    const size_t len)
+{
+  const unsigned int j = StreamIndex(serial);
+
+  USBstream stream;
+  uint64_t ref = 0;
+  Configure(stream, serial);
+  stream.SetTimeKeyReference(&ref);
+  stream.decodestream("baseline", data, len);
+
+  std::vector<decoded_packet> BaselineData;
+  stream.GetBaselineData(&BaselineData);
+  std::vector<int> baselines;
+  calculate_pedestals(baselines, BaselineData, nummodules);
+  streams[j].SetBaseline(baselines);
+}
+
+void MemoryBuilder::SetCallback(event_callback cb, void * arg)
+{
+  callback = cb;
+  callback_arg = arg;
+}
+
+void MemoryBuilder::Push(const int serial, const char * const data,
+                         const size_t len)
+{
+  streams[StreamIndex(serial)].decodestream("pushed data", data, len);
+}
+
+// Encodes the open event and passes it on
+void MemoryBuilder::CloseEvent()
+{
+  if(callback == NULL){
+    encoder.Encode(&openevent[0], &openindex[0], openevent.size(), built);
+    nbuilt++;
+  }
+  else{
+    event.clear();
+    encoder.Encode(&openevent[0], &openindex[0], openevent.size(), event);
+    callback(event.data(), event.size(), callback_arg);
+  }
+  openevent.clear();
+  openindex.clear();
+}
+
+// Moves each stream's decoded data up to its next Unix time stamp, or all
+// of it, onto the end of what is waiting to be built
+void MemoryBuilder::Extract(const bool all)
+{
+  std::vector<decoded_packet> slice;
+  for(unsigned int j = 0; j < streams.size(); j++){
+    bool more = streams[j].GetDecodedDataUpToNextUnixTimeStamp(slice);
+    while(all && more)
+      more = streams[j].GetDecodedDataUpToNextUnixTimeStamp(slice);
+    append_packets(current[j], slice);
+  }
+}
+
+// Adds the packets of 'data' to events in the merged order in 'order',
+// where data[k] is the data of stream index[k], and removes them from
+// 'data'.  Returns the number of events closed.
+unsigned int MemoryBuilder::BuildOrdered(
+  std::vector< std::vector<decoded_packet> > & data,
+  const std::vector<int> & index)
+{
+  unsigned int nevents = 0;
+  std::vector<unsigned int> used(data.size(), 0);
+  for(unsigned int i = 0; i < order.size(); i++){
+    const int k = order[i].usb;
+    decoded_packet & packet = data[k][used[k]++];
+
+    if(!openevent.empty() && LessThan(openevent.back(), packet, 3)){
+      CloseEvent();
+      nevents++;
+    }
+    openevent.push_back(decoded_packet());
+    openevent.back().swap(packet);
+    openindex.push_back(index[k]);
+  }
+
+  for(unsigned int k = 0; k < data.size(); k++)
+    erase_front_packets(data[k], used[k]);
+
+  return nevents;
+}
+
+// As SuperBuildEvents() in the EventBuilder
+unsigned int MemoryBuilder::Build()
+{
+  Setup();
+  Extract(false);
+  merge_streams(current, 0, order);
+  return BuildOrdered(current, allstreams);
+}
+
+// merge_streams() stops at the end of the first stream to run out, which
+// is where Build() has to stop too.  Here nothing more is coming, so once a
+// stream runs out the rest are merged on without it, until all are empty.
+unsigned int MemoryBuilder::Finish()
+{
+  Setup();
+  Extract(true);
+
+  unsigned int nevents = 0;
+  std::vector< std::vector<decoded_packet> > rest;
+  std::vector<int> index;
+  while(true){
+    rest.clear();
+    index.clear();
+    for(unsigned int j = 0; j < streams.size(); j++){
+      if(current[j].empty()) continue;
+      rest.push_back(std::vector<decoded_packet>());
+      rest.back().swap(current[j]);
+      index.push_back(j);
+    }
+    if(rest.empty()) break;
+
+    merge_streams(rest, 0, order);
+    nevents += BuildOrdered(rest, index);
+
+    for(unsigned int k = 0; k < rest.size(); k++)
+      current[index[k]].swap(rest[k]);
+  }
+
+  if(!openevent.empty()){
+    CloseEvent();
+    nevents++;
+  }
+
+  return nevents;
+}
+
+unsigned int MemoryBuilder::TakeEvents(std::string & events)
+{
+  events.append(built);
+  built.clear();
+
+  const unsigned int n = nbuilt;
+  nbuilt = 0;
+  return n;
+}
+
+const corruption_counts & MemoryBuilder::GetCorruptionCounts(const int serial)
+{
+  return streams[StreamIndex(serial)].GetCorruptionCounts();
+}
@@ -0,0 +1,253 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <syslog.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "Merge.h"
+
+using std::vector;
+
+// One unit of work for a merge thread.  Either merges USB streams
+// [first, last) of 'data' (the bottom level), or, if 'data' is NULL, the
+// already merged sequences in 'inputs'.
+struct merge_job {
+  const vector< vector<decoded_packet> > * data;
+  unsigned int first, last;
+  vector<const vector<merged_ref> *> inputs;
+  vector<merged_ref> out;
+};
+
+// The flat merge of streams [first, last).  Repeatedly takes the earliest
+// packet at the front of any stream until a stream runs out.
+static void merge_group_of_streams(const vector< vector<decoded_packet> > & data,
+                                   const unsigned int first,
+                                   const unsigned int last,
+                                   vector<merged_ref> & out)
+{
+  vector<unsigned int> pos(last - first, 0);
+
+  while(true){
+    unsigned int imin = first;
+    for(unsigned int k = first+1; k < last; k++)
+      if(LessThan(data[k][pos[k-first]], data[imin][pos[imin-first]], 0))
+        imin = k;
+
+    merged_ref ref;
+    ref.packet = &data[imin][pos[imin-first]++];
+    ref.usb = imin;
+    ref.last = pos[imin-first] == data[imin].size();
+    out.push_back(ref);
+
+    if(ref.last) break;
+  }
+}
+
+// Merges sequences that were themselves merged, stopping after the first
+// packet that was the last of its USB stream.  Every input sequence ends
+// with such a packet.
+static void merge_sequences(const vector<const vector<merged_ref> *> & in,
+                            vector<merged_ref> & out)
+{
+  vector<unsigned int> pos(in.size(), 0);
+
+  while(true){
+    unsigned int imin = 0;
+    for(unsigned int k = 1; k < in.size(); k++)
+      if(LessThan(*(*in[k])[pos[k]].packet, *(*in[imin])[pos[imin]].packet, 0))
+        imin = k;
+
+    const merged_ref & ref = (*in[imin])[pos[imin]++];
+    out.push_back(ref);
+
+    if(ref.last) break;
+  }
+}
+
+static void run_merge_job(merge_job & job)
+{
+  if(job.data != NULL)
+    merge_group_of_streams(*job.data, job.first, job.last, job.out);
+  else
+    merge_sequences(job.inputs, job.out);
+}
+
+// For threading
+static void * merge_thread(void * job)
+{
+  run_merge_job(*(merge_job *)job);
+  return NULL;
+}
+
+// Runs all the jobs, each in its own thread if there is more than one.
+static void run_merge_jobs(vector<merge_job> & jobs)
+{
+  if(jobs.size() == 1){
+    run_merge_job(jobs[0]);
+    return;
+  }
+
+  vector<pthread_t> threads(jobs.size());
+  for(unsigned int i = 0; i < jobs.size(); i++)
+    if(pthread_create(&threads[i], NULL, merge_thread, &jobs[i]))
+      log_msg(LOG_CRIT, "Fatal Error: could not start merge thread\n");
+
+  for(unsigned int i = 0; i < jobs.size(); i++)
+    pthread_join(threads[i], NULL);
+}
+
+void merge_streams(const vector< vector<decoded_packet> > & data,
+                   const unsigned int group_size,
+                   vector<merged_ref> & order)
+{
+  order.clear();
+
+  if(data.empty()) return;
+  for(unsigned int i = 0; i < data.size(); i++)
+    if(data[i].empty()) return;
+
+  const unsigned int G =
+    group_size < 2 || group_size >= data.size()? data.size(): group_size;
+
+  vector<merge_job> jobs((data.size() + G - 1)/G);
+  for(unsigned int g = 0; g < jobs.size(); g++){
+    jobs[g].data = &data;
+    jobs[g].first = g*G;
+    jobs[g].last = std::min((g+1)*G, (unsigned int)data.size());
+  }
+  run_merge_jobs(jobs);
+
+  // Merge groups of the results until only one is left
+  while(jobs.size() > 1){
+    vector<merge_job> next((jobs.size() + G - 1)/G);
+    for(unsigned int g = 0; g < next.size(); g++){
+      next[g].data = NULL;
+      for(unsigned int i = g*G; i < std::min((g+1)*G, (unsigned int)jobs.size()); i++)
+        next[g].inputs.push_back(&jobs[i].out);
+    }
+    run_merge_jobs(next);
+    jobs.swap(next);
+  }
+
+  order.swap(jobs[0].out);
+}
+
+static bool packet_less(const decoded_packet & lhs, const decoded_packet & rhs)
+{
+  return LessThan(lhs, rhs, 0);
+}
+
+void merged_extent(const vector< vector<decoded_packet> > & data,
+                   vector<unsigned int> & used)
+{
+  used.assign(data.size(), 0);
+
+  for(unsigned int k = 0; k < data.size(); k++)
+    if(data[k].empty()) return;
+
+  // The merge stops after the earliest last packet of any stream, taking
+  // the stream with the lowest index on ties.
+  unsigned int c = 0;
+  for(unsigned int k = 1; k < data.size(); k++)
+    if(LessThan(data[k].back(), data[c].back(), 0)) c = k;
+  const decoded_packet & stop = data[c].back();
+
+  // Streams before c also give up packets equal to the stopping packet
+  // before it, and streams after c do not.
+  for(unsigned int k = 0; k < data.size(); k++){
+    if(k == c)
+      used[k] = data[k].size();
+    else if(k < c)
+      used[k] = std::upper_bound(data[k].begin(), data[k].end(), stop,
+                                 packet_less) - data[k].begin();
+    else
+      used[k] = std::lower_bound(data[k].begin(), data[k].end(), stop,
+                                 packet_less) - data[k].begin();
+  }
+}
+
+// Whether cutting each stream k before packet split[k] leaves every packet
+// before the cut more than 'window' ticks before every packet after it.
+// Since each stream is in time order, only the packets on either side of
+// the cut need checking.
+static bool valid_cut(const vector< vector<decoded_packet> > & data,
+                      const vector<unsigned int> & used,
+                      const vector<unsigned int> & split, const int window)
+{
+  for(unsigned int k = 0; k < data.size(); k++){
+    if(split[k] == 0) continue;
+    for(unsigned int l = 0; l < data.size(); l++){
+      if(split[l] == used[l]) continue;
+      if(!LessThan(data[k][split[k]-1], data[l][split[l]], window))
+        return false;
+    }
+  }
+  return true;
+}
+
+void partition_streams(const vector< vector<decoded_packet> > & data,
+                       const vector<unsigned int> & used,
+                       const unsigned int nranges, const int window,
+                       vector< vector<unsigned int> > & cuts)
+{
+  // How far to look past each evenly spaced candidate for a usable gap
+  const unsigned int max_tries = 256;
+
+  cuts.assign(1, vector<unsigned int>(data.size(), 0));
+
+  // Space the cuts evenly through the stream with the most packets
+  unsigned int s = 0;
+  for(unsigned int k = 1; k < data.size(); k++)
+    if(used[k] > used[s]) s = k;
+
+  for(unsigned int r = 1; r < nranges; r++){
+    const unsigned int first = (unsigned long)used[s]*r/nranges;
+
+    for(unsigned int i = first; i < used[s] && i < first + max_tries; i++){
+      vector<unsigned int> split(data.size());
+      bool later = true; // is this after the previous cut in every stream?
+      bool empty = true; // would the range before this cut be empty?
+      for(unsigned int k = 0; k < data.size(); k++){
+        split[k] = std::lower_bound(data[k].begin(), data[k].begin() + used[k],
+                                    data[s][i], packet_less) - data[k].begin();
+        later = later && split[k] >= cuts.back()[k];
+        empty = empty && split[k] == cuts.back()[k];
+      }
+
+      if(later && !empty && valid_cut(data, used, split, window)){
+        cuts.push_back(split);
+        break;
+      }
+    }
+  }
+
+  cuts.push_back(used);
+}
+
+void merge_ranges(const vector< vector<decoded_packet> > & data,
+                  const vector<unsigned int> & begin,
+                  const vector<unsigned int> & end,
+                  vector<merged_ref> & order)
+{
+  order.clear();
+  vector<unsigned int> pos(begin);
+
+  while(true){
+    int imin = -1;
+    for(unsigned int k = 0; k < data.size(); k++){
+      if(pos[k] == end[k]) continue;
+      if(imin < 0 || LessThan(data[k][pos[k]], data[imin][pos[imin]], 0))
+        imin = k;
+    }
+    if(imin < 0) break;
+
+    merged_ref ref;
+    ref.packet = &data[imin][pos[imin]++];
+    ref.usb = imin;
+    ref.last = pos[imin] == data[imin].size();
+    order.push_back(ref);
+  }
+}
@@ -0,0 +1,138 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "Monitor.h"
+
+template<typename T> static void fold_into(std::vector<T> & total,
+                                           std::vector<T> & shard)
+{
+  for(unsigned int i = 0; i < shard.size(); i++) total[i] += shard[i];
+  std::fill(shard.begin(), shard.end(), 0);
+}
+
+Monitor::Monitor()
+{
+  pthread_mutex_init(&lock, NULL);
+  interval = 0;
+  last_dump = 0;
+  nmodules = 0;
+}
+
+void Monitor::Init(const std::string & filename_, const unsigned int interval_,
+                   const std::vector<int> & usbs_, const int nmodules_,
+                   const int noutmodules)
+{
+  filename = filename_;
+  interval = interval_;
+  usbs = usbs_;
+  nmodules = nmodules_;
+  last_dump = time(0);
+
+  decoded.resize(usbs.size());
+  for(unsigned int i = 0; i < usbs.size(); i++) decoded[i].Init(nmodules);
+  built.Init(noutmodules);
+}
+
+void Monitor::Fold(const unsigned int usbindex, decode_histograms & shard)
+{
+  pthread_mutex_lock(&lock);
+  decode_histograms & total = decoded[usbindex];
+  fold_into(total.hits, shard.hits);
+  fold_into(total.charge, shard.charge);
+  fold_into(total.pedestal_n, shard.pedestal_n);
+  fold_into(total.pedestal_sum, shard.pedestal_sum);
+  pthread_mutex_unlock(&lock);
+}
+
+void Monitor::Fold(build_histograms & shard)
+{
+  pthread_mutex_lock(&lock);
+  built.nevents += shard.nevents;
+  shard.nevents = 0;
+  fold_into(built.multiplicity, shard.multiplicity);
+  fold_into(built.modules, shard.modules);
+  pthread_mutex_unlock(&lock);
+}
+
+// Writes the totals as text, one histogram per line, leaving out the empty
+// ones, then zeroes them:
+//
+//   snapshot <unix time> <seconds covered>
+//   rate <usb> <module> <channel> <hits per second>
+//   charge <usb> <module> <channel> <count in each bin>...
+//   pedestal <usb> <module> <channel> <hits near baseline> <mean charge>
+//   events <number built>
+//   multiplicity <count with 0 packets> <with 1>... <with 63 or more>
+//   module <output module> <packets in built events>
+//   end
+void Monitor::Dump(FILE * f, const time_t now)
+{
+  const double seconds = std::max(1.0, difftime(now, last_dump));
+  fprintf(f, "snapshot %ld %.0f\n", (long)now, seconds);
+
+  for(unsigned int u = 0; u < decoded.size(); u++){
+    decode_histograms & h = decoded[u];
+    for(int i = 0; i < nmodules*64; i++){
+      if(h.hits[i] == 0) continue;
+      const int module = i/64, channel = i%64;
+
+      fprintf(f, "rate %d %d %d %.3f\n", usbs[u], module, channel,
+              h.hits[i]/seconds);
+
+      fprintf(f, "charge %d %d %d", usbs[u], module, channel);
+      for(int b = 0; b < monitor_charge_bins; b++)
+        fprintf(f, " %u", h.charge[i*monitor_charge_bins + b]);
+      fprintf(f, "\n");
+
+      if(h.pedestal_n[i])
+        fprintf(f, "pedestal %d %d %d %u %.2f\n", usbs[u], module, channel,
+                h.pedestal_n[i], (double)h.pedestal_sum[i]/h.pedestal_n[i]);
+    }
+    h.Init(nmodules);
+  }
+
+  fprintf(f, "events %lu\n", (unsigned long)built.nevents);
+  fprintf(f, "multiplicity");
+  for(unsigned int n = 0; n < built.multiplicity.size(); n++)
+    fprintf(f, " %u", built.multiplicity[n]);
+  fprintf(f, "\n");
+  for(unsigned int m = 0; m < built.modules.size(); m++)
+    if(built.modules[m])
+      fprintf(f, "module %u %u\n", m, built.modules[m]);
+  built.Init(built.modules.size());
+
+  fprintf(f, "end\n");
+}
+
+void Monitor::MaybeDump(const bool force)
+{
+  if(!IsOn()) return;
+
+  const time_t now = time(0);
+  pthread_mutex_lock(&lock);
+  if(force || difftime(now, last_dump) >= interval){
+    errno = 0;
+    FILE * f = fopen(filename.c_str(), "a");
+    if(f == NULL)
+      log_msg(LOG_ERR, "Could not open monitoring file %s: %s\n",
+              filename.c_str(), strerror(errno));
+    else{
+      Dump(f, now);
+      if(fclose(f) != 0)
+        log_msg(LOG_ERR, "Could not write monitoring file %s\n",
+                filename.c_str());
+    }
+    last_dump = now;
+  }
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,127 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <string>
+
+#include "USBstreamUtils.h"
+#include "OutputFile.h"
+
+OutputFile::OutputFile()
+{
+  fd = -1;
+  opentime = 0;
+  written = allocated = synced = writtenback = 0;
+}
+
+void OutputFile::Open(const std::string & name, const uint64_t keep)
+{
+  myname = name;
+
+  errno = 0;
+  fd = open(name.c_str(), O_WRONLY | O_CREAT | (keep? 0: O_TRUNC), 0644);
+  if(fd < 0)
+    log_msg(LOG_CRIT, "Fatal Error: failed to open file %s: %s\n",
+            name.c_str(), strerror(errno));
+
+  if(keep && (ftruncate(fd, keep) < 0 || lseek(fd, keep, SEEK_SET) < 0))
+    log_msg(LOG_CRIT, "Fatal Error: failed to resume file %s at byte %lu: %s\n",
+            name.c_str(), (unsigned long)keep, strerror(errno));
+
+  opentime = time(0);
+  written = allocated = synced = writtenback = keep;
+}
+
+// Extends the preallocated space to cover what is written.  Space is
+// reserved past the end of the file (FALLOC_FL_KEEP_SIZE), so the file's
+// size always reflects only what has been written, even after a crash.
+bool OutputFile::Preallocate()
+{
+  const uint64_t want = allocated + policy.prealloc_bytes;
+
+  if(fallocate(fd, FALLOC_FL_KEEP_SIZE, allocated, want - allocated) < 0){
+    if(errno == EOPNOTSUPP || errno == ENOSYS){
+      log_msg(LOG_NOTICE, "Filesystem of %s does not support preallocation. "
+              "Not preallocating.\n", myname.c_str());
+      policy.prealloc_bytes = 0;
+      return true;
+    }
+    log_msg(LOG_ERR, "Could not preallocate %s: %s\n", myname.c_str(),
+            strerror(errno));
+    return false;
+  }
+
+  allocated = want;
+  return true;
+}
+
+bool OutputFile::Write(const char * buf, size_t len)
+{
+  while(policy.prealloc_bytes && written + len > allocated)
+    if(!Preallocate()) return false;
+
+  while(len > 0){
+    const ssize_t n = write(fd, buf, len);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0) return false;
+    buf += n;
+    len -= n;
+    written += n;
+  }
+
+  // Start writing back each full chunk, and wait for the one before it,
+  // which bounds the amount of dirty data to about two chunks.
+  const uint64_t chunk = policy.writebehind_bytes;
+  while(chunk && written - writtenback >= chunk){
+    sync_file_range(fd, writtenback, chunk, SYNC_FILE_RANGE_WRITE);
+    if(writtenback >= chunk)
+      sync_file_range(fd, writtenback - chunk, chunk,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                      SYNC_FILE_RANGE_WAIT_AFTER);
+    writtenback += chunk;
+  }
+
+  if(policy.sync_bytes && written - synced >= policy.sync_bytes)
+    return Sync();
+
+  return true;
+}
+
+bool OutputFile::Sync()
+{
+  if(fdatasync(fd) < 0){
+    log_msg(LOG_ERR, "Could not sync %s: %s\n", myname.c_str(),
+            strerror(errno));
+    return false;
+  }
+  synced = written;
+  return true;
+}
+
+bool OutputFile::Close(const bool sync)
+{
+  bool ok = true;
+
+  // Give back preallocated space that wasn't used
+  if(allocated > written && ftruncate(fd, written) < 0){
+    log_msg(LOG_ERR, "Could not truncate %s: %s\n", myname.c_str(),
+            strerror(errno));
+    ok = false;
+  }
+
+  if((sync || policy.sync_bytes) && written != synced)
+    ok = Sync() && ok;
+
+  if(close(fd) < 0){
+    log_msg(LOG_ERR, "Could not close output data file %s\n", myname.c_str());
+    ok = false;
+  }
+  fd = -1;
+
+  return ok;
+}
@@ -0,0 +1,257 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "USBstream.h"
+#include "USBstreamUtils.h"
+#include "PacketCache.h"
+
+static const uint32_t cache_magic = 0x43504245; // "EBPC"
+
+// Bump this whenever decoding changes what it gives for the same input, or
+// the layout of cache files changes, so that old cache files aren't used.
+static const uint32_t packet_cache_version = 2;
+
+static const size_t header_bytes = 96;
+static const size_t packet_bytes = 16;
+static const size_t hit_bytes = 4;
+
+// FNV-1a
+static void hash_bytes(uint64_t & h, const void * data, const size_t len)
+{
+  const unsigned char * p = (const unsigned char *)data;
+  for(size_t i = 0; i < len; i++){
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+}
+
+uint64_t packet_cache_key(const std::string & name, const struct stat & st,
+                          const std::deque<uint16_t> & leftover,
+                          const uint16_t hi, const uint16_t lo,
+                          const bool pending, const bool stamped)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  const size_t slash = name.rfind('/');
+  const std::string base =
+    slash == std::string::npos? name: name.substr(slash + 1);
+  hash_bytes(h, base.data(), base.size());
+
+  const uint64_t fields[] = {
+    packet_cache_version, (uint64_t)st.st_size, (uint64_t)st.st_mtim.tv_sec,
+    (uint64_t)st.st_mtim.tv_nsec, hi, lo, pending, stamped, leftover.size()
+  };
+  hash_bytes(h, fields, sizeof fields);
+  for(unsigned int i = 0; i < leftover.size(); i++)
+    hash_bytes(h, &leftover[i], sizeof leftover[i]);
+
+  return h;
+}
+
+void PacketCacheWriter::Clear()
+{
+  packets.clear();
+  npackets = 0;
+}
+
+void PacketCacheWriter::Add(const decoded_packet & p, const bool parity_ok)
+{
+  char rec[packet_bytes] = {0};
+  const uint16_t module = p.module, nhits = p.hits.size();
+  memcpy(rec,     &p.timeunix, 4);
+  memcpy(rec + 4, &p.time16ns, 4);
+  memcpy(rec + 8, &module,     2);
+  memcpy(rec + 10, &nhits,     2);
+  rec[12] = p.isadc;
+  rec[13] = parity_ok;
+  packets.append(rec, packet_bytes);
+
+  for(unsigned int i = 0; i < p.hits.size(); i++){
+    char hit[hit_bytes] = {0};
+    memcpy(hit, &p.hits[i].charge, 2);
+    hit[2] = p.hits[i].channel;
+    packets.append(hit, hit_bytes);
+  }
+
+  npackets++;
+}
+
+bool PacketCacheWriter::Commit(const std::string & name, const uint64_t key,
+                               const packet_cache_summary & s,
+                               const std::deque<uint16_t> & leftover)
+{
+  char header[header_bytes] = {0};
+  const uint32_t words[] = { s.tolutc, s.unix_time_hi, s.unix_time_lo,
+                             (uint32_t)leftover.size(), npackets,
+                             s.pending_time_hi };
+  const uint64_t counts[] = {
+    s.counts.skipped_bytes, s.counts.skipped_words, s.counts.bad_headers,
+    s.daq.skipped, s.daq.received, s.daq.lost, s.daq.reports
+  };
+  memcpy(header,      &cache_magic,          4);
+  memcpy(header +  4, &packet_cache_version, 4);
+  memcpy(header +  8, &key,                  8);
+  memcpy(header + 16, counts, sizeof counts);
+  memcpy(header + 72, words,  sizeof words);
+
+  std::string words16;
+  for(unsigned int i = 0; i < leftover.size(); i++)
+    words16.append((const char *)&leftover[i], 2);
+  words16.resize((words16.size() + 3) & ~3, 0);
+
+  const std::string tmpname = name + ".tmp";
+  errno = 0;
+  FILE * f = fopen(tmpname.c_str(), "wb");
+  if(f == NULL){
+    log_msg(LOG_WARNING, "Could not write packet cache %s: %s\n",
+            tmpname.c_str(), strerror(errno));
+    return false;
+  }
+
+  const bool ok = 1 == fwrite(header, header_bytes, 1, f) &&
+    (words16.empty() || 1 == fwrite(words16.data(), words16.size(), 1, f)) &&
+    (packets.empty() || 1 == fwrite(packets.data(), packets.size(), 1, f));
+  if(fclose(f) != 0 || !ok || rename(tmpname.c_str(), name.c_str()) != 0){
+    log_msg(LOG_WARNING, "Could not write packet cache %s: %s\n",
+            name.c_str(), strerror(errno));
+    unlink(tmpname.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+PacketCacheReader::PacketCacheReader()
+{
+  map = NULL;
+  maplen = pos = 0;
+  nleft = nleftover = 0;
+}
+
+PacketCacheReader::~PacketCacheReader()
+{
+  Close();
+}
+
+void PacketCacheReader::Close()
+{
+  if(map != NULL) munmap((void *)map, maplen);
+  map = NULL;
+  maplen = pos = 0;
+  nleft = nleftover = 0;
+}
+
+bool PacketCacheReader::Open(const std::string & name, const uint64_t key)
+{
+  Close();
+
+  const int fd = open(name.c_str(), O_RDONLY);
+  if(fd < 0) return false;
+
+  struct stat st;
+  if(fstat(fd, &st) < 0 || (size_t)st.st_size < header_bytes){
+    close(fd);
+    return false;
+  }
+
+  maplen = st.st_size;
+  void * m = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(m == MAP_FAILED){
+    maplen = 0;
+    return false;
+  }
+  map = (const char *)m;
+  madvise(m, maplen, MADV_SEQUENTIAL);
+
+  uint32_t magic, version, words[6];
+  uint64_t filekey, counts[7];
+  memcpy(&magic,   map,      4);
+  memcpy(&version, map +  4, 4);
+  memcpy(&filekey, map +  8, 8);
+  memcpy(counts,   map + 16, sizeof counts);
+  memcpy(words,    map + 72, sizeof words);
+  if(magic != cache_magic || version != packet_cache_version ||
+     filekey != key){
+    Close();
+    return false;
+  }
+
+  summary.counts = corruption_counts();
+  summary.counts.skipped_bytes = counts[0];
+  summary.counts.skipped_words = counts[1];
+  summary.counts.bad_headers   = counts[2];
+  summary.daq.skipped  = counts[3];
+  summary.daq.received = counts[4];
+  summary.daq.lost     = counts[5];
+  summary.daq.reports  = counts[6];
+  summary.tolutc = words[0];
+  summary.unix_time_hi = words[1];
+  summary.unix_time_lo = words[2];
+  summary.pending_time_hi = words[5];
+  nleftover = words[3];
+  nleft = words[4];
+  pos = header_bytes + ((2*(size_t)nleftover + 3) & ~(size_t)3);
+
+  // Check that the packets are all there before any is used
+  size_t end = pos;
+  uint32_t i = 0;
+  for( ; i < nleft && end + packet_bytes <= maplen; i++){
+    uint16_t nhits;
+    memcpy(&nhits, map + end + 10, 2);
+    end += packet_bytes + nhits*hit_bytes;
+  }
+  if(i == nleft && end == maplen) return true;
+
+  log_msg(LOG_WARNING, "Packet cache %s is damaged.  Not using it.\n",
+          name.c_str());
+  Close();
+  return false;
+}
+
+void PacketCacheReader::GetLeftover(std::deque<uint16_t> & leftover) const
+{
+  leftover.clear();
+  for(uint32_t i = 0; i < nleftover; i++){
+    uint16_t w;
+    memcpy(&w, map + header_bytes + 2*i, 2);
+    leftover.push_back(w);
+  }
+}
+
+bool PacketCacheReader::Next(decoded_packet & p, bool & parity_ok)
+{
+  if(nleft == 0) return false;
+
+  const char * rec = map + pos;
+  uint16_t module, nhits;
+  memcpy(&p.timeunix, rec,     4);
+  memcpy(&p.time16ns, rec + 4, 4);
+  memcpy(&module,     rec + 8, 2);
+  memcpy(&nhits,      rec + 10, 2);
+  p.module = module;
+  p.isadc = rec[12];
+  parity_ok = rec[13];
+
+  p.hits.resize(nhits);
+  const char * hit = rec + packet_bytes;
+  for(unsigned int i = 0; i < nhits; i++, hit += hit_bytes){
+    memcpy(&p.hits[i].charge, hit, 2);
+    p.hits[i].channel = hit[2];
+  }
+
+  pos += packet_bytes + nhits*hit_bytes;
+  nleft--;
+  return true;
+}
@@ -0,0 +1,119 @@
+// Stand-in for a DAQ process streaming one USB stream's raw data to the
+// event builder over a Unix domain socket (EventBuilder -u).  Sends the
+// given files, in order, as one continuous stream.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Seconds to keep trying to connect while the builder starts up
+static const int connect_timeout = 30;
+
+static void usage(const char * const prog)
+{
+  printf(
+    "Usage: %s -s <socket> [-p <seconds_per_file>] <file>...\n"
+    "\n"
+    "  -s : Socket the event builder is listening on for this USB stream,\n"
+    "       i.e. <socket_dir>/usb_<serial number>\n"
+    "  -p : Take at least this many seconds over each file, as the DAQ\n"
+    "       would.  default: send as fast as possible\n", prog);
+  exit(127);
+}
+
+static int connect_to(const char * const path)
+{
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof addr.sun_path){
+    fprintf(stderr, "Socket path %s is too long\n", path);
+    exit(1);
+  }
+  strcpy(addr.sun_path, path);
+
+  for(int tries = 0; ; tries++){
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0){
+      perror("socket");
+      exit(1);
+    }
+    if(connect(fd, (sockaddr *)&addr, sizeof addr) == 0) return fd;
+    close(fd);
+
+    if(tries >= connect_timeout){
+      fprintf(stderr, "Could not connect to %s: %s\n", path, strerror(errno));
+      exit(1);
+    }
+    sleep(1);
+  }
+}
+
+static void send_file(const int sock, const char * const name)
+{
+  const int fd = open(name, O_RDONLY);
+  if(fd < 0){
+    fprintf(stderr, "Could not open %s: %s\n", name, strerror(errno));
+    exit(1);
+  }
+
+  char buf[0x10000];
+  ssize_t n;
+  while((n = read(fd, buf, sizeof buf)) > 0){
+    for(ssize_t done = 0; done < n; ){
+      const ssize_t w = write(sock, buf + done, n - done);
+      if(w < 0 && errno == EINTR) continue;
+      if(w <= 0){
+        fprintf(stderr, "Could not send %s: %s\n", name, strerror(errno));
+        exit(1);
+      }
+      done += w;
+    }
+  }
+  if(n < 0){
+    fprintf(stderr, "Could not read %s: %s\n", name, strerror(errno));
+    exit(1);
+  }
+  close(fd);
+}
+
+int main(int argc, char **argv)
+{
+  const char * path = NULL;
+  double seconds_per_file = 0;
+
+  char c;
+  while((c = getopt(argc, argv, "s:p:h")) != -1){
+    switch(c){
+      case 's': path = optarg; break;
+      case 'p': seconds_per_file = atof(optarg); break;
+      case 'h':
+      default:  usage(argv[0]);
+    }
+  }
+  if(path == NULL || optind >= argc) usage(argv[0]);
+
+  const int sock = connect_to(path);
+
+  for(int i = optind; i < argc; i++){
+    timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    send_file(sock, argv[i]);
+    printf("Sent %s\n", argv[i]);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const double left = seconds_per_file - (now.tv_sec - start.tv_sec)
+                        - (now.tv_nsec - start.tv_nsec)*1e-9;
+    if(left > 0) usleep((useconds_t)(left*1e6));
+  }
+
+  close(sock);
+  return 0;
+}
@@ -0,0 +1,85 @@
+#include <stdint.h>
+#include <syslog.h>
+
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "Scheduler.h"
+
+AdaptiveScheduler::AdaptiveScheduler()
+{
+  on = false;
+  maxfilesets = filesets = 1;
+  minranges = maxranges = ranges = 1;
+  decode_us = decode_files = build_us = build_filesets = 0;
+  decode_cost = build_cost = 0;
+}
+
+void AdaptiveScheduler::Init(const unsigned int maxfilesets_,
+                             const unsigned int minranges_,
+                             const unsigned int maxranges_)
+{
+  on = true;
+  maxfilesets = maxfilesets_;
+  minranges = minranges_;
+  maxranges = maxranges_ > minranges_? maxranges_: minranges_;
+  filesets = 1;
+  ranges = minranges;
+}
+
+unsigned int AdaptiveScheduler::Plan(const unsigned int backlog)
+{
+  // Take what has been reported since last time.  The counts are swapped
+  // out before the times, so a report that comes in between only makes a
+  // cost look a little higher this time.
+  const uint64_t dn = __atomic_exchange_n(&decode_files, 0, __ATOMIC_ACQ_REL);
+  const uint64_t dt = __atomic_exchange_n(&decode_us, 0, __ATOMIC_ACQ_REL);
+  const uint64_t bn = __atomic_exchange_n(&build_filesets, 0, __ATOMIC_ACQ_REL);
+  const uint64_t bt = __atomic_exchange_n(&build_us, 0, __ATOMIC_ACQ_REL);
+  if(dn) decode_cost = (double)dt/dn;
+  if(bn) build_cost = (double)bt/bn;
+
+  const unsigned int oldfilesets = filesets, oldranges = ranges;
+  unsigned int r = ranges; // only written here, but read by the merger
+
+  // Behind if more is waiting than one subrun would take.  Caught up if at
+  // most one file set is waiting, which is the usual state when keeping up
+  // with the DAQ, since a file set is ready as soon as its last file is.
+  if(backlog > filesets){
+    filesets = filesets*2 < maxfilesets? filesets*2: maxfilesets;
+
+    // More threads only help if building, not decoding, is the bottleneck
+    if(build_cost > 0 && build_cost >= decode_cost && r < maxranges) r++;
+  }
+  else if(backlog <= 1){
+    filesets = filesets/2 > 1? filesets/2: 1;
+    if(r > minranges) r--;
+  }
+
+  __atomic_store_n(&ranges, r, __ATOMIC_RELAXED);
+
+  if(filesets != oldfilesets || r != oldranges)
+    log_msg(LOG_NOTICE, "%u file sets waiting: now %u file sets per subrun "
+            "and %u build ranges (%.0f us decoding, %.0f us building per file "
+            "set)\n", backlog, filesets, r, decode_cost, build_cost);
+
+  return filesets;
+}
+
+unsigned int AdaptiveScheduler::GetBuildRanges() const
+{
+  return __atomic_load_n(&ranges, __ATOMIC_RELAXED);
+}
+
+void AdaptiveScheduler::ObserveDecode(const uint64_t us)
+{
+  __atomic_fetch_add(&decode_us, us, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&decode_files, 1, __ATOMIC_RELEASE);
+}
+
+void AdaptiveScheduler::ObserveBuild(const unsigned int nfilesets,
+                                     const uint64_t us)
+{
+  __atomic_fetch_add(&build_us, us, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&build_filesets, nfilesets, __ATOMIC_RELEASE);
+}
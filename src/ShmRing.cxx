@@ -0,0 +1,216 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <string>
+
+#include "USBstreamUtils.h"
+#include "ShmRing.h"
+
+static const uint32_t ring_magic = 0x45425247; // "EBRG"
+static const uint32_t ring_version = 1;
+
+// Copies between a flat buffer and the ring, wrapping around its end
+static void copy_to_ring(char * ring, const uint64_t capacity,
+                         const uint64_t pos, const void * src, size_t len)
+{
+  const uint64_t off = pos & (capacity-1);
+  const size_t first = std::min<uint64_t>(len, capacity - off);
+  memcpy(ring + off, src, first);
+  memcpy(ring, (const char *)src + first, len - first);
+}
+
+static void copy_from_ring(const char * ring, const uint64_t capacity,
+                           const uint64_t pos, void * dst, size_t len)
+{
+  const uint64_t off = pos & (capacity-1);
+  const size_t first = std::min<uint64_t>(len, capacity - off);
+  memcpy(dst, ring + off, first);
+  memcpy((char *)dst + first, ring, len - first);
+}
+
+static uint64_t record_size(const uint32_t len)
+{
+  return (sizeof(shm_ring_record) + len + 7) & ~(uint64_t)7;
+}
+
+ShmRingWriter::ShmRingWriter()
+{
+  header = NULL;
+  ring = NULL;
+  mapsize = 0;
+}
+
+void ShmRingWriter::Open(const std::string & name, const uint64_t capacity)
+{
+  uint64_t size = 4096;
+  while(size < capacity) size <<= 1;
+  mapsize = sizeof(shm_ring_header) + size;
+
+  errno = 0;
+  const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0644);
+  if(fd < 0)
+    log_msg(LOG_CRIT, "Fatal Error: could not open shared memory %s: %s\n",
+            name.c_str(), strerror(errno));
+
+  if(ftruncate(fd, mapsize) < 0)
+    log_msg(LOG_CRIT, "Fatal Error: could not size shared memory %s: %s\n",
+            name.c_str(), strerror(errno));
+
+  void * p = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED)
+    log_msg(LOG_CRIT, "Fatal Error: could not map shared memory %s: %s\n",
+            name.c_str(), strerror(errno));
+
+  header = (shm_ring_header *)p;
+  ring = (char *)p + sizeof(shm_ring_header);
+
+  // Readers of a previous writer see the generation change and start over
+  const uint64_t generation =
+    header->magic == ring_magic? header->generation + 1: 1;
+  header->magic = ring_magic;
+  header->version = ring_version;
+  header->capacity = size;
+  __atomic_store_n(&header->reserve, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&header->head, 0, __ATOMIC_RELAXED);
+  header->nevents = 0;
+  __atomic_store_n(&header->generation, generation, __ATOMIC_RELEASE);
+
+  log_msg(LOG_NOTICE, "Publishing events to shared memory %s, %lu bytes\n",
+          name.c_str(), (unsigned long)size);
+}
+
+void ShmRingWriter::Publish(const char * data, const uint32_t len,
+                            const uint32_t nevents)
+{
+  if(len == 0) return;
+
+  const uint64_t capacity = header->capacity;
+  const uint64_t size = record_size(len);
+  if(size > capacity){
+    log_msg(LOG_WARNING, "Batch of %u bytes is too big for the shared "
+            "memory ring. Not publishing it.\n", len);
+    header->nevents += nevents;
+    return;
+  }
+
+  // Claim the space before overwriting what readers might be reading
+  const uint64_t pos = header->head;
+  __atomic_store_n(&header->reserve, pos + size, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  shm_ring_record rec;
+  rec.length = len;
+  rec.nevents = nevents;
+  rec.first_event = header->nevents;
+  copy_to_ring(ring, capacity, pos, &rec, sizeof rec);
+  copy_to_ring(ring, capacity, pos + sizeof rec, data, len);
+
+  header->nevents += nevents;
+  __atomic_store_n(&header->head, pos + size, __ATOMIC_RELEASE);
+}
+
+void ShmRingWriter::Close()
+{
+  if(header == NULL) return;
+  munmap(header, mapsize);
+  header = NULL;
+  ring = NULL;
+}
+
+ShmRingReader::ShmRingReader()
+{
+  header = NULL;
+  ring = NULL;
+  mapsize = 0;
+  generation = 0;
+  readpos = 0;
+}
+
+bool ShmRingReader::Open(const std::string & name)
+{
+  const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if(fd < 0) return false;
+
+  struct stat info;
+  if(fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(shm_ring_header)){
+    close(fd);
+    return false;
+  }
+  mapsize = info.st_size;
+
+  void * p = mmap(NULL, mapsize, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED) return false;
+
+  header = (const shm_ring_header *)p;
+  ring = (const char *)p + sizeof(shm_ring_header);
+
+  if(header->magic != ring_magic || header->version != ring_version ||
+     sizeof(shm_ring_header) + header->capacity != mapsize){
+    Close();
+    return false;
+  }
+
+  generation = __atomic_load_n(&header->generation, __ATOMIC_ACQUIRE);
+  readpos = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+  return true;
+}
+
+ShmRingReader::read_status
+  ShmRingReader::Read(std::string & events, uint64_t & first_event,
+                      uint32_t & nevents)
+{
+  const uint64_t capacity = header->capacity;
+  const uint64_t gen = __atomic_load_n(&header->generation, __ATOMIC_ACQUIRE);
+  const uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+
+  if(gen != generation || head < readpos){
+    generation = gen;
+    readpos = head;
+    return kOverrun;
+  }
+  if(head == readpos) return kNothing;
+  if(head - readpos > capacity){
+    readpos = head;
+    return kOverrun;
+  }
+
+  shm_ring_record rec;
+  copy_from_ring(ring, capacity, readpos, &rec, sizeof rec);
+  if(record_size(rec.length) > head - readpos){
+    // Can only be garbage from being overwritten
+    readpos = head;
+    return kOverrun;
+  }
+  events.resize(rec.length);
+  copy_from_ring(ring, capacity, readpos + sizeof rec, &events[0], rec.length);
+
+  // If the writer claimed space over what we were copying, it's garbage
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  const uint64_t reserve = __atomic_load_n(&header->reserve, __ATOMIC_RELAXED);
+  if(reserve - readpos > capacity){
+    readpos = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    return kOverrun;
+  }
+
+  first_event = rec.first_event;
+  nevents = rec.nevents;
+  readpos += record_size(rec.length);
+  return kGot;
+}
+
+void ShmRingReader::Close()
+{
+  if(header == NULL) return;
+  munmap((void *)header, mapsize);
+  header = NULL;
+  ring = NULL;
+}
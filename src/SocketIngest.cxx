@@ -0,0 +1,107 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <string>
+
+#include "USBstreamUtils.h"
+#include "SocketIngest.h"
+
+// Ask for a receive buffer this big, so that the DAQ isn't held up between
+// calls to Receive()
+static const int receive_buffer_bytes = 8 << 20;
+
+// Most to take in one Receive(), so a fast sender can't keep it going forever
+static const uint64_t max_receive_bytes = 256 << 20;
+
+SocketIngest::SocketIngest()
+{
+  listenfd = connfd = -1;
+}
+
+void SocketIngest::Listen(const std::string & path_)
+{
+  path = path_;
+
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if(path.size() >= sizeof addr.sun_path)
+    log_msg(LOG_CRIT, "Fatal Error: socket path %s is too long\n",
+            path.c_str());
+  strcpy(addr.sun_path, path.c_str());
+
+  errno = 0;
+  listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(listenfd < 0)
+    log_msg(LOG_CRIT, "Fatal Error: could not make socket: %s\n",
+            strerror(errno));
+
+  unlink(path.c_str());
+  if(bind(listenfd, (sockaddr *)&addr, sizeof addr) < 0 ||
+     listen(listenfd, 1) < 0)
+    log_msg(LOG_CRIT, "Fatal Error: could not listen on %s: %s\n",
+            path.c_str(), strerror(errno));
+
+  log_msg(LOG_INFO, "Listening for raw data on %s\n", path.c_str());
+}
+
+bool SocketIngest::Accept()
+{
+  connfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if(connfd < 0){
+    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      log_msg(LOG_ERR, "Could not accept a connection on %s: %s\n",
+              path.c_str(), strerror(errno));
+    return false;
+  }
+
+  setsockopt(connfd, SOL_SOCKET, SO_RCVBUF, &receive_buffer_bytes,
+             sizeof receive_buffer_bytes);
+  log_msg(LOG_NOTICE, "DAQ connected to %s\n", path.c_str());
+  return true;
+}
+
+uint64_t SocketIngest::Receive(std::string & buf)
+{
+  if(connfd < 0 && !Accept()) return 0;
+
+  uint64_t got = 0;
+  char chunk[0x10000];
+  while(got < max_receive_bytes){
+    const ssize_t n = read(connfd, chunk, sizeof chunk);
+    if(n > 0){
+      buf.append(chunk, n);
+      got += n;
+      continue;
+    }
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+    // Closed by the DAQ, or broken.  Wait for it to connect again.
+    if(n < 0)
+      log_msg(LOG_ERR, "Error receiving on %s: %s\n", path.c_str(),
+              strerror(errno));
+    else
+      log_msg(LOG_NOTICE, "DAQ disconnected from %s\n", path.c_str());
+    close(connfd);
+    connfd = -1;
+    break;
+  }
+  return got;
+}
+
+void SocketIngest::Close()
+{
+  if(connfd >= 0) close(connfd);
+  if(listenfd >= 0){
+    close(listenfd);
+    unlink(path.c_str());
+  }
+  connfd = listenfd = -1;
+}
@@ -0,0 +1,150 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "Spill.h"
+
+// Bytes of a packet on disk, before its hits, and of each hit
+static const unsigned int packet_record = 20;
+static const unsigned int hit_record = 3;
+
+// stdio buffer size, so that reading and writing are done in large blocks
+static const size_t spill_buffer = 1 << 20;
+
+uint64_t packet_memory(const std::vector<decoded_packet> & packets)
+{
+  uint64_t bytes = packets.size()*sizeof(decoded_packet);
+  for(unsigned int i = 0; i < packets.size(); i++)
+    bytes += packets[i].hits.capacity()*sizeof(decoded_hit);
+  return bytes;
+}
+
+SpillFile::SpillFile()
+{
+  f = NULL;
+  count = filebytes = 0;
+  reading = false;
+}
+
+SpillFile::~SpillFile()
+{
+  if(f != NULL) fclose(f);
+}
+
+void SpillFile::Open(const std::string & name)
+{
+  myname = name;
+
+  errno = 0;
+  f = fopen(name.c_str(), "w+b");
+  if(f == NULL)
+    log_msg(LOG_CRIT, "Fatal Error: could not create spill file %s: %s\n",
+            name.c_str(), strerror(errno));
+
+  if(unlink(name.c_str()) < 0)
+    log_msg(LOG_WARNING, "Could not unlink spill file %s: %s\n",
+            name.c_str(), strerror(errno));
+
+  setvbuf(f, NULL, _IOFBF, spill_buffer);
+}
+
+void SpillFile::Write(const std::vector<decoded_packet> & packets)
+{
+  if(reading)
+    log_msg(LOG_CRIT, "Fatal Error: spilling to %s while reading it back\n",
+            myname.c_str());
+
+  char rec[packet_record];
+  for(unsigned int i = 0; i < packets.size(); i++){
+    const decoded_packet & p = packets[i];
+    if(p.hits.size() > 0xff)
+      log_msg(LOG_CRIT, "Fatal Error: packet with %u hits can't be spilled\n",
+              (unsigned int)p.hits.size());
+
+    const uint16_t module = p.module;
+    rec[2] = p.isadc;
+    rec[3] = p.hits.size();
+    memcpy(rec,      &module,     2);
+    memcpy(rec +  4, &p.timeunix, 4);
+    memcpy(rec +  8, &p.time16ns, 4);
+    memcpy(rec + 12, &p.timekey,  8);
+    bool ok = 1 == fwrite(rec, packet_record, 1, f);
+
+    for(unsigned int h = 0; ok && h < p.hits.size(); h++){
+      char hit[hit_record];
+      hit[0] = p.hits[h].channel;
+      memcpy(hit + 1, &p.hits[h].charge, 2);
+      ok = 1 == fwrite(hit, hit_record, 1, f);
+    }
+
+    if(!ok)
+      log_msg(LOG_CRIT, "Fatal Error: could not write spill file %s: %s\n",
+              myname.c_str(), strerror(errno));
+
+    filebytes += packet_record + hit_record*p.hits.size();
+  }
+
+  count += packets.size();
+}
+
+uint64_t SpillFile::Read(std::vector<decoded_packet> & packets,
+                         const uint64_t bytes)
+{
+  if(count == 0) return 0;
+
+  if(!reading){
+    if(fflush(f) != 0 || fseek(f, 0, SEEK_SET) != 0)
+      log_msg(LOG_CRIT, "Fatal Error: could not rewind spill file %s: %s\n",
+              myname.c_str(), strerror(errno));
+    reading = true;
+  }
+
+  uint64_t added = 0;
+  char rec[packet_record];
+  while(count > 0 && added < bytes){
+    if(1 != fread(rec, packet_record, 1, f))
+      log_msg(LOG_CRIT, "Fatal Error: could not read spill file %s\n",
+              myname.c_str());
+
+    packets.push_back(decoded_packet());
+    decoded_packet & p = packets.back();
+    uint16_t module;
+    memcpy(&module,     rec,      2);
+    memcpy(&p.timeunix, rec +  4, 4);
+    memcpy(&p.time16ns, rec +  8, 4);
+    memcpy(&p.timekey,  rec + 12, 8);
+    p.module = module;
+    p.isadc = rec[2];
+
+    p.hits.resize((uint8_t)rec[3]);
+    for(unsigned int h = 0; h < p.hits.size(); h++){
+      char hit[hit_record];
+      if(1 != fread(hit, hit_record, 1, f))
+        log_msg(LOG_CRIT, "Fatal Error: could not read spill file %s\n",
+                myname.c_str());
+      p.hits[h].channel = hit[0];
+      memcpy(&p.hits[h].charge, hit + 1, 2);
+    }
+
+    added += sizeof(decoded_packet) + p.hits.capacity()*sizeof(decoded_hit);
+    count--;
+  }
+
+  // All read back, so start again from empty
+  if(count == 0){
+    if(fseek(f, 0, SEEK_SET) != 0 || ftruncate(fileno(f), 0) != 0)
+      log_msg(LOG_CRIT, "Fatal Error: could not empty spill file %s: %s\n",
+              myname.c_str(), strerror(errno));
+    filebytes = 0;
+    reading = false;
+  }
+
+  return added;
+}
@@ -0,0 +1,168 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "Trace.h"
+
+// Spans kept per thread.  Older ones are overwritten.
+static const unsigned int max_spans = 1 << 18;
+
+struct trace_record {
+  const char * name;
+  uint64_t begin, end;
+  int subrun, fileset, usb;
+};
+
+struct trace_buffer {
+  std::string thread;
+  std::vector<trace_record> spans; // a ring once full
+  uint64_t nspans; // ever recorded
+};
+
+static bool TraceOn = false;
+
+// Clock readings at the start and end of tracing, to convert between clock
+// ticks and nanoseconds
+static uint64_t StartTicks = 0;
+static uint64_t StartNs = 0;
+
+static pthread_mutex_t BuffersLock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<trace_buffer *> Buffers;
+static __thread trace_buffer * MyBuffer = NULL;
+
+static uint64_t monotonic_ns()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+uint64_t trace_clock_fallback()
+{
+  return monotonic_ns();
+}
+
+void trace_start()
+{
+  TraceOn = true;
+  StartNs = monotonic_ns();
+  StartTicks = trace_clock();
+}
+
+bool trace_on()
+{
+  return TraceOn;
+}
+
+static trace_buffer * my_buffer()
+{
+  if(MyBuffer == NULL){
+    MyBuffer = new trace_buffer;
+    MyBuffer->nspans = 0;
+    pthread_mutex_lock(&BuffersLock);
+    Buffers.push_back(MyBuffer);
+    pthread_mutex_unlock(&BuffersLock);
+  }
+  return MyBuffer;
+}
+
+void trace_thread(const char * name, const int index)
+{
+  if(!TraceOn) return;
+
+  char buf[64];
+  if(index >= 0) snprintf(buf, sizeof buf, "%s %d", name, index);
+  else           snprintf(buf, sizeof buf, "%s", name);
+  my_buffer()->thread = buf;
+}
+
+void trace_span(const char * name, const uint64_t begin, const int subrun,
+                const int fileset, const int usb)
+{
+  if(!TraceOn) return;
+
+  trace_record r;
+  r.name = name;
+  r.begin = begin;
+  r.end = trace_clock();
+  r.subrun = subrun;
+  r.fileset = fileset;
+  r.usb = usb;
+
+  trace_buffer * b = my_buffer();
+  if(b->spans.size() < max_spans) b->spans.push_back(r);
+  else b->spans[b->nspans % max_spans] = r;
+  b->nspans++;
+}
+
+bool trace_write(const std::string & filename)
+{
+  if(!TraceOn) return true;
+
+  // Clock ticks per microsecond, as measured over the whole run
+  const uint64_t ticks = trace_clock() - StartTicks;
+  const uint64_t ns = monotonic_ns() - StartNs;
+  const double ticks_per_us = ns? ticks*1000.0/ns: 1;
+
+  errno = 0;
+  FILE * f = fopen(filename.c_str(), "w");
+  if(f == NULL){
+    log_msg(LOG_ERR, "Could not open trace file %s: %s\n", filename.c_str(),
+            strerror(errno));
+    return false;
+  }
+
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  bool first = true;
+  uint64_t dropped = 0;
+  for(unsigned int t = 0; t < Buffers.size(); t++){
+    const trace_buffer & b = *Buffers[t];
+    if(b.thread != ""){
+      fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+              "\"tid\":%u,\"args\":{\"name\":\"%s\"}}", first? "": ",\n",
+              t, b.thread.c_str());
+      first = false;
+    }
+
+    for(unsigned int i = 0; i < b.spans.size(); i++){
+      const trace_record & r = b.spans[i];
+      fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+              "\"ts\":%.3f,\"dur\":%.3f,\"args\":{", first? "": ",\n",
+              r.name, t, (int64_t)(r.begin - StartTicks)/ticks_per_us,
+              (r.end - r.begin)/ticks_per_us);
+      const char * sep = "";
+      if(r.subrun >= 0){
+        fprintf(f, "\"subrun\":%d", r.subrun);
+        sep = ",";
+      }
+      if(r.fileset >= 0){
+        fprintf(f, "%s\"fileset\":%d", sep, r.fileset);
+        sep = ",";
+      }
+      if(r.usb >= 0) fprintf(f, "%s\"usb\":%d", sep, r.usb);
+      fprintf(f, "}}");
+      first = false;
+    }
+    dropped += b.nspans - b.spans.size();
+  }
+  fprintf(f, "\n]}\n");
+
+  if(fclose(f) != 0){
+    log_msg(LOG_ERR, "Could not write trace file %s\n", filename.c_str());
+    return false;
+  }
+
+  if(dropped)
+    log_msg(LOG_NOTICE, "Trace %s has only the last %u spans of each thread; "
+            "%lu older ones were dropped\n", filename.c_str(), max_spans,
+            (unsigned long)dropped);
+  return true;
+}
@@ -0,0 +1,192 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "Trigger.h"
+
+// Module numbers are 7 bits in the data
+static const int modules_per_usb = 128;
+
+// Output module numbers are 16 bits
+static const int max_out_module = 0xffff;
+
+EventTrigger::EventTrigger()
+{
+  min_modules = 0;
+  window = 0;
+  prescale = 0;
+  mask_words = 0;
+}
+
+void EventTrigger::SetBit(module_mask & mask, const int outmodule) const
+{
+  mask[outmodule/64] |= (uint64_t)1 << (outmodule%64);
+}
+
+void EventTrigger::ReadConfig(const std::string & filename)
+{
+  FILE * f = fopen(filename.c_str(), "r");
+  if(f == NULL)
+    log_msg(LOG_CRIT, "Could not read trigger config file %s\n",
+            filename.c_str());
+
+  // Groups are kept as lists of modules until the mask size is known
+  std::map<std::string, std::vector<int> > grouplists;
+  std::vector< std::vector<std::string> > required;
+
+  char * line = NULL;
+  size_t len = 0;
+  while(getline(&line, &len, f) != -1){
+    std::string text(line);
+    if(text.find('#') != std::string::npos) text.erase(text.find('#'));
+
+    std::istringstream in(text);
+    std::string keyword;
+    if(!(in >> keyword)) continue;
+
+    bool ok = true;
+    if(keyword == "modules")
+      ok = !(in >> min_modules).fail();
+    else if(keyword == "window")
+      ok = !(in >> window).fail();
+    else if(keyword == "prescale")
+      ok = !(in >> prescale).fail();
+    else if(keyword == "group"){
+      std::string name;
+      int m;
+      ok = !(in >> name).fail();
+      std::vector<int> & list = grouplists[name];
+      while(ok && in >> m){
+        if(m < 0 || m > max_out_module) ok = false;
+        list.push_back(m);
+      }
+      ok = ok && in.eof() && !list.empty();
+    }
+    else if(keyword == "require"){
+      std::string name;
+      required.push_back(std::vector<std::string>());
+      while(in >> name) required.back().push_back(name);
+      ok = !required.back().empty();
+    }
+    else
+      ok = false;
+
+    if(!ok)
+      log_msg(LOG_CRIT, "Invalid line in trigger config file: %s\n", line);
+  }
+  fclose(f);
+  if(line) free(line);
+
+  int maxmodule = 0;
+  for(std::map<std::string, std::vector<int> >::const_iterator g =
+      grouplists.begin(); g != grouplists.end(); g++)
+    for(unsigned int i = 0; i < g->second.size(); i++)
+      maxmodule = std::max(maxmodule, g->second[i]);
+  for(unsigned int i = 0; i < outmodules.size(); i++)
+    maxmodule = std::max(maxmodule, outmodules[i]);
+  mask_words = maxmodule/64 + 1;
+
+  for(std::map<std::string, std::vector<int> >::const_iterator g =
+      grouplists.begin(); g != grouplists.end(); g++){
+    module_mask & mask = groups[g->first];
+    mask.assign(mask_words, 0);
+    for(unsigned int i = 0; i < g->second.size(); i++)
+      SetBit(mask, g->second[i]);
+  }
+
+  for(unsigned int r = 0; r < required.size(); r++){
+    requirements.push_back(std::vector<module_mask>());
+    for(unsigned int i = 0; i < required[r].size(); i++){
+      if(!groups.count(required[r][i]))
+        log_msg(LOG_CRIT, "Trigger config requires undefined group %s\n",
+                required[r][i].c_str());
+      requirements.back().push_back(groups[required[r][i]]);
+    }
+  }
+
+  log_msg(LOG_NOTICE, "Trigger: %u modules within %lu clock cycles, %u "
+          "group requirements, prescale %u\n", min_modules,
+          (unsigned long)window, (unsigned int)requirements.size(), prescale);
+}
+
+void EventTrigger::AddModule(const int usbindex, const int module,
+                             const int outmodule)
+{
+  const unsigned int i = usbindex*modules_per_usb + module;
+  if(outmodules.size() <= i) outmodules.resize(i+1, -1);
+  outmodules[i] = outmodule;
+
+  // Make room if this module is above any in the trigger config
+  if(outmodule/64 + 1 > (int)mask_words){
+    mask_words = outmodule/64 + 1;
+    for(std::map<std::string, module_mask>::iterator g = groups.begin();
+        g != groups.end(); g++)
+      g->second.resize(mask_words, 0);
+    for(unsigned int r = 0; r < requirements.size(); r++)
+      for(unsigned int k = 0; k < requirements[r].size(); k++)
+        requirements[r][k].resize(mask_words, 0);
+  }
+}
+
+int EventTrigger::OutModule(const int usbindex, const int module) const
+{
+  const unsigned int i = usbindex*modules_per_usb + module;
+  return i < outmodules.size()? outmodules[i]: -1;
+}
+
+bool EventTrigger::Satisfied(const module_mask & hit) const
+{
+  unsigned int nhit = 0;
+  for(unsigned int w = 0; w < mask_words; w++)
+    nhit += __builtin_popcountll(hit[w]);
+  if(nhit < min_modules) return false;
+
+  if(requirements.empty()) return true;
+
+  for(unsigned int r = 0; r < requirements.size(); r++){
+    bool all = true;
+    for(unsigned int k = 0; all && k < requirements[r].size(); k++){
+      bool any = false;
+      for(unsigned int w = 0; !any && w < mask_words; w++)
+        any = hit[w] & requirements[r][k][w];
+      all = any;
+    }
+    if(all) return true;
+  }
+  return false;
+}
+
+bool EventTrigger::Pass(const decoded_packet * const packets,
+                        const int * const usbindex,
+                        const unsigned int npackets) const
+{
+  module_mask hit(mask_words);
+
+  // Try each packet as the start of the window.  Events are short, so this
+  // is cheap.
+  for(unsigned int first = 0; first < npackets; first++){
+    hit.assign(mask_words, 0);
+
+    for(unsigned int i = first; i < npackets; i++){
+      if(window && packets[i].timekey - packets[first].timekey > window) break;
+
+      const int out = OutModule(usbindex[i], packets[i].module);
+      if(out < 0) continue;
+      SetBit(hit, out);
+      if(Satisfied(hit)) return true;
+    }
+
+    // Without a window, the first pass saw everything
+    if(!window) break;
+  }
+
+  return false;
+}
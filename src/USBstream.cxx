@@ -1,10 +1,12 @@
 #include <syslog.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h> // For htons, htonl
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <algorithm>
 #include <fstream>
 #include <sstream>
 #include <vector>
@@ -12,28 +14,103 @@
 
 #include "USBstream.h"
 #include "USBstreamUtils.h"
+#include "Checkpoint.h"
+#include "Monitor.h"
+#include "HitPool.h"
+#include "PacketCache.h"
+#include "Compress.h"
+
+// The two strips, of the other layer, that strip i of the first layer
+// overlaps
+static int adj1(const int i)
+{
+  return i+32;
+}
+
+static int adj2(const int i)
+{
+  if(i==0) return adj1(i);
+  else if(i % 8 == 0) return adj1(i)-1;
+  else if(i % 8 < 4) return adj1(i)+3;
+  else return adj1(i)-4;
+}
+
+ThresholdCut::ThresholdCut()
+{
+  thresh = 0;
+  use = false;
+  bothlayer = false;
+}
+
+void ThresholdCut::Set(const int thresh_, const int threshtype)
+{
+  use = (bool)threshtype;
+  bothlayer = (bool)(threshtype-1);
+  if(thresh_)
+    thresh = thresh_;
+  else
+    thresh = -20; // Put SW threshold well below HW threshold (including spread)
+}
+
+bool ThresholdCut::Passes(const decoded_packet & packet) const
+{
+  if(!use || !packet.isadc) return true;
+
+  bool allhits  [64] = {0}; // which channels were hit
+  bool threshits[64] = {0}; // which channels were hit over threshold
+  for(unsigned int i = 0; i < packet.hits.size(); i++){
+    allhits[packet.hits[i].channel] = true;
+    if(packet.hits[i].charge > thresh) threshits[packet.hits[i].channel] = true;
+  }
+
+  for(int i = 0; i < 32; i++) {
+    // If this strip and an overlapping strip are over threshold
+    if(bothlayer &&
+       threshits[i] && (threshits[adj1(i)] || threshits[adj2(i)]))
+      return true;
+
+    // If this strip is hit and an overlapping strip is over threshold
+    // or an overlapping strip is over threshold and this channel is hit
+    if(!bothlayer &&
+       ((allhits  [i] && (threshits[adj1(i)] || threshits[adj2(i)])) ||
+        (threshits[i] && (allhits  [adj1(i)] || allhits  [adj2(i)]))))
+      return true;
+  }
+  return false;
+}
 
 USBstream::USBstream()
 {
-  mythresh=0;
   myusb=-1;
+  nummodules = 0;
+  mytolutc = 0;
+  myFile = NULL;
   got_unix_time_hi = false;
   unix_time_hi = 0;
   unix_time_lo = 0;
-  BothLayerThresh = false;
-  UseThresh = false;
-  for(int i = 0; i < 32; i++) { // Map of adjacent channels
-    adj1[i] = i+32;
-    if(i==0) adj2[i] = adj1[i];
-    else if(i % 8 == 0) adj2[i] = adj1[i]-1;
-    else if(i % 8 < 4) adj2[i] = adj1[i]+3;
-    else adj2[i] = adj1[i]-4;
-  }
+  corruption_messages = 0;
+  rawword = 0;
+  expcounter = 0;
+  resyncing = false;
+  c6words = 0;
+  monitor = NULL;
+  hitpool = NULL;
+  workers = NULL;
+  workerclient = 0;
+  timekeyref = NULL;
+  cachewriter = NULL;
+}
+
+void USBstream::SetNumModules(const int n)
+{
+  nummodules = n;
+  offset.assign(n, 0);
+  baseline.assign(n*64, 0);
 }
 
 void USBstream::SetOffset(const int module, const int off)
 {
-  if(module < 0 || module >= 64){
+  if(module < 0 || module >= nummodules){
      log_msg(LOG_WARNING, "Ignoring attempt to set offset on module %d\n", module);
      return;
   }
@@ -43,21 +120,17 @@ void USBstream::SetOffset(const int module, const int off)
 
 void USBstream::SetThresh(int thresh, int threshtype)
 {
-  //threshtype: 0=NONE, 1=OR, 2=AND
-  UseThresh = (bool)threshtype;
-  BothLayerThresh=(bool)(threshtype-1);
-  if(thresh)
-    mythresh=thresh;
-  else
-    mythresh = -20; // Put SW threshold well below HW threshold (including spread)
+  cut.Set(thresh, threshtype);
 }
 
-void USBstream::SetBaseline(
-  const int baseptr[64 /* maxModules */][64 /* numChannels*/])
+void USBstream::SetBaseline(const std::vector<int> & base)
 {
-  for(int i = 0; i < 64; i++)
-    for(int j = 0; j < 64; j++)
-      baseline[i][j] = std::max(0, baseptr[i][j]);
+  if(base.size() != baseline.size())
+    log_msg(LOG_CRIT, "Fatal Error: got %lu baselines for USB %d, expected "
+            "%lu\n", (long int)base.size(), myusb, (long int)baseline.size());
+
+  for(unsigned int i = 0; i < base.size(); i++)
+    baseline[i] = std::max(0, base[i]);
 }
 
 void USBstream::GetBaselineData(std::vector<decoded_packet> *vec)
@@ -74,6 +147,7 @@ void USBstream::GetBaselineData(std::vector<decoded_packet> *vec)
   sortedpackets.clear();
 
   unix_time_hi = unix_time_lo = 0;
+  got_unix_time_hi = false;
 }
 
 // Appends all decoded data to 'vec' up to the next change of Unix time stamp
@@ -89,11 +163,14 @@ bool USBstream::GetDecodedDataUpToNextUnixTimeStamp(
   }
 
   for( ; sortedpacketsptr != sortedpackets.end(); sortedpacketsptr++) {
-    vec.push_back(*sortedpacketsptr);
+    // Move the packet rather than copy it.  The emptied packet left behind
+    // is thrown away when the next file is decoded.
+    vec.push_back(decoded_packet());
+    vec.back().swap(*sortedpacketsptr);
 
-    if(sortedpacketsptr->hits.empty()) continue;
+    if(vec.back().hits.empty()) continue;
 
-    const uint32_t new_time = sortedpacketsptr->timeunix;
+    const uint32_t new_time = vec.back().timeunix;
 
     if(new_time > mytolutc) break;
   }
@@ -104,7 +181,7 @@ bool USBstream::GetDecodedDataUpToNextUnixTimeStamp(
     return false;
   }
 
-  mytolutc = sortedpacketsptr->timeunix;
+  mytolutc = vec.back().timeunix;
 
   log_msg(LOG_NOTICE, "Sent decoded data up to Unix time stamp %lu for "
     "USB %d\n", mytolutc, myusb);
@@ -114,28 +191,93 @@ bool USBstream::GetDecodedDataUpToNextUnixTimeStamp(
   return true;
 }
 
+bool USBstream::SaveState(FILE * f)
+{
+  const std::vector<decoded_packet> leftover(sortedpacketsptr,
+                                             sortedpackets.end());
+
+  if(!ckpt_write_u32(f, myusb) ||
+     !ckpt_write_u32(f, mytolutc) ||
+     !ckpt_write_u32(f, unix_time_hi) ||
+     !ckpt_write_u32(f, unix_time_lo) ||
+     !ckpt_write_u32(f, got_unix_time_hi) ||
+     !ckpt_write_packets(f, leftover) ||
+     !ckpt_write_u32(f, raw16bitdata.size()))
+    return false;
+
+  for(unsigned int i = 0; i < raw16bitdata.size(); i++)
+    if(!ckpt_write_u32(f, raw16bitdata[i])) return false;
+
+  return true;
+}
+
+bool USBstream::RestoreState(FILE * f)
+{
+  uint32_t usb, time_hi, time_lo, pending, nraw;
+  if(!ckpt_read_u32(f, usb) ||
+     !ckpt_read_u32(f, mytolutc) ||
+     !ckpt_read_u32(f, time_hi) ||
+     !ckpt_read_u32(f, time_lo) ||
+     !ckpt_read_u32(f, pending) ||
+     !ckpt_read_packets(f, sortedpackets) ||
+     !ckpt_read_u32(f, nraw))
+    return false;
+
+  if((int)usb != myusb){
+    log_msg(LOG_ERR, "Checkpoint has USB %u where config has USB %d\n",
+            usb, myusb);
+    return false;
+  }
+
+  unix_time_hi = time_hi;
+  unix_time_lo = time_lo;
+  got_unix_time_hi = pending;
+  sortedpacketsptr = sortedpackets.begin();
+
+  raw16bitdata.clear();
+  for(unsigned int i = 0; i < nraw; i++){
+    uint32_t word;
+    if(!ckpt_read_u32(f, word)) return false;
+    raw16bitdata.push_back(word);
+  }
+
+  return true;
+}
+
 int USBstream::LoadFile(const std::string & nextfile)
 {
   std::ostringstream smyfilename;
   smyfilename << nextfile << "_" << GetUSB();
-  myfilename = smyfilename.str();
+  return OpenFile(smyfilename.str());
+}
+
+int USBstream::OpenFile(const std::string & filename)
+{
+  myfilename = filename;
 
   struct stat myfileinfo;
   if(myFile == NULL || !myFile->is_open()) {
     myFile = new std::fstream(myfilename.c_str(),
                               std::fstream::in | std::fstream::binary);
     if(myFile == NULL || myFile->is_open()) {
+      // An empty file from the DAQ means it has died, but an archived file
+      // of data received with -a is empty for a second with no data
+      const size_t n = myfilename.size();
+      const bool archived = is_compressed_name(myfilename) ||
+        (n > 5 && myfilename.compare(n - 5, 5, ".done") == 0);
       if(stat(myfilename.c_str(), &myfileinfo) == 0 &&
-         myfileinfo.st_size)
+         (myfileinfo.st_size || archived))
         return 1;
       myFile->close();
       delete myFile;
+      myFile = NULL;
       log_msg(LOG_ERR, "USB %d has died. Exiting.\n", myusb);
       return -1;
     }
     else {
       log_msg(LOG_ERR, "Could not open %s\n", myfilename.c_str());
       delete myFile;
+      myFile = NULL;
       return -1;
     }
   }
@@ -145,8 +287,194 @@ int USBstream::LoadFile(const std::string & nextfile)
   return 0;
 }
 
-void USBstream::decodefile()
+// Gets ready to decode a new file or chunk of a live stream
+void USBstream::begin_chunk()
 {
+  // Throw out what has already been passed on up
+  if(sortedpacketsptr <= sortedpackets.end())
+    erase_front_packets(sortedpackets,
+                        sortedpacketsptr - sortedpackets.begin());
+
+  filecounts = corruption_counts();
+  corruption_messages = 0;
+  chunkdaq = daq_word_counts();
+}
+
+// Restarts the decoding of bytes into 24-bit words, as at the start of a
+// file.  A Unix time stamp whose high half has been read carries on to the
+// next file, as it does from one chunk of a stream to the next, so that
+// files split from a stream decode the same as the stream.
+void USBstream::reset_byte_state()
+{
+  rawword = 0;
+  expcounter = 0;
+  resyncing = false;
+  c6words = 0;
+}
+
+// Logs what corruption there was in the file or chunk just decoded, and
+// makes the packets decoded available
+void USBstream::end_chunk()
+{
+  if(filecounts.any())
+    log_msg(LOG_WARNING, "Corruption in %s: skipped %lu bytes and %lu "
+      "words, %lu bad headers, %lu parity errors, %lu bad module numbers\n",
+      myfilename.c_str(), (unsigned long)filecounts.skipped_bytes,
+      (unsigned long)filecounts.skipped_words,
+      (unsigned long)filecounts.bad_headers,
+      (unsigned long)filecounts.parity_errors,
+      (unsigned long)filecounts.bad_modules);
+  totalcounts.add(filecounts);
+
+  // Until the first Unix time stamp is found, everything decoded will be
+  // decoded again, so don't count the DAQ's reports twice
+  if(mytolutc == 0) chunkdaq = daq_word_counts();
+  totaldaq.add(chunkdaq);
+
+  sortedpacketsptr = sortedpackets.begin();
+}
+
+/*
+  Decodes 'len' raw bytes, continuing from where the last call left off.
+  Returns true, having stopped, if the first Unix time stamp was just found,
+  in which case everything up to here has to be decoded again, this time
+  with the time known.
+
+  Undocumented input file format is revealed by inspection to be
+  constructed like this:
+
+  0                   1                   2                   3
+  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ |0 0|     A     |0 1|      B    |1 0|     C     |1 1|     D     |
+ +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+
+ Where the bits of A, B, C, and D concatenated make the 24-bit words
+ described in Matt Toups' thesis.
+*/
+bool USBstream::decode_bytes(const char * data, const unsigned int len)
+{
+  for(unsigned int bytedex = 0; bytedex < len; bytedex++){
+    const char counter = (data[bytedex] >> 6) & 3;
+    const char payload = data[bytedex] & 0x3f;
+    if(counter == 0){
+      resyncing = false;
+      expcounter = 1;
+      rawword = payload;
+    }
+    else if(counter == expcounter){
+      rawword = (rawword << 6) | payload;
+      if(++expcounter == 4){
+        expcounter = 0;
+
+        if(raw24bit_to_raw16bit(rawword)) return true;
+      }
+    }
+    else if(resyncing){
+      filecounts.skipped_bytes++;
+    }
+    else{
+      if(ShouldLogCorruption())
+        log_msg(LOG_WARNING, "Found corrupted data in %s: "
+          "expected %d, got %d\n", myfilename.c_str(), expcounter, counter);
+
+      // Drop the partial word and everything up to the start of the next
+      filecounts.skipped_bytes += expcounter + 1;
+      resyncing = true;
+      expcounter = 0;
+    }
+  }
+  return false;
+}
+
+// Decodes the file from its packets in cache file 'cachename', if there is
+// one for 'key'.  Returns false, having done nothing, if not.
+bool USBstream::replay_cached(const std::string & cachename,
+                              const uint64_t key)
+{
+  PacketCacheReader reader;
+  if(!reader.Open(cachename, key)) return false;
+
+  const packet_cache_summary & summary = reader.GetSummary();
+
+  begin_chunk();
+  reset_byte_state();
+  filecounts = summary.counts;
+  chunkdaq = summary.daq;
+  if(mytolutc == 0) mytolutc = summary.tolutc;
+
+  while(true){
+    decoded_packet packet;
+    bool parity_ok;
+    NewHits(packet.hits);
+    if(!reader.Next(packet, parity_ok)) break;
+    add_decoded_packet(packet, parity_ok);
+  }
+
+  reader.GetLeftover(raw16bitdata);
+  unix_time_hi = summary.unix_time_hi;
+  unix_time_lo = summary.unix_time_lo;
+  got_unix_time_hi = summary.pending_time_hi;
+
+  end_chunk();
+  return true;
+}
+
+bool USBstream::decodefile()
+{
+  if(!myFile->is_open()) log_msg(LOG_CRIT, "File not open! Exiting.\n");
+
+  struct stat fileinfo;
+  if(stat(myfilename.c_str(), &fileinfo) == -1){
+    log_msg(LOG_ERR, "File %s stopped being readable!\n", myfilename.c_str());
+    begin_chunk(); // as for an empty file
+    end_chunk();
+    myFile->close();
+    delete myFile;
+    myFile = NULL;
+    return false;
+  }
+
+  // With a cache, replay the file from it if it has been decoded before in
+  // the same state, or otherwise collect what is decoded for next time
+  std::string cachename;
+  uint64_t cachekey = 0;
+  PacketCacheWriter writer;
+  const bool stamped = mytolutc != 0;
+  const bool pending = got_unix_time_hi;
+  if(cachedir != ""){
+    const size_t slash = myfilename.rfind('/');
+    cachename = cachedir + "/" + (slash == std::string::npos? myfilename:
+                                  myfilename.substr(slash + 1)) + ".pc";
+    cachekey = packet_cache_key(myfilename, fileinfo, raw16bitdata,
+                                unix_time_hi, unix_time_lo, pending,
+                                stamped);
+    if(replay_cached(cachename, cachekey)){
+      myFile->close();
+      delete myFile;
+      myFile = NULL;
+      return true;
+    }
+    cachewriter = &writer;
+  }
+
+  // Compressed files are decoded from memory, as their blocks come out of
+  // the threads decompressing them
+  CompressedFile packed;
+  packed.SetWorkers(workers, workerclient);
+  const bool compressed = is_compressed_name(myfilename);
+  if(compressed && !packed.Open(myfilename)){
+    log_msg(LOG_ERR, "Could not read compressed file %s\n",
+            myfilename.c_str());
+    begin_chunk(); // as for an empty file
+    end_chunk();
+    myFile->close();
+    delete myFile;
+    myFile = NULL;
+    return false;
+  }
+  const unsigned int filesize = compressed? packed.Size(): fileinfo.st_size;
+
   top: // we return here if triggered by restart leading from finding
        // the first Unix timestamp packet, which means we have to go
        // back and assign the time to each hit that came before that packet.
@@ -155,77 +483,94 @@ void USBstream::decodefile()
 
   char filedata[BUFSIZE];//data buffer
 
-  if(!myFile->is_open()) log_msg(LOG_CRIT, "File not open! Exiting.\n");
-
-  // Throw out what has already been passed on up
-  if(sortedpacketsptr <= sortedpackets.end())
-    sortedpackets.assign(sortedpacketsptr, sortedpackets.end());
+  begin_chunk();
+  reset_byte_state();
+  got_unix_time_hi = pending;
 
-  got_unix_time_hi = false;
-
-  struct stat fileinfo;
-  if(stat(myfilename.c_str(), &fileinfo) == -1)
-    log_msg(LOG_CRIT, "File %s stopped being readable!\n", myfilename.c_str());
-
-  unsigned int bytesleft = fileinfo.st_size;
+  unsigned int bytesleft = filesize;
   unsigned int bytestoread = 0;
-
-  uint32_t word = 0; // holds 24-bit word being built, must be unsigned
-  char expcounter = 0; // expecting this counter next
+  bool damaged = false;
 
   do{
     bytestoread = std::min(BUFSIZE, bytesleft);
     bytesleft -= bytestoread;
 
-    myFile->read(filedata, bytestoread);
-
-    /*
-      Undocumented input file format is revealed by inspection to be
-      constructed like this:
-
-      0                   1                   2                   3
-      0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
-     +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-     |0 0|     A     |0 1|      B    |1 0|     C     |1 1|     D     |
-     +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-
-     Where the bits of A, B, C, and D concatenated make the 24-bit words
-     described in Matt Toups' thesis.
-   */
+    const char * data = filedata;
+    if(!compressed) myFile->read(filedata, bytestoread);
+    else if((data = packed.Data(filesize - bytesleft)) != NULL)
+      data += filesize - bytesleft - bytestoread;
+    else{
+      log_msg(LOG_ERR, "Compressed file %s is damaged\n",
+              myfilename.c_str());
+      raw16bitdata.clear(); // the rest of the packet is lost
+      damaged = true;
+      break;
+    }
 
-    for(unsigned int bytedex = 0; bytedex < bytestoread; bytedex++){
-      const char counter = (filedata[bytedex] >> 6) & 3;
-      const char payload = filedata[bytedex] & 0x3f;
-      if(counter == 0){
-        expcounter = 1;
-        word = payload;
-      }
-      else if(counter == expcounter){
-        word = (word << 6) | payload;
-        if(++expcounter == 4){
-          expcounter = 0;
-
-          if(raw24bit_to_raw16bit(word)) { //24-bit word stored, process it
-            sortedpackets.clear();
-            raw16bitdata.clear();
-            myFile->seekg(std::ios::beg);
-            goto top;
-          }
-        }
-      }
-      else{
-        log_msg(LOG_WARNING, "Found corrupted data in file %s: "
-          "expected %d, got %d\n", myfilename.c_str(), expcounter, counter);
-        expcounter = 0;
-      }
+    if(decode_bytes(data, bytestoread)){
+      sortedpackets.clear();
+      raw16bitdata.clear();
+      if(cachewriter != NULL) cachewriter->Clear();
+      myFile->seekg(std::ios::beg);
+      goto top;
     }
   }while(bytestoread != bytesleft);
 
+  // A damaged file is not cached, so that it is read again next time
+  if(damaged) cachewriter = NULL;
+
+  if(cachewriter != NULL){
+    packet_cache_summary summary;
+    summary.counts.skipped_bytes = filecounts.skipped_bytes;
+    summary.counts.skipped_words = filecounts.skipped_words;
+    summary.counts.bad_headers   = filecounts.bad_headers;
+    summary.daq = chunkdaq;
+    if(!stamped) summary.tolutc = mytolutc;
+    summary.unix_time_hi = unix_time_hi;
+    summary.unix_time_lo = unix_time_lo;
+    summary.pending_time_hi = got_unix_time_hi;
+    writer.Commit(cachename, cachekey, summary, raw16bitdata);
+    cachewriter = NULL;
+  }
+
+  end_chunk();
+
   if(myFile->is_open()) myFile->close();
   delete myFile;
   myFile = NULL;
+  return !damaged;
+}
 
-  sortedpacketsptr = sortedpackets.begin();
+void USBstream::decodestream(const std::string & name, const char * data,
+                             const unsigned int len)
+{
+  myfilename = name;
+  begin_chunk();
+
+  // Where this chunk starts, to decode it again once the first Unix time
+  // stamp is found in it.  As with decodefile(), only this chunk is, since
+  // what earlier chunks held has already been handed out without the time.
+  const uint32_t word = rawword;
+  const char counter = expcounter;
+  const bool skipping = resyncing;
+  const unsigned int reportwords = c6words;
+  const bool pending = got_unix_time_hi;
+
+  if(decode_bytes(data, len)){
+    sortedpackets.clear();
+    raw16bitdata.clear();
+    filecounts = corruption_counts();
+    corruption_messages = 0;
+    chunkdaq = daq_word_counts();
+    rawword = word;
+    expcounter = counter;
+    resyncing = skipping;
+    c6words = reportwords;
+    got_unix_time_hi = pending;
+    decode_bytes(data, len);
+  }
+
+  end_chunk();
 }
 
 /* This would be better named "process_word()". Returns true if we need
@@ -237,7 +582,12 @@ bool USBstream::raw24bit_to_raw16bit(uint32_t in24bitword)
   // undocumented in Matt Toups' thesis that start with values other
   // than 11b, but we just ignore them.
   if(((in24bitword >> 22) & 3) == 3) {
-    if(handle_unix_time_words(in24bitword)) return true;
+    if(handle_control_words(in24bitword)) return true;
+
+    // Control words between packets, like the Unix time stamps, aren't
+    // part of any packet, so don't make the decoder skip over them.
+    const bool control = ((in24bitword >> 16) & 0xff) != 0xc0;
+    if(control && raw16bitdata.empty()) return false;
 
     raw16bitdata.push_back(in24bitword & 0xffff);
     raw16bit_to_packets();
@@ -245,26 +595,31 @@ bool USBstream::raw24bit_to_raw16bit(uint32_t in24bitword)
   return false;
 }
 
-// Return true if the hits in this module packet satisfy the cuts
-bool USBstream::ThresholdCut(const bool * const allhits,
-                             const bool * const threshits)
+// Returns whether to log another message about corruption in the file being
+// decoded.  Only the first few are logged, and then a summary at the end of
+// the file, so that a badly damaged file can't flood the logs.
+bool USBstream::ShouldLogCorruption()
 {
-  for(int i = 0; i < 32; i++) {
-    // If this strip and an overlapping strip are over threshold
-    if(BothLayerThresh &&
-       threshits[i] && (threshits[adj1[i]] || threshits[adj2[i]]))
-      return true;
+  const unsigned int max_messages = 10;
 
-    // If this strip is hit and an overlapping strip is over threshold
-    // or an overlapping strip is over threshold and this channel is hit
-    if(!BothLayerThresh &&
-       ((allhits  [i] && (threshits[adj1[i]] || threshits[adj2[i]])) ||
-        (threshits[i] && (allhits  [adj1[i]] || allhits  [adj2[i]]))))
-      return true;
-  }
+  if(++corruption_messages < max_messages) return true;
+  if(corruption_messages == max_messages)
+    log_msg(LOG_WARNING, "Too much corruption in %s; no more messages about "
+            "it until the end of the file\n", myfilename.c_str());
   return false;
 }
 
+// Gives 'hits', which must be empty, a container that has been used before
+// if there is one, taking them from the pool a few at a time.
+void USBstream::NewHits(std::vector<decoded_hit> & hits)
+{
+  if(sparehits.empty() && hitpool != NULL) hitpool->Take(sparehits, 256);
+  if(sparehits.empty()) return;
+
+  hits.swap(sparehits.back());
+  sparehits.pop_back();
+}
+
 /* This function was called "check_data", but it is clearly not just
  * checking.  It is decoding. */
 void USBstream::raw16bit_to_packets()
@@ -286,75 +641,113 @@ void USBstream::raw16bit_to_packets()
 
   // Try to decode the data in 'data'. Stop trying if 'data' is empty, or
   // if it starts out right with 0xffff but has nothing else, or if it is
-  // shorter than the length it claims to have.  But otherwise, drop the
-  // first word and try to decode again.
+  // shorter than the length it claims to have.  Anything before the next
+  // 0xffff, or a 0xffff without a plausible length after it, is dropped.
   while(1) {
-    bool got_packet = false;
-
     if(raw16bitdata.empty()) break;
 
-    // First word of all packets other than unix timestamp packets is 0xffff
-    if(raw16bitdata[0] == 0xffff) {
-      if(raw16bitdata.size() < 2) break;
+    // Skip straight to the next possible header
+    if(raw16bitdata[0] != 0xffff) {
+      const std::deque<uint16_t>::iterator next =
+        std::find(raw16bitdata.begin(), raw16bitdata.end(), 0xffff);
+      filecounts.skipped_words += next - raw16bitdata.begin();
+      raw16bitdata.erase(raw16bitdata.begin(), next);
+      continue;
+    }
 
-      unsigned int len = raw16bitdata[ADC_WIDX_MODLEN] & 0xff;
-      if(len == 0) continue;
+    // Now at 0xffff, the first word of all packets other than Unix time stamps
+    if(raw16bitdata.size() < 2) break;
 
-      // we don't have all the data in this packet yet
-      if(raw16bitdata.size() < len + 1) break;
+    // Too short to hold the clock counter, so not really a header
+    unsigned int len = raw16bitdata[ADC_WIDX_MODLEN] & 0xff;
+    if(len < ADC_WIDX_HIT) {
+      filecounts.bad_headers++;
+      filecounts.skipped_words++;
+      raw16bitdata.pop_front();
+      continue;
+    }
 
-      got_packet = true;
+    // we don't have all the data in this packet yet
+    if(raw16bitdata.size() < len + 1) break;
 
-      unsigned int parity = 0;
-      decoded_packet packet;
-      packet.timeunix = ((uint32_t)unix_time_hi << 16) + unix_time_lo;
-      packet.module = (raw16bitdata[ADC_WIDX_MODLEN] >> 8) & 0x7f;
-      if(packet.module > 63)
-        log_msg(LOG_ERR, "Invalid module number %u\n", packet.module);
-      packet.isadc = raw16bitdata[ADC_WIDX_MODLEN] >> 15;
-      bool allhits  [64] = {0}; // which channels were hit
-      bool threshits[64] = {0}; // which channels were hit over threshold
+    // Parse the packet as it is, with raw charges and clock count, leaving
+    // everything that depends on the config to add_decoded_packet()
+    unsigned int parity = 0;
+    decoded_packet packet;
+    NewHits(packet.hits);
+    packet.timeunix = ((uint32_t)unix_time_hi << 16) + unix_time_lo;
+    packet.module = (raw16bitdata[ADC_WIDX_MODLEN] >> 8) & 0x7f;
+    packet.isadc = raw16bitdata[ADC_WIDX_MODLEN] >> 15;
 
-      for(unsigned int wordi = ADC_WIDX_MODLEN; wordi < len; wordi++){
-        parity ^= raw16bitdata[wordi];
+    for(unsigned int wordi = ADC_WIDX_MODLEN; wordi < len; wordi++){
+      parity ^= raw16bitdata[wordi];
 
-        if(wordi == ADC_WIDX_CLKHI) {
-          packet.time16ns |= (raw16bitdata[wordi] << 16);
-        }
-        else if(wordi == ADC_WIDX_CLKLO) {
-          packet.time16ns |= raw16bitdata[wordi];
-          packet.time16ns -= offset[packet.module];
-        }
-        else if(packet.isadc) { // we are in the words that give the hit info
-          // hits start on even numbered words
-          if(wordi%2 == 0 && raw16bitdata[wordi+1] < 64 && packet.module < 64) {
-            decoded_hit hit;
-            hit.channel = raw16bitdata[wordi+1];
-            hit.charge  = raw16bitdata[wordi] - baseline[packet.module][hit.channel];
-            packet.hits.push_back(hit);
-
-            allhits[hit.channel] = true;
-            if(hit.charge > mythresh) threshits[hit.channel] = true;
-          }
+      if(wordi == ADC_WIDX_CLKHI) {
+        packet.time16ns |= (raw16bitdata[wordi] << 16);
+      }
+      else if(wordi == ADC_WIDX_CLKLO) {
+        packet.time16ns |= raw16bitdata[wordi];
+      }
+      else if(packet.isadc) { // we are in the words that give the hit info
+        // hits start on even numbered words
+        if(wordi%2 == 0 && raw16bitdata[wordi+1] < 64) {
+          decoded_hit hit;
+          hit.channel = raw16bitdata[wordi+1];
+          hit.charge  = raw16bitdata[wordi];
+          packet.hits.push_back(hit);
         }
       }
+    }
 
-      if(parity != raw16bitdata[len])
-        log_msg(LOG_WARNING, "Parity error in USB stream %d\n", myusb);
+    const bool parity_ok = parity == raw16bitdata[len];
+    if(cachewriter != NULL) cachewriter->Add(packet, parity_ok);
+    add_decoded_packet(packet, parity_ok);
 
-      if(!UseThresh || !packet.isadc || ThresholdCut(allhits, threshits)){
-        // Slot this packet into place in time order, searching from the end
-        std::vector<decoded_packet>::iterator i = sortedpackets.end();
-        while(i != sortedpackets.begin() && LessThan(packet, *(i-1), 0))
-          i--;
-        sortedpackets.insert(i, packet);
-      }
+    //delete the data that we've decoded into 'packet'
+    raw16bitdata.erase(raw16bitdata.begin(), raw16bitdata.begin()+len+1);
+  }
+}
 
-      //delete the data that we've decoded into 'packet'
-      raw16bitdata.erase(raw16bitdata.begin(), raw16bitdata.begin()+len+1);
-    }
+// Does everything to a packet just parsed, with raw charges and clock count,
+// that depends on the config: throws out the hits of modules not in it,
+// applies the timing offset and baselines, fills the monitoring histograms,
+// applies the threshold and slots the packet into time order.
+void USBstream::add_decoded_packet(decoded_packet & packet,
+                                   const bool parity_ok)
+{
+  const bool known_module = packet.module < nummodules;
+  if(!known_module){
+    filecounts.bad_modules++;
+    if(ShouldLogCorruption())
+      log_msg(LOG_ERR, "Invalid module number %u\n", packet.module);
+    packet.hits.clear();
+  }
+  else{
+    packet.time16ns -= offset[packet.module];
+  }
+
+  for(unsigned int i = 0; i < packet.hits.size(); i++){
+    decoded_hit & hit = packet.hits[i];
+    hit.charge = (uint16_t)hit.charge - baseline[packet.module*64 + hit.channel];
+    if(monitor) monitor->Hit(packet.module, hit.channel, hit.charge);
+  }
+
+  packet.timekey =
+    make_time_key(*timekeyref, packet.timeunix, packet.time16ns);
+
+  if(!parity_ok){
+    filecounts.parity_errors++;
+    if(ShouldLogCorruption())
+      log_msg(LOG_WARNING, "Parity error in USB stream %d\n", myusb);
+  }
 
-    if(!got_packet) raw16bitdata.pop_front();
+  if(cut.Passes(packet)){
+    // Slot this packet into place in time order, searching from the end
+    sortedpackets.push_back(decoded_packet());
+    sortedpackets.back().swap(packet);
+    for(unsigned int i = sortedpackets.size() - 1;
+        i > 0 && LessThan(sortedpackets[i], sortedpackets[i-1], 0); i--)
+      sortedpackets[i].swap(sortedpackets[i-1]);
   }
 }
 
@@ -363,7 +756,8 @@ void USBstream::raw16bit_to_packets()
   by its control code (bits 3-8), set the Unix time on this USB stream, which
   will be attached to hits from now on.  If we didn't know the time before,
   signal that we need to rewind to the beginning of the file so these time
-  can be set.  Returns true in this case, false otherwise.
+  can be set.  Returns true in this case, false otherwise.  If it is one of
+  the DAQ's counts of skipped, received or lost words, count it.
 
   This function was named "check_debug". Here's the old top-of-function comment:
 
@@ -379,7 +773,7 @@ void USBstream::raw16bit_to_packets()
 
   These refer to the control bytes of DAQ packets.
 */
-bool USBstream::handle_unix_time_words(const uint32_t wordin)
+bool USBstream::handle_control_words(const uint32_t wordin)
 {
   const uint8_t control = (wordin >> 16) & 0xff;
   const uint16_t payload = wordin & 0xffff;
@@ -390,7 +784,23 @@ bool USBstream::handle_unix_time_words(const uint32_t wordin)
   // each, we end up doing nothing.
   //
   // For 0xc5, "skipped" and c6, "number of received data words", old
-  // code did some arithmetic and then discarded the result. Let's not.
+  // code did some arithmetic and then discarded the result.  We keep the
+  // counts, so that data lost by the DAQ can be told apart from the builder
+  // falling behind.  See daq_word_counts.  A 0xc6 report cut short by any
+  // other word is dropped.
+  if(control == 0xc6) {
+    c6payload[c6words++] = payload;
+    if(c6words == 4){
+      chunkdaq.received += ((uint32_t)c6payload[0] << 16) + c6payload[1];
+      chunkdaq.lost     += ((uint32_t)c6payload[2] << 16) + c6payload[3];
+      chunkdaq.reports++;
+      c6words = 0;
+    }
+    return false;
+  }
+  c6words = 0;
+
+  if(control == 0xc5) chunkdaq.skipped += payload;
 
   // Unix-timestamp-high-bits packet - see appendix B.2 of Matt
   // Toups' thesis.
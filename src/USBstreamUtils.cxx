@@ -5,9 +5,31 @@
 #include <syslog.h>
 
 #include <vector>
+#include <string>
 
-void log_msg(const int priority, const char * const format, ...)
+static __thread const char * LogTag = NULL;
+
+void set_log_tag(const char * const tag)
+{
+  LogTag = tag != NULL && tag[0] != '\0'? tag: NULL;
+}
+
+void log_msg(const int priority, const char * format, ...)
 {
+  // Put the tag in front, escaping any '%' in it, so it isn't taken as
+  // part of the format
+  std::string tagged;
+  if(LogTag != NULL){
+    tagged = "[";
+    for(const char * c = LogTag; *c != '\0'; c++){
+      if(*c == '%') tagged += '%';
+      tagged += *c;
+    }
+    tagged += "] ";
+    tagged += format;
+    format = tagged.c_str();
+  }
+
   va_list ap;
   va_start(ap, format);
   vprintf(format, ap);
@@ -31,21 +53,92 @@ void start_log()
   log_msg(LOG_NOTICE, "OV Event Builder Started\n");
 }
 
-/* Returns true if the packet 'lhs' is earlier in time than 'rhs' */
-bool LessThan(const decoded_packet & lhs,
-              const decoded_packet & rhs, const int ClockSlew)
+uint64_t make_time_key(uint64_t & reference, const uint32_t timeunix,
+                       const uint32_t time16ns)
 {
-  const int64_t dt_unix = (int64_t)lhs.timeunix - rhs.timeunix;
+  // Packets decoded before the first Unix time stamp have no sync period to
+  // go by.  Put them first, in counter order, as they always have been, and
+  // leave the reference to be set by a packet with a time stamp.
+  if(timeunix == 0) return time16ns;
+
+  const int64_t period = 1LL << SYNC_PULSE_CLK_COUNT_PERIOD_LOG2;
+
+  // When the counter was last reset, give or take the slop in the Unix time
+  // stamps, which is much less than a sync period
+  const int64_t reset = (int64_t)timeunix * CLK_COUNT_PER_SECOND - time16ns;
+
+  uint64_t ref = __atomic_load_n(&reference, __ATOMIC_ACQUIRE);
+  if(ref == 0){
+    // If another thread got there first, this loads its value into 'ref'
+    if(__atomic_compare_exchange_n(&reference, &ref, (uint64_t)reset,
+                                   false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      ref = reset;
+  }
+
+  // Round to the nearest whole number of sync periods from the reference
+  const int64_t d = reset - (int64_t)ref;
+  const int64_t n = d >= 0?  (d + period/2)/period
+                          : -((-d + period/2)/period);
+
+  return ref + n*period + time16ns;
+}
+
+void append_packets(std::vector<decoded_packet> & dst,
+                    std::vector<decoded_packet> & src)
+{
+  const unsigned int old = dst.size();
+  dst.resize(old + src.size());
+  for(unsigned int i = 0; i < src.size(); i++)
+    dst[old + i].swap(src[i]);
+  src.clear();
+}
+
+void erase_front_packets(std::vector<decoded_packet> & v, const unsigned int n)
+{
+  if(n == 0) return;
+  for(unsigned int i = n; i < v.size(); i++)
+    v[i - n].swap(v[i]);
+  v.resize(v.size() - n);
+}
+
+void calculate_pedestals(std::vector<int> & baseptr,
+                         const std::vector<decoded_packet> & BaselineData,
+                         const int numModules)
+{
+  const int numChannels = 64; // Number of channels in M64
+
+  std::vector<double> baseline(numModules*numChannels, 0);
+  std::vector<int> counter(numModules*numChannels, 0);
+
+  for(std::vector<decoded_packet>::const_iterator I = BaselineData.begin();
+      I != BaselineData.end();
+      I++) {
+
+    const int module = I->module;
+
+    if(!I->isadc) continue;
 
-  if(labs(dt_unix) > 1) return dt_unix < 0; // Timestamps are not adjacent
+    if(module >= numModules)
+      log_msg(LOG_CRIT, "Fatal Error: Module number requested "
+        "(%d) out of range (0-%d) in calculate pedestal\n", module, numModules-1);
 
-  const int64_t dt_16ns = (int64_t)lhs.time16ns - rhs.time16ns;
+    for(unsigned int i = 0; i < I->hits.size(); i++) {
+      const int charge = I->hits[i].charge;
+      const int channel = I->hits[i].channel;
+      if(channel >= numChannels)
+        log_msg(LOG_CRIT, "Fatal Error: Channel number requested "
+          "(%d) out of range (0-%d) in calculate pedestal\n",
+          channel, numChannels-1);
 
-  // Found comment "Was sync pulse 2sec (sqrd)"
-  // I do not understand what that means.  Is this supposed to be 0x2000 such
-  // that this indicates a clock overflow after missing a sync pulse?  That
-  // produces different results.
-  if(labs(dt_16ns) > 2000 * (1 << 16)) return dt_16ns > 0;
+      // Should these be modified to better handle large numbers of baseline
+      // triggers?
+      const int mc = module*numChannels + channel;
+      baseline[mc] = (baseline[mc]*counter[mc] + charge)/(counter[mc]+1);
+      counter[mc]++;
+    }
+  }
 
-  return dt_16ns < -ClockSlew;
+  baseptr.resize(numModules*numChannels);
+  for(int i = 0; i < numModules*numChannels; i++)
+    baseptr[i] = (int)baseline[i];
 }
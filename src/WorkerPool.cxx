@@ -0,0 +1,86 @@
+#include <pthread.h>
+
+#include <vector>
+
+#include "USBstreamUtils.h"
+#include "WorkerPool.h"
+
+WorkerPool::WorkerPool()
+{
+  slots = inuse = 0;
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&freed, NULL);
+}
+
+WorkerPool::~WorkerPool()
+{
+  pthread_cond_destroy(&freed);
+  pthread_mutex_destroy(&lock);
+}
+
+void WorkerPool::Init(const unsigned int nslots)
+{
+  pthread_mutex_lock(&lock);
+  slots = nslots;
+  pthread_mutex_unlock(&lock);
+}
+
+unsigned int WorkerPool::AddClient()
+{
+  pthread_mutex_lock(&lock);
+  const unsigned int client = held.size();
+  held.push_back(0);
+  waiting.push_back(0);
+  pthread_mutex_unlock(&lock);
+  return client;
+}
+
+// Max-min fairness: no other waiting client may hold fewer slots
+bool WorkerPool::MyTurn(const unsigned int client) const
+{
+  for(unsigned int c = 0; c < held.size(); c++)
+    if(waiting[c] && held[c] < held[client]) return false;
+  return true;
+}
+
+void WorkerPool::Acquire(const unsigned int client)
+{
+  if(!IsOn()) return;
+
+  pthread_mutex_lock(&lock);
+  waiting[client]++;
+  while(inuse >= slots || !MyTurn(client))
+    pthread_cond_wait(&freed, &lock);
+  waiting[client]--;
+  held[client]++;
+  inuse++;
+
+  // Taking this slot may have made it someone else's turn for another
+  if(inuse < slots) pthread_cond_broadcast(&freed);
+  pthread_mutex_unlock(&lock);
+}
+
+bool WorkerPool::TryAcquire(const unsigned int client)
+{
+  if(!IsOn()) return true;
+
+  pthread_mutex_lock(&lock);
+  const bool took = inuse < slots && MyTurn(client);
+  if(took){
+    held[client]++;
+    inuse++;
+  }
+  pthread_mutex_unlock(&lock);
+  return took;
+}
+
+void WorkerPool::Release(const unsigned int client)
+{
+  if(!IsOn()) return;
+
+  pthread_mutex_lock(&lock);
+  held[client]--;
+  inuse--;
+  pthread_cond_broadcast(&freed);
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,159 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "USBstream.h"
+#include "USBstreamUtils.h"
+#include "Merge.h"
+#include "EventEncoder.h"
+#include "MemoryBuilder.h"
+
+// Checks of the MemoryBuilder's push API on raw data made up here, with no
+// files.  Run by "make test".  Prints each failure and exits non-zero if
+// there were any.
+
+static const int serial = 1, board = 5;
+static const uint32_t stamp = 1506152660;
+
+static int failures = 0;
+
+static void check(const bool ok, const char * what)
+{
+  if(!ok){
+    printf("FAIL: %s\n", what);
+    failures++;
+  }
+}
+
+// A 24-bit word as the USB sends it: four bytes of six bits each, with a
+// two-bit counter on top
+static void put_word(std::string & out, const uint32_t w)
+{
+  for(int i = 0; i < 4; i++)
+    out += (char)((i << 6) | ((w >> (18 - 6*i)) & 0x3f));
+}
+
+static void put_time_stamp(std::string & out, const uint32_t t)
+{
+  put_word(out, (0xc8 << 16) | (t >> 16));
+  put_word(out, (0xc9 << 16) | (t & 0xffff));
+}
+
+// A module packet with one hit over threshold in each layer, on strips
+// that overlap
+static void put_packet(std::string & out, const uint32_t time16ns)
+{
+  std::vector<uint16_t> words;
+  words.push_back(0xffff);
+  words.push_back((1 << 15) | (board << 8) | 8);
+  words.push_back(time16ns >> 16);
+  words.push_back(time16ns & 0xffff);
+  words.push_back(500); words.push_back(3);
+  words.push_back(500); words.push_back(35);
+
+  uint16_t parity = 0;
+  for(unsigned int i = 1; i < words.size(); i++) parity ^= words[i];
+  words.push_back(parity);
+
+  for(unsigned int i = 0; i < words.size(); i++)
+    put_word(out, 0xc00000 | words[i]);
+}
+
+static void setup(MemoryBuilder & b)
+{
+  b.AddModule(serial, board, 200, 0);
+  b.SetBaselines(serial, std::vector<int>((board+1)*64, 0));
+}
+
+// The number of packets in each of the encoded 'events'
+static std::vector<int> packet_counts(const std::string & events)
+{
+  std::vector<int> counts;
+  size_t pos = 0;
+  while(pos + 8 <= events.size()){
+    const int npackets =
+      ((uint8_t)events[pos+2] << 8) | (uint8_t)events[pos+3];
+    counts.push_back(npackets);
+    pos += 8;
+    for(int i = 0; i < npackets && pos + 8 <= events.size(); i++)
+      pos += 8 + 4*(uint8_t)events[pos+1];
+  }
+  return counts;
+}
+
+// Data before the first Unix time stamp is handed out without the time.
+// Once the stamp turns up, only the chunk it is in is decoded again, so no
+// packet comes out twice.
+static void test_first_stamp_across_chunks()
+{
+  std::string first, second;
+  put_packet(first, 100);
+  put_time_stamp(second, stamp);
+  put_packet(second, 200);
+
+  MemoryBuilder b;
+  setup(b);
+  unsigned int n = 0;
+  b.Push(serial, first.data(), first.size());
+  n += b.Build();
+  b.Push(serial, second.data(), second.size());
+  n += b.Build();
+  n += b.Finish();
+
+  std::string events;
+  check(b.TakeEvents(events) == 2 && n == 2,
+        "two packets in two chunks around the first stamp give two events");
+  const std::vector<int> counts = packet_counts(events);
+  check(counts.size() == 2 && counts[0] == 1 && counts[1] == 1,
+        "each event around the first stamp has one packet");
+}
+
+// After the first stamp, where the data is cut between pushes, even inside
+// a word, doesn't change the events
+static void test_chunking()
+{
+  std::string data;
+  put_time_stamp(data, stamp);
+  for(uint32_t t = 0; t < 40; t++){
+    put_packet(data, 1000*t);
+    put_packet(data, 1000*t + 2); // same event as the one before
+    if(t % 10 == 9) put_time_stamp(data, stamp + t/10 + 1);
+  }
+
+  MemoryBuilder whole;
+  setup(whole);
+  whole.Push(serial, data.data(), data.size());
+  whole.Build();
+  whole.Finish();
+  std::string expected;
+  check(whole.TakeEvents(expected) == 40, "forty events in one push");
+
+  const size_t cuts[] = { 1, 3, 7, 64 };
+  for(unsigned int c = 0; c < sizeof cuts/sizeof cuts[0]; c++){
+    MemoryBuilder b;
+    setup(b);
+    // The stamp first, so that no packet is decoded before it
+    b.Push(serial, data.data(), 8);
+    for(size_t pos = 8; pos < data.size(); pos += cuts[c]){
+      b.Push(serial, data.data() + pos, std::min(cuts[c], data.size() - pos));
+      b.Build();
+    }
+    b.Finish();
+    std::string events;
+    b.TakeEvents(events);
+    check(events == expected, "pushing in pieces gives the same events");
+  }
+}
+
+int main()
+{
+  test_first_stamp_across_chunks();
+  test_chunking();
+
+  if(failures == 0) printf("MemoryBuilderTest: all passed\n");
+  return failures == 0? 0: 1;
+}